@@ -242,4 +242,622 @@ EOF
     
     # Clean up
     rm -f redir_test.txt redir_output.txt
-}
\ No newline at end of file
+}
+
+# Test tokenizer: quoted arguments keep their spaces
+@test "Parser: Quoted arguments" {
+    run ./dsh <<EOF
+echo "hello    world" 'single  quoted'
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"hello    world single  quoted"* ]]
+}
+
+# Test tokenizer: redirections and pipes without surrounding whitespace
+@test "Parser: Operators without spaces" {
+    rm -f parser_out.txt
+    run ./dsh <<EOF
+echo one>parser_out.txt
+echo two>>parser_out.txt
+cat<parser_out.txt|wc -l
+exit
+EOF
+    rm -f parser_out.txt
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"2"* ]]
+}
+
+# Test tokenizer: quoted operators are plain characters
+@test "Parser: Quoted pipe is not a pipe" {
+    run ./dsh <<EOF
+echo "a|b>c"
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"a|b>c"* ]]
+}
+
+# Test tokenizer: dangling redirection is a syntax error
+@test "Parser: Dangling redirection" {
+    run ./dsh <<EOF
+echo hi >
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"syntax error"* ]]
+}
+
+# Test arena: parsing stops allocating after the first line
+@test "Arena: Steady-state parsing does not allocate" {
+    run ./dsh <<EOF
+echo one | cat
+echo two three | wc -w
+ls > /dev/null
+memstat
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"arena: 4 lines, 1 heap allocations"* ]]
+}
+
+# Test dynamic limits: more stages and arguments than CMD_MAX
+@test "Limits: Long pipelines and argument lists" {
+    run ./dsh <<EOF
+echo a b c d e f g h i j k l m n o p q r s t | wc -w
+echo x | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"20"* ]]
+    [[ "$output" == *"x"* ]]
+    [[ "$output" != *"error"* ]]
+}
+
+# Test script mode: no prompts, comments skipped, continue on error
+@test "Script Mode: Runs a file without prompting" {
+    printf '# setup\necho one\nfalse\necho two\n' > script_test.dsh
+    run ./dsh -f script_test.dsh
+    rm -f script_test.dsh
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"one"* ]]
+    [[ "$output" == *"two"* ]]
+    [[ "$output" != *"dsh4>"* ]]
+}
+
+# Test script mode: -e stops at the first failure
+@test "Script Mode: Fail-fast stops at first error" {
+    printf 'echo one\nfalse\necho two\n' > script_test.dsh
+    run ./dsh -e -f script_test.dsh
+    rm -f script_test.dsh
+    [ "$status" -ne 0 ]
+    [[ "$output" == *"one"* ]]
+    [[ "$output" != *"two"* ]]
+}
+
+# Test script mode: piped input runs as a script unless DSH_PROMPT is set
+@test "Script Mode: Input that is not a terminal runs without prompts" {
+    run env -u DSH_PROMPT ./dsh <<EOF
+echo one
+echo two
+EOF
+    [ "$status" -eq 0 ]
+    [ "$output" = "$(printf 'one\ntwo')" ]
+
+    run env DSH_PROMPT=1 ./dsh <<EOF
+echo one
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"one"* ]]
+    [[ "$output" == *"local mode"*"dsh4>"*"cmd loop returned 0"* ]]
+}
+
+# Test path cache: commands are cached and a new binary earlier on PATH wins
+@test "Path Cache: Invalidated when a PATH directory changes" {
+    rm -rf path_test_bin
+    mkdir path_test_bin
+    printf '#!/bin/sh\necho shadowed\n' > path_test_shadow
+    chmod +x path_test_shadow
+    run env PATH="$PWD/path_test_bin:/usr/bin:/bin" ./dsh <<EOF
+uname
+hash
+cp path_test_shadow path_test_bin/uname
+uname
+hash -r
+hash
+exit
+EOF
+    rm -rf path_test_bin path_test_shadow
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"/usr/bin/uname"* ]] || [[ "$output" == *"/bin/uname"* ]]
+    [[ "$output" == *"shadowed"* ]]
+    [[ "$output" == *"hash table empty"* ]]
+}
+
+# Test launcher: redirections apply on any pipeline stage
+@test "Launcher: Redirection inside a pipeline and bad target reporting" {
+    rm -f launch_test.out
+    run ./dsh <<EOF
+echo alpha | tr a-z A-Z > launch_test.out
+cat < launch_test.out | tr A-Z a-z
+echo x > /nonexistent_dir/out
+exit
+EOF
+    rm -f launch_test.out
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"alpha"* ]]
+    [[ "$output" == *"open output file: /nonexistent_dir/out"* ]]
+}
+
+# Test pipe wiring: a middle stage inherits no pipe ends besides its own
+@test "Pipes: Pipeline stages only inherit their own ends" {
+    run ./dsh <<EOF
+ls /proc/self/fd | wc -l
+echo x | echo y | ls /proc/self/fd | cat | cat | wc -l
+exit
+EOF
+    [ "$status" -eq 0 ]
+    counts=($(echo "$output" | grep -oE '^[[:space:]]*[0-9]+$|dsh4> *[0-9]+' | grep -oE '[0-9]+$'))
+    [ "${#counts[@]}" -eq 2 ]
+    [ "${counts[0]}" -eq "${counts[1]}" ]
+}
+
+# Test in-process built-ins: output, redirection and pipelines
+@test "Built-ins: echo, printf and pwd run in-process and in pipelines" {
+    rm -f builtin_test.out
+    run ./dsh <<EOF
+printf "%s=%03d\\n" a 7 b 42 > builtin_test.out
+echo tail >> builtin_test.out
+cat builtin_test.out
+echo piped | tr a-z A-Z
+pwd | cat
+true | false
+exit
+EOF
+    rm -f builtin_test.out
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"a=007"*"b=042"*"tail"* ]]
+    [[ "$output" == *"PIPED"* ]]
+    [[ "$output" == *"$PWD"* ]]
+    [[ "$output" == *"error: command execution failed"* ]]
+}
+
+# Test built-in registry: one table serves both shells with per-scope entries
+@test "Built-in Registry: Remote built-ins answer the client, stop-server is remote-only" {
+    ./dsh -s -p 7782 &
+    server_pid=$!
+    sleep 1
+
+    output=$(echo -e "dragon | tr a-z A-Z\nhash\nexit" | timeout 5 ./dsh -c -p 7782 || true)
+
+    kill $server_pid 2>/dev/null || true
+    wait $server_pid 2>/dev/null || true
+
+    [[ "$output" == *"HERE BE DRAGONS!"* ]]
+    [[ "$output" == *"hash table empty"* ]] || [[ "$output" == *"hits"* ]]
+
+    run ./dsh <<EOF
+stop-server
+exit
+EOF
+    [[ "$output" == *"stop-server: No such file or directory"* ]]
+}
+
+# Test background jobs: independent commands overlap and wait collects them
+@test "Jobs: Background commands run concurrently and wait collects them" {
+    printf 'sleep 1 &\nsleep 1 &\nsleep 1 | cat &\njobs\nwait\necho all done\n' > jobs_test.dsh
+    start=$(date +%s%N)
+    run ./dsh -f jobs_test.dsh
+    elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    rm -f jobs_test.dsh
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"[3]+  Running"*"sleep 1 | cat &"* ]]
+    [[ "$output" == *"all done"* ]]
+    [ "$elapsed_ms" -lt 2500 ]
+}
+
+# Test job control built-ins: fg returns the job's status, notices before the prompt
+@test "Jobs: fg and completion notices" {
+    run ./dsh <<EOF
+sleep 0.2 | false &
+fg
+sleep 0.1 &
+sleep 0.5
+echo after
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"sleep 0.2 | false"*"error: command execution failed"* ]]
+    [[ "$output" == *"[1]+  Done                    sleep 0.1"* ]]
+
+    # Background jobs honour pipefail, and their notice precedes later output
+    run bash -c "set -o pipefail; printf 'false | sleep 0.1 &\\necho after\\nwait %%1\\necho continued\\n' | ./dsh -e -f - | cat"
+    [ "$status" -ne 0 ]
+    [[ "$output" == "[1] "*"after"* ]]
+    [[ "$output" != *"continued"* ]]
+}
+
+# Test that a background built-in never runs on the shell's thread
+@test "Jobs: Background built-ins leave the prompt free" {
+    start=$(date +%s%N)
+    run timeout 5 ./dsh -f - <<EOF
+parallel sleep ::: 2 &
+echo next
+EOF
+    elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    [ "$status" -eq 0 ]
+    [[ "$output" == "[1]"*"next"* ]]
+    [[ "$output" != *"Done"* ]]
+    [ "$elapsed_ms" -lt 1500 ]
+
+    run timeout 5 ./dsh -f - <<EOF
+wait &
+echo next
+EOF
+    [ "$status" -ne 124 ]
+    [[ "$output" == *"next"* ]]
+}
+
+# Test parallel: bounded pool, ordered grouped output and failure count
+@test "Parallel: Runs instances concurrently with grouped output" {
+    start=$(date +%s%N)
+    run ./dsh <<EOF
+parallel -j 4 sleep ::: 0.5 0.5 0.5 0.5
+parallel -k -j 3 printf "<%s>\\\\n" ::: a b c d
+parallel -j 2 ls {}/missing ::: /nonexistent_a /nonexistent_b
+exit
+EOF
+    elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    [ "$status" -eq 0 ]
+    [ "$elapsed_ms" -lt 1500 ]
+    [[ "$output" == *"<a>"*"<b>"*"<c>"*"<d>"* ]]
+    [[ "$output" == *"/nonexistent_a/missing"* ]]
+    [[ "$output" == *"/nonexistent_b/missing"* ]]
+    [[ "$output" == *"error: command execution failed"* ]]
+
+    # -k behind one slow instance must not run out of descriptors
+    vals=$(seq 2 400 | tr '\n' ' ')
+    run bash -c "ulimit -n 128; echo \"parallel -k -j 2 sh -c 'case {} in slow) sleep 0.5;; esac; echo {}' ::: slow $vals\" | ./dsh -f -"
+    [ "$status" -eq 0 ]
+    [[ "$output" == "slow"$'\n'"2"$'\n'* ]]
+    [ "$(wc -l <<< "$output")" -eq 400 ]
+    [[ "$output" != *"memfd_create"* ]]
+}
+
+# Test the zero-copy cat built-in across file, pipe and redirection paths
+@test "Cat: Copies files, pipes and redirections in-process" {
+    head -c 300000 /dev/urandom > cat_src.bin
+    run ./dsh <<EOF
+cat cat_src.bin > cat_a.bin
+cat < cat_src.bin | cat > cat_b.bin
+echo head | cat - cat_src.bin | wc -c
+cat cat_src.bin | head -c 5 | wc -c
+cat missing_file
+cat cat_a.bin >> cat_a.bin
+exit
+EOF
+    cmp cat_src.bin cat_a.bin
+    cmp_a=$?
+    cmp cat_src.bin cat_b.bin
+    cmp_b=$?
+    rm -f cat_src.bin cat_a.bin cat_b.bin
+    [ "$status" -eq 0 ]
+    [ "$cmp_a" -eq 0 ]
+    [ "$cmp_b" -eq 0 ]
+    [[ "$output" == *"300005"* ]]
+    [[ "$output" == *"cat: missing_file: No such file or directory"* ]]
+    [[ "$output" == *"cat: cat_a.bin: input file is output file"* ]]
+}
+
+# Test set pipesize: the kernel's rounded size is kept and pipelines still flow
+@test "Set: pipesize applies to pipelines and rejects bad sizes" {
+    run ./dsh <<EOF
+set pipesize=100
+set
+set pipesize=1M
+head -c 3000000 /dev/zero | cat | wc -c
+set pipesize=lots
+set pipesize=0
+set
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"pipesize=4096"* ]]
+    [[ "$output" == *"3000000"* ]]
+    [[ "$output" == *"set: lots: invalid size"* ]]
+    [[ "$output" == *"pipesize=default"* ]]
+}
+
+# Test time: per-stage rusage summary with the slowest stage starred
+@test "Time: Reports each pipeline stage and the shell's overhead" {
+    run ./dsh <<EOF
+time sleep 0.3 | echo piped
+set stats=on
+uname
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"piped"* ]]
+    [[ "$output" =~ "1*        0.3"[0-9]+"s".*"sleep 0.3" ]]
+    [[ "$output" == *"builtin  echo piped"* ]]
+    [[ "$output" == *"total"*"parse"*"spawn"* ]]
+    [[ "$output" =~ "1         0."[0-9]+"s".*"uname" ]]
+}
+
+# Test pipeline teardown: an idle upstream stage is stopped once the consumer exits
+@test "Pipeline: Tears down upstream stages and honours pipefail" {
+    start=$(date +%s%N)
+    run ./dsh <<EOF
+sleep 5 | head -c 0 /dev/null
+yes | head -1
+set pipefail=off
+false | echo lenient
+set pipefail=on
+false | echo strict
+exit
+EOF
+    elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    [ "$status" -eq 0 ]
+    [ "$elapsed_ms" -lt 2000 ]
+    [[ "$output" == *"lenient"*"strict"* ]]
+    # Only the pipefail=on line fails
+    [ "$(grep -c 'error: command execution failed' <<< "$output")" -eq 1 ]
+
+    # A lone command killed by a signal fails the same way, SIGPIPE aside
+    run ./dsh -e -f - <<EOF
+sh -c 'kill -PIPE \$\$'
+echo survived
+sh -c 'kill -TERM \$\$'
+echo continued
+EOF
+    [ "$status" -ne 0 ]
+    [[ "$output" == *"survived"* ]]
+    [[ "$output" != *"continued"* ]]
+}
+
+# Test -z: commands launched by the zygote behave like posix_spawn'd ones
+@test "Zygote: Launches commands with the shell's cwd, redirections and errors" {
+    tmp=$(mktemp -d)
+    run ./dsh -z <<EOF
+cd $tmp
+echo zygote > out.txt
+cat < out.txt | tr a-z A-Z
+ls
+nosuchcmd
+yes | head -1
+exit
+EOF
+    rm -rf "$tmp"
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"ZYGOTE"* ]]
+    [[ "$output" == *"out.txt"* ]]
+    [[ "$output" == *"execvp: nosuchcmd: No such file or directory"* ]]
+    [[ "${lines[0]}" == "y" || "$output" == *$'\ny\n'* ]]
+}
+
+# Test here input and command substitution: data moves through memfds, not files
+@test "Expand: Here-strings, here-documents and command substitution" {
+    run ./dsh <<EOF
+tr a-z A-Z <<< "here string"
+wc -l << END
+one
+two
+END
+echo got \$(printf "a   b") "[\$(printf "c   d")]"
+echo \$(echo \$(echo nested) | tr a-z A-Z)
+echo '\$(literal)'
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"HERE STRING"* ]]
+    [[ "$output" == *"2"* ]]
+    [[ "$output" == *"got a b [c   d]"* ]]
+    [[ "$output" == *"NESTED"* ]]
+    [[ "$output" == *'$(literal)'* ]]
+}
+
+# Test pathname expansion: sorted matches, hidden files skipped, quotes and no-match left alone
+@test "Glob: Wildcards expand against the directory" {
+    dir=$(mktemp -d)
+    mkdir "$dir/sub"
+    touch "$dir/b.c" "$dir/a.c" "$dir/c.h" "$dir/.hid.c" "$dir/sub/s.c"
+    run ./dsh <<EOF
+cd $dir
+echo *.c
+echo "*.c"
+echo [ab].c [!a].?
+echo */*.c
+echo nomatch*
+touch new.c
+echo *.c
+exit
+EOF
+    rm -rf "$dir"
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"a.c b.c"$'\n'* ]]
+    [[ "$output" == *"*.c"$'\n'* ]]
+    [[ "$output" == *"a.c b.c b.c c.h"* ]]
+    [[ "$output" == *"sub/s.c"* ]]
+    [[ "$output" == *"nomatch*"* ]]
+    [[ "$output" != *".hid.c"* ]]
+    # A file created right after a glob shows up in the next one
+    [[ "$output" == *"a.c b.c new.c"* ]]
+}
+
+# Test the parsed command cache: repeated lines hit, expanding lines are never stored
+@test "Parsecache: Repeated lines reuse their parse" {
+    run ./dsh <<EOF
+parsecache -r
+echo one | tr a-z A-Z
+echo one | tr a-z A-Z
+time echo two
+time echo two
+echo \$(echo three)
+echo \$(echo three)
+parsecache
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"ONE"$'\n'"ONE"* ]]
+    [[ "$output" == *"three"$'\n'"three"* ]]
+    [[ "$output" == *"   1"$'\t'"echo one | tr a-z A-Z"* ]]
+    [[ "$output" == *"   1"$'\t'"time echo two"* ]]
+    [[ "$output" != *$'\t''echo $(echo three)'* ]]
+    [[ "$output" == *"   1"$'\t'"echo three"* ]]
+    [[ "$output" == *"3 hits"* ]]
+}
+
+# Test the threaded server: clients overlap and each keeps its own directory
+@test "Threaded Server: Concurrent clients with separate working directories" {
+    ./dsh -s -x -p 7790 &
+    server_pid=$!
+    sleep 1
+
+    # The first client holds its worker while the second one runs
+    (echo -e "cd /tmp\nsleep 2\npwd\nexit" | timeout 10 ./dsh -c -p 7790 > threaded_c1.txt) &
+    client_pid=$!
+    sleep 0.5
+    start=$(date +%s%N)
+    output=$(echo -e "pwd\nexit" | timeout 5 ./dsh -c -p 7790 || true)
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+    wait $client_pid
+    first=$(cat threaded_c1.txt)
+    rm -f threaded_c1.txt
+
+    echo -e "stop-server" | timeout 5 ./dsh -c -p 7790 > /dev/null || true
+    wait $server_pid 2>/dev/null || true
+
+    [ "$elapsed" -lt 1000 ]
+    [[ "$output" == *"$PWD"* ]]
+    [[ "$first" == *"/tmp"* ]]
+}
+
+@test "Event Server: One loop serves idle and busy clients" {
+    ./dsh -s -E -p 7791 &
+    server_pid=$!
+    sleep 1
+
+    # An idle connection must not hold up anyone, nor a slow $(...)
+    exec 3<>/dev/tcp/127.0.0.1/7791
+    (echo -e "cd \$(echo /tmp)\necho x\$(sleep 2)y\npwd\nexit" | timeout 10 ./dsh -c -p 7791 > event_c1.txt) &
+    client_pid=$!
+    sleep 0.5
+    start=$(date +%s%N)
+    output=$(echo -e "pwd\nprintf 'a\\\\nb\\\\n' | cat\nexit" | timeout 5 ./dsh -c -p 7791 || true)
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+    wait $client_pid
+    first=$(cat event_c1.txt)
+    rm -f event_c1.txt
+    exec 3<&-
+
+    echo -e "stop-server" | timeout 5 ./dsh -c -p 7791 > /dev/null || true
+    wait $server_pid 2>/dev/null || true
+
+    [ "$elapsed" -lt 1000 ]
+    [[ "$output" == *"$PWD"* ]]
+    [[ "$output" == *"a"$'\n'"b"* ]]
+    [[ "$first" == *"xy"* ]]
+    [[ "$first" == *"/tmp"* ]]
+}
+
+@test "Pre-fork Server: Workers are respawned and stop together" {
+    ./dsh -s -P -w 2 -E -p 7792 > prefork_log.txt &
+    server_pid=$!
+    sleep 1
+
+    workers=$(pgrep -P $server_pid | wc -l)
+    kill -9 $(pgrep -P $server_pid | head -1)
+    sleep 1.5
+    respawned=$(pgrep -P $server_pid | wc -l)
+
+    output=""
+    for i in 1 2 3 4; do
+        output+=$(echo -e "cd /tmp\npwd\nexit" | timeout 5 ./dsh -c -p 7792 || true)
+    done
+    echo -e "stop-server" | timeout 5 ./dsh -c -p 7792 > /dev/null || true
+    timeout 5 tail --pid=$server_pid -f /dev/null
+    log=$(cat prefork_log.txt)
+    rm -f prefork_log.txt
+
+    [ "$workers" -eq 2 ]
+    [ "$respawned" -eq 2 ]
+    [ "$(grep -o '/tmp' <<< "$output" | wc -l)" -eq 4 ]
+    [[ "$log" == *"restarting"* ]]
+    ! kill -0 $server_pid 2>/dev/null
+}
+
+@test "Framed Protocol: Separate streams for new clients, legacy replies for old" {
+    ./dsh -s -E -p 7793 &
+    server_pid=$!
+    sleep 1
+
+    # The client negotiates frames; errors arrive on its stderr, and an
+    # EOF byte in the output no longer ends the reply early
+    out=$(printf 'echo hi\nls /nonexistent_dir\necho a\004b\nexit\n' |
+          timeout 5 ./dsh -c -p 7793 2> framed_err.txt || true)
+    err=$(cat framed_err.txt)
+    rm -f framed_err.txt
+
+    # A legacy client: NUL-terminated command, reply ends with 0x04
+    exec 3<>/dev/tcp/127.0.0.1/7793
+    printf 'echo legacy\0' >&3
+    legacy=$(timeout 2 head -c 8 <&3 | od -An -c | tr -d ' \n')
+    exec 3<&-
+
+    echo -e "stop-server" | timeout 5 ./dsh -c -p 7793 > /dev/null || true
+    wait $server_pid 2>/dev/null || true
+
+    [[ "$out" == *"hi"* ]]
+    [[ "$out" == *"a"$'\004'"b"* ]]
+    [[ "$out" != *"nonexistent_dir"* ]]
+    [[ "$err" == *"nonexistent_dir"* ]]
+    [ "$legacy" = 'legacy\n004' ]
+}
+
+@test "Remote Scripts: Pipelined commands reply in order, -e stops at the first failure" {
+    ./dsh -s -E -p 7794 &
+    server_pid=$!
+    sleep 1
+
+    printf '# setup\ncd /tmp\n\npwd\nls /nonexistent_dir\necho last\n' > pipe_script.txt
+    for i in $(seq 1 300); do echo "echo line$i"; done >> pipe_script.txt
+    rc=0
+    out=$(timeout 10 ./dsh -c -p 7794 -f pipe_script.txt 2> pipe_err.txt) || rc=$?
+    err=$(cat pipe_err.txt)
+
+    stopped_rc=0
+    stopped=$(timeout 10 ./dsh -c -p 7794 -e -f pipe_script.txt 2> /dev/null) || stopped_rc=$?
+    rm -f pipe_script.txt pipe_err.txt
+
+    echo "stop-server" | timeout 5 ./dsh -c -p 7794 -f - > /dev/null || true
+    wait $server_pid 2>/dev/null || true
+
+    expected=$(printf '/tmp\nlast\n'; for i in $(seq 1 300); do echo "line$i"; done)
+    [ "$rc" -eq 0 ]
+    [ "$out" = "$expected" ]
+    [[ "$err" == *"nonexistent_dir"* ]]
+    [ "$stopped_rc" -ne 0 ]
+    [ "$stopped" = "/tmp" ]
+    ! kill -0 $server_pid 2>/dev/null
+}
+
+# Test that a client's $(...) reads /dev/null, not the server's stdin
+@test "Remote Expand: Substitutions do not read the server's stdin" {
+    rm -f server_in
+    mkfifo server_in
+    ./dsh -s -x -p 7795 < server_in > /dev/null &
+    server_pid=$!
+    exec 4> server_in
+    sleep 1
+
+    rc=0
+    out=$(echo 'echo a$(cat)b' | timeout 5 ./dsh -c -p 7795 -f -) || rc=$?
+
+    echo "stop-server" | timeout 5 ./dsh -c -p 7795 -f - > /dev/null || true
+    exec 4>&-
+    wait $server_pid 2>/dev/null || true
+    rm -f server_in
+
+    [ "$rc" -eq 0 ]
+    [ "$out" = "ab" ]
+}
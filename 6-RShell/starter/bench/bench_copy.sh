@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+# File: bench_copy.sh
+#
+# Compares the zero-copy cat built-in with the external cat.
+#
+#   ./bench/bench_copy.sh [MB]
+#
+# Pushes an MB-sized file (default 1024) through the file -> file,
+# file -> pipe and pipe -> file paths with each cat and prints the time and
+# throughput for both. Each line runs once untimed first so writeback from
+# the previous run does not land on the next one's clock.
+
+cd "$(dirname "$0")/.." || exit 1
+
+mb=${1:-1024}
+dir=$(mktemp -d /tmp/dsh_copy_XXXXXX)
+trap 'rm -rf "$dir"' EXIT
+
+head -c "$((mb * 1024 * 1024))" /dev/zero > "$dir/src"
+catbin=$(command -v cat)
+
+run() {
+    local label=$1 line=$2
+    echo "$line" | ./dsh -f - > /dev/null
+    rm -f "$dir/dst"
+    sync
+    start=$(date +%s.%N)
+    echo "$line" | ./dsh -f - > /dev/null
+    end=$(date +%s.%N)
+    awk -v l="$label" -v s="$start" -v e="$end" -v mb="$mb" \
+        'BEGIN { t = e - s; printf "%-28s %8.3f s  %8.1f MB/s\n", l, t, mb / t }'
+    rm -f "$dir/dst"
+}
+
+for path in "file -> file" "file -> pipe" "pipe -> file"; do
+    for impl in builtin external; do
+        c=cat
+        [ "$impl" = external ] && c=$catbin
+        case $path in
+            "file -> file") line="$c $dir/src > $dir/dst" ;;
+            "file -> pipe") line="$c $dir/src | $catbin > /dev/null" ;;
+            "pipe -> file") line="$catbin $dir/src | $c > $dir/dst" ;;
+        esac
+        run "$path ($impl)" "$line"
+    done
+done
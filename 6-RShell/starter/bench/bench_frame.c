@@ -0,0 +1,184 @@
+/*
+ * bench_frame.c
+ *
+ * Starts the remote shell server one client at a time and then with -E,
+ * and runs the same requests over the legacy protocol and the framed one
+ * on each: the round trip of "echo hi" and the throughput of a command
+ * writing 64MB. A legacy reply is read until a chunk ends in the EOF byte;
+ * a framed one is decoded frame by frame until its EXIT frame.
+ *
+ *   make bench && ./bench/bench_frame [requests]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+#define BULK_CMD   "head -c 67108864 /dev/zero"
+#define BULK_BYTES 67108864.0
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* connect_to(port) - a client socket without start_client's logging */
+static int connect_to(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int nodelay = 1;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+/* legacy_request(sock, cmd) - sends one command and reads its reply up to the EOF byte */
+static int legacy_request(int sock, const char *cmd) {
+    static char buf[RDSH_FRAME_DATA_MAX];
+    ssize_t n;
+
+    if (send(sock, cmd, strlen(cmd) + 1, 0) < 0) {
+        return -1;
+    }
+    do {
+        if ((n = recv(sock, buf, sizeof(buf), 0)) <= 0) {
+            return -1;
+        }
+    } while (buf[n - 1] != RDSH_EOF_CHAR);
+    return 0;
+}
+
+/* framed_request(reader, cmd) - sends one CMD frame and reads frames up to EXIT */
+static int framed_request(rdsh_reader_t *reader, const char *cmd) {
+    rdsh_frame_t frame;
+
+    if (rdsh_send_frame(reader->fd, RDSH_FRAME_CMD, 0, 0, cmd, strlen(cmd)) != OK) {
+        return -1;
+    }
+    do {
+        if (rdsh_read_frame(reader, &frame) != 1) {
+            return -1;
+        }
+    } while (frame.type != RDSH_FRAME_EXIT);
+    return 0;
+}
+
+/* request(sock, reader, cmd) - one request in whichever protocol the connection speaks */
+static int request(int sock, rdsh_reader_t *reader, const char *cmd) {
+    return reader ? framed_request(reader, cmd) : legacy_request(sock, cmd);
+}
+
+/* open_session(port, reader) - connects, and negotiates frames if reader is given */
+static int open_session(int port, rdsh_reader_t *reader) {
+    rdsh_frame_t frame;
+    int sock = connect_to(port);
+
+    if (sock < 0 || !reader) {
+        return sock;
+    }
+    if (rdsh_reader_init(reader, sock) != OK || rdsh_send_hello(sock) != OK ||
+        rdsh_read_frame(reader, &frame) != 1 || rdsh_check_hello(&frame) < 1) {
+        fprintf(stderr, "framed negotiation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+/* start_bench_server(port, mode) - forks a server and waits until it accepts */
+static pid_t start_bench_server(int port, int mode) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        _exit(start_server("127.0.0.1", port, mode, RDSH_DEF_BACKLOG, 0) == OK_EXIT ? 0 : 1);
+    }
+    for (int tries = 0; pid > 0 && tries < 100; tries++) {
+        usleep(20000);
+        int sock = connect_to(port);
+        if (sock >= 0) {
+            legacy_request(sock, "exit");
+            close(sock);
+            return pid;
+        }
+    }
+    fprintf(stderr, "server on port %d did not start\n", port);
+    exit(EXIT_FAILURE);
+}
+
+/* run(port, framed, requests) - prints echo latency and bulk throughput for one protocol */
+static void run(const char *label, int port, int framed, int requests) {
+    rdsh_reader_t reader;
+    rdsh_reader_t *r = framed ? &reader : NULL;
+    int sock = open_session(port, r);
+
+    if (sock < 0) {
+        fprintf(stderr, "connect failed\n");
+        exit(EXIT_FAILURE);
+    }
+    request(sock, r, "echo warm");
+    double start = now_ns();
+    for (int i = 0; i < requests; i++) {
+        if (request(sock, r, "echo hi") < 0) {
+            fprintf(stderr, "request failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double echo_us = (now_ns() - start) / requests / 1e3;
+
+    start = now_ns();
+    request(sock, r, BULK_CMD);
+    double mb_s = BULK_BYTES / 1048576.0 / ((now_ns() - start) / 1e9);
+
+    request(sock, r, "exit");
+    close(sock);
+    if (r) {
+        rdsh_reader_free(r);
+    }
+    printf("%-16s %-8s %14.1f %14.0f\n", label, framed ? "framed" : "legacy", echo_us, mb_s);
+}
+
+int main(int argc, char *argv[]) {
+    int requests = (argc > 1) ? atoi(argv[1]) : 5000;
+    int port = 20000 + getpid() % 20000;
+    struct { const char *label; int mode; } servers[] = {
+        { "single", RDSH_SERVER_SINGLE },
+        { "-E", RDSH_SERVER_EVENT },
+    };
+
+    if (requests <= 0) requests = 5000;
+    signal(SIGPIPE, SIG_IGN);
+    printf("%-16s %-8s %14s %14s\n", "server", "protocol", "echo hi us", "bulk MB/s");
+    for (size_t s = 0; s < sizeof(servers) / sizeof(servers[0]); s++) {
+        pid_t pid = start_bench_server(port, servers[s].mode);
+        run(servers[s].label, port, 0, requests);
+        run(servers[s].label, port, 1, requests);
+
+        int sock = connect_to(port);
+        if (sock >= 0) {
+            legacy_request(sock, "stop-server");
+            close(sock);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
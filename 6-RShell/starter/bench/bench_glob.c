@@ -0,0 +1,123 @@
+/*
+ * bench_glob.c
+ *
+ * Fills a scratch directory with ENTRIES files (every tenth named *.log)
+ * and expands the *.log and * patterns in it through expand_cmd_list: cold,
+ * when the listing is read with getdents64, then warm from the directory
+ * cache, then again after a file is added so the mtime check forces a
+ * fresh read. glob(3) on the same patterns is shown for comparison.
+ *
+ *   make bench && ./bench/bench_glob [entries]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+
+#include "../dshlib.h"
+
+#define WARM_RUNS 20
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * dsh_glob(dir, pattern, argc)
+ *
+ * Expands "true DIR/PATTERN" and returns the milliseconds it took
+ */
+static double dsh_glob(const char *dir, const char *pattern, int *argc) {
+    char line[512];
+    command_list_t clist;
+
+    snprintf(line, sizeof(line), "true %s/%s", dir, pattern);
+    double start = now_ns();
+    if (build_cmd_list(line, &clist) != OK ||
+        expand_cmd_list(&clist, BUILTIN_LOCAL, STDERR_FILENO, NULL) != OK) {
+        fprintf(stderr, "expansion failed: %s\n", line);
+        exit(EXIT_FAILURE);
+    }
+    double ms = (now_ns() - start) / 1e6;
+    *argc = clist.commands[0].argc - 1;
+    free_cmd_list(&clist);
+    return ms;
+}
+
+static double libc_glob(const char *dir, const char *pattern, int *count) {
+    char path[512];
+    glob_t g;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, pattern);
+    double start = now_ns();
+    int rc = glob(path, 0, NULL, &g);
+    double ms = (now_ns() - start) / 1e6;
+    *count = (rc == 0) ? (int)g.gl_pathc : 0;
+    globfree(&g);
+    return ms;
+}
+
+static void touch(const char *dir, const char *name) {
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    long entries = (argc > 1) ? atol(argv[1]) : 200000;
+    char dir[] = "/tmp/bench_glob.XXXXXX";
+    const char *patterns[] = {"*.log", "*"};
+    dsh_session_t session;
+
+    if (entries <= 0) entries = 200000;
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < entries; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%07ld.%s", i, (i % 10 == 0) ? "log" : "dat");
+        touch(dir, name);
+    }
+
+    session_init(&session);
+    session_enter(&session);
+    printf("%ld entries\n", entries);
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        int n, libc_n;
+        char extra[32];
+
+        // A new directory entry changes the mtime, so the first dsh run of
+        // each pattern reads the listing again
+        snprintf(extra, sizeof(extra), "new%zu.log", p);
+        touch(dir, extra);
+
+        double cold = dsh_glob(dir, patterns[p], &n);
+        double warm = 0;
+        for (int r = 0; r < WARM_RUNS; r++) {
+            warm += dsh_glob(dir, patterns[p], &n);
+        }
+        double libc = libc_glob(dir, patterns[p], &libc_n);
+
+        printf("%-6s %7d matches  dsh cold %8.2f ms  cached %8.2f ms  glob(3) %8.2f ms%s\n",
+               patterns[p], n, cold, warm / WARM_RUNS, libc,
+               (n == libc_n) ? "" : "  (count differs)");
+    }
+    session_enter(NULL);
+    session_destroy(&session);
+
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd) == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,171 @@
+/*
+ * bench_idle.c
+ *
+ * Starts the remote shell server with -E in a child process and opens
+ * 1000, then up to the requested number of idle connections to it, each of
+ * which runs one command first so it has a live session. After each step
+ * it reports the server's resident memory per connection and the latency
+ * of "echo hi" and "true | cat" on one more client while the idle ones stay
+ * connected. Both processes need a descriptor per connection; the bench
+ * raises its soft limit to the hard one and caps the count to fit.
+ *
+ *   make bench && ./bench/bench_idle [connections]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+#define SAMPLES 2000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* request(sock, cmd) - sends one command and reads its reply up to the EOF marker */
+static int request(int sock, const char *cmd) {
+    char buf[RDSH_COMM_BUFF_SZ];
+    ssize_t n;
+
+    if (send(sock, cmd, strlen(cmd) + 1, 0) < 0) {
+        return -1;
+    }
+    do {
+        if ((n = recv(sock, buf, sizeof(buf), 0)) <= 0) {
+            return -1;
+        }
+    } while (buf[n - 1] != RDSH_EOF_CHAR);
+    return 0;
+}
+
+/* connect_to(port) - a client socket without start_client's logging */
+static int connect_to(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int nodelay = 1;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+/* server_rss_kb(pid) - VmRSS of the server process */
+static long server_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/* latency_us(sock, cmd) - mean round trip of cmd over SAMPLES requests */
+static double latency_us(int sock, const char *cmd) {
+    double start = now_ns();
+
+    for (int i = 0; i < SAMPLES; i++) {
+        if (request(sock, cmd) < 0) {
+            return -1;
+        }
+    }
+    return (now_ns() - start) / SAMPLES / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    int want = (argc > 1) ? atoi(argv[1]) : 10000;
+    int port = 20000 + getpid() % 20000;
+    struct rlimit rl;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // Room for the server's own descriptors and the bench's
+    if (want <= 0 || (rlim_t)want > rl.rlim_cur - 64) {
+        want = rl.rlim_cur - 64;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        _exit(start_server("127.0.0.1", port, RDSH_SERVER_EVENT, RDSH_DEF_BACKLOG, 0) == OK_EXIT ? 0 : 1);
+    }
+    int active = -1;
+    for (int tries = 0; active < 0 && tries < 100; tries++) {
+        usleep(20000);
+        active = connect_to(port);
+    }
+    if (active < 0) {
+        fprintf(stderr, "server on port %d did not start\n", port);
+        kill(pid, SIGTERM);
+        return EXIT_FAILURE;
+    }
+    request(active, "true");
+    long base_kb = server_rss_kb(pid);
+
+    int *idle = malloc(want * sizeof(int));
+    int open_count = 0;
+    printf("%12s %12s %14s %14s %14s\n", "connections", "server RSS", "bytes/conn",
+           "echo hi us", "true|cat us");
+    for (int step = (want < 1000) ? want : 1000; ; step = (step * 2 < want) ? step * 2 : want) {
+        while (open_count < step) {
+            int sock = connect_to(port);
+            if (sock < 0 || request(sock, "true") < 0) {
+                fprintf(stderr, "connection %d failed\n", open_count);
+                want = step = open_count;
+                if (sock >= 0) {
+                    close(sock);
+                }
+                break;
+            }
+            idle[open_count++] = sock;
+        }
+        long kb = server_rss_kb(pid);
+        printf("%12d %10ldkB %14.0f %14.1f %14.1f\n", open_count, kb,
+               open_count ? (kb - base_kb) * 1024.0 / open_count : 0.0,
+               latency_us(active, "echo hi"), latency_us(active, "true | cat"));
+        if (step >= want) {
+            break;
+        }
+    }
+
+    request(active, "stop-server");
+    close(active);
+    for (int i = 0; i < open_count; i++) {
+        close(idle[i]);
+    }
+    free(idle);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# File: bench_parallel.sh
+#
+# Measures how the parallel built-in scales with its worker count.
+#
+#   ./bench/bench_parallel.sh [JOBS] [MB]
+#
+# Hashes JOBS copies of an MB-sized file (defaults: 16 jobs, 32 MB) with
+# sha256sum through "parallel -j N" for N = 1, 2, 4, ... up to the CPU
+# count, and prints the time and speedup over N = 1 for each.
+
+cd "$(dirname "$0")/.." || exit 1
+
+jobs=${1:-16}
+mb=${2:-32}
+cpus=$(nproc)
+data=$(mktemp /tmp/dsh_par_XXXXXX)
+trap 'rm -f "$data"' EXIT
+
+head -c "$((mb * 1024 * 1024))" /dev/urandom > "$data"
+args=$(yes "$data" | head -n "$jobs" | tr '\n' ' ')
+
+base=
+n=1
+while :; do
+    start=$(date +%s.%N)
+    echo "parallel -j $n sha256sum ::: $args" | ./dsh -f - > /dev/null
+    end=$(date +%s.%N)
+    t=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }')
+    base=${base:-$t}
+    awk -v n="$n" -v t="$t" -v b="$base" -v j="$jobs" \
+        'BEGIN { printf "-j %-4d %3d jobs  %8.3f s  speedup %5.2fx\n", n, j, t, b / t }'
+    [ "$n" -ge "$cpus" ] && break
+    n=$((n * 2))
+    [ "$n" -gt "$cpus" ] && n=$cpus
+done
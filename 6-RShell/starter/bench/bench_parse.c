@@ -0,0 +1,101 @@
+/*
+ * bench_parse.c
+ *
+ * Measures build_cmd_list/free_cmd_list on lines with 1, 8 and 1000
+ * pipeline stages and 1, 8 and 1000 arguments, and reports the heap
+ * allocations the session arena made while doing it. Each shape is run
+ * with the parsed command cache off and then on; lines too long for the
+ * cache show the same time twice.
+ *
+ *   make bench && ./bench/bench_parse [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../dshlib.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * make_line(stages, args)
+ *
+ * Builds "cmd a1 .. aN | cmd a1 .. aN | ..." with the given shape
+ */
+static char *make_line(int stages, int args) {
+    size_t cap = (size_t)stages * (args * 8 + 16) + 1;
+    char *line = malloc(cap);
+    size_t len = 0;
+
+    if (!line) return NULL;
+    for (int s = 0; s < stages; s++) {
+        len += snprintf(line + len, cap - len, "%scmd", s ? " | " : "");
+        for (int a = 1; a < args; a++) {
+            len += snprintf(line + len, cap - len, " arg%d", a);
+        }
+    }
+    return line;
+}
+
+static void run_case(int stages, int args, int iters, int cached) {
+    dsh_session_t session;
+    command_list_t clist;
+    char *line = make_line(stages, args);
+
+    if (!line) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    session_init(&session);
+    session.parse_cache = cached;
+    session_enter(&session);
+
+    // The first parse grows the arena, the second settles it on one chunk
+    for (int i = 0; i < 2; i++) {
+        if (build_cmd_list(line, &clist) != OK) {
+            fprintf(stderr, "parse failed for %d stages x %d args\n", stages, args);
+            exit(EXIT_FAILURE);
+        }
+        free_cmd_list(&clist);
+    }
+    unsigned long warm_allocs = session.arena.heap_allocs;
+
+    double start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        build_cmd_list(line, &clist);
+        free_cmd_list(&clist);
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%6d stages x %6d args  %-6s %10.0f ns/line  %8.2f ns/token  "
+           "warm-up allocs %lu  steady-state allocs %lu\n",
+           stages, args, cached ? "cached" : "parsed",
+           elapsed / iters, elapsed / iters / ((double)stages * args),
+           warm_allocs, session.arena.heap_allocs - warm_allocs);
+
+    session_enter(NULL);
+    session_destroy(&session);
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    int iters = (argc > 1) ? atoi(argv[1]) : 2000;
+    const int shapes[] = {1, 8, 1000};
+
+    if (iters <= 0) iters = 2000;
+    for (int s = 0; s < 3; s++) {
+        for (int a = 0; a < 3; a++) {
+            // Keep the 1000 x 1000 case from dominating the run time
+            int n = (shapes[s] * shapes[a] > 100000) ? iters / 100 + 1 : iters;
+            run_case(shapes[s], shapes[a], n, 0);
+            run_case(shapes[s], shapes[a], n, 1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * bench_pipe.c
+ *
+ * Pushes MB megabytes of zeros through "head | cat | ... | cat" with
+ * STAGES stages, once per pipe capacity (the kernel default, then 256K
+ * and 1M through "set pipesize="), and reports throughput plus the
+ * context switches each stage made. Every stage is an external process
+ * collected with wait4 so its own rusage can be read.
+ *
+ *   make bench && ./bench/bench_pipe [MB] [STAGES]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * run_line(line)
+ *
+ * Parses and runs a line that is a single built-in, e.g. "set pipesize=1M"
+ */
+static int run_line(const char *line) {
+    char buf[128];
+    command_list_t clist;
+    launch_fds_t fds = { -1, -1, -1 };
+    int status = 1;
+
+    snprintf(buf, sizeof(buf), "%s", line);
+    if (build_cmd_list(buf, &clist) != OK) {
+        return 1;
+    }
+    const builtin_desc_t *bi = builtin_lookup(clist.commands[0].argv[0], BUILTIN_LOCAL);
+    if (bi && bi->fn) {
+        status = run_builtin(bi, &clist.commands[0], &fds);
+    }
+    free_cmd_list(&clist);
+    return status;
+}
+
+/*
+ * run_case(label, mb, stages, cat)
+ *
+ * Runs one pipeline and prints its throughput and per-stage context switches
+ */
+static void run_case(const char *label, long mb, int stages, const char *cat) {
+    size_t cap = 64 + (size_t)stages * (strlen(cat) + 4);
+    char *line = malloc(cap);
+    size_t len = 0;
+    command_list_t clist;
+
+    if (!line) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    len += snprintf(line, cap, "head -c %ldM /dev/zero", mb);
+    for (int s = 1; s < stages; s++) {
+        len += snprintf(line + len, cap - len, " | %s", cat);
+    }
+    if (build_cmd_list(line, &clist) != OK) {
+        fprintf(stderr, "parse failed: %s\n", line);
+        exit(EXIT_FAILURE);
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    launch_fds_t ends = { -1, null_fd, -1 };
+    pipeline_stage_t *st = calloc(stages, sizeof(pipeline_stage_t));
+    if (!st || null_fd < 0) {
+        fprintf(stderr, "setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_ns();
+    launch_pipeline(&clist, &ends, BUILTIN_LOCAL, st);
+    long csw[stages];
+    for (int s = 0; s < stages; s++) {
+        struct rusage ru = {0};
+        int ws;
+        csw[s] = -1;
+        if (st[s].pid > 0 && wait4(st[s].pid, &ws, 0, &ru) > 0) {
+            csw[s] = ru.ru_nvcsw + ru.ru_nivcsw;
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%-8s %8.3f s  %8.1f MB/s  csw/stage:", label, secs, mb / secs);
+    for (int s = 0; s < stages; s++) {
+        printf(" %ld", csw[s]);
+    }
+    printf("\n");
+
+    close(null_fd);
+    free(st);
+    free_cmd_list(&clist);
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    long mb = (argc > 1) ? atol(argv[1]) : 2048;
+    int stages = (argc > 2) ? atoi(argv[2]) : 4;
+    const char *sizes[] = {"0", "256K", "1M"};
+    dsh_session_t session;
+    char cat[PATH_MAX];
+
+    if (mb <= 0) mb = 2048;
+    if (stages < 2) stages = 2;
+
+    // A path keeps the cat built-in from claiming the middle stages
+    if (path_lookup("cat", cat, sizeof(cat)) != OK) {
+        fprintf(stderr, "cat not found on PATH\n");
+        return EXIT_FAILURE;
+    }
+
+    session_init(&session);
+    session_enter(&session);
+    printf("%ld MB through %d stages\n", mb, stages);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char set[64];
+        snprintf(set, sizeof(set), "set pipesize=%s", sizes[i]);
+        if (run_line(set) != 0) {
+            printf("%-8s skipped\n", sizes[i]);
+            continue;
+        }
+        run_case(strcmp(sizes[i], "0") == 0 ? "default" : sizes[i], mb, stages, cat);
+    }
+    session_enter(NULL);
+    session_destroy(&session);
+    return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * bench_pipeline.c
+ *
+ * Starts the remote shell server with -E and runs a script of "echo hi"
+ * lines through exec_remote_script, one command at a time (as -e does)
+ * and pipelined, both straight over loopback and through a relay that
+ * holds every chunk for a fixed delay each way to stand in for a slow
+ * link. One at a time pays the delay per command; pipelined pays it about
+ * once per window.
+ *
+ *   make bench && ./bench/bench_pipeline [lines] [delay-ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+typedef struct hop {
+    int from;
+    int to;
+    int delay_us;
+} hop_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* connect_to(port) - a client socket without start_client's logging */
+static int connect_to(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int nodelay = 1;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+/* hop_thread(arg) - copies one direction of a relayed connection, delaying each chunk */
+static void *hop_thread(void *arg) {
+    hop_t *h = arg;
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(h->from, buf, sizeof(buf))) > 0) {
+        usleep(h->delay_us);
+        if (write(h->to, buf, n) != n) {
+            break;
+        }
+    }
+    shutdown(h->to, SHUT_WR);
+    return NULL;
+}
+
+/* relay_thread(arg) - accepts clients on the relay port and joins each to the server */
+static void *relay_thread(void *arg) {
+    int *ports = arg;            // listening socket, server port, delay
+    while (1) {
+        int client = accept(ports[0], NULL, NULL);
+        int server = (client >= 0) ? connect_to(ports[1]) : -1;
+        int nodelay = 1;
+        if (server < 0) {
+            if (client >= 0) {
+                close(client);
+            }
+            continue;
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        hop_t *up = malloc(sizeof(hop_t));
+        hop_t *down = malloc(sizeof(hop_t));
+        *up = (hop_t){ client, server, ports[2] };
+        *down = (hop_t){ server, client, ports[2] };
+        pthread_t t;
+        pthread_create(&t, NULL, hop_thread, up);
+        pthread_detach(t);
+        pthread_create(&t, NULL, hop_thread, down);
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+/* start_relay(server_port, delay_us) - a delaying relay in front of the server; returns its port */
+static int start_relay(int server_port, int delay_us) {
+    static int args[3];
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_t t;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 16) < 0 || getsockname(sock, (struct sockaddr *)&addr, &len) < 0) {
+        perror("relay");
+        exit(EXIT_FAILURE);
+    }
+    args[0] = sock;
+    args[1] = server_port;
+    args[2] = delay_us;
+    pthread_create(&t, NULL, relay_thread, args);
+    pthread_detach(t);
+    return ntohs(addr.sin_port);
+}
+
+/* run_script(path, port, one_at_a_time) - commands/sec running the script */
+static double run_script(const char *path, int port, int lines, int one_at_a_time) {
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    double start = now_ns();
+    int rc = exec_remote_script("127.0.0.1", port, path, one_at_a_time);
+    double secs = (now_ns() - start) / 1e9;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null_fd);
+    if (rc != OK) {
+        fprintf(stderr, "script failed: %d\n", rc);
+        exit(EXIT_FAILURE);
+    }
+    return lines / secs;
+}
+
+int main(int argc, char *argv[]) {
+    int lines = (argc > 1) ? atoi(argv[1]) : 10000;
+    int delay_ms = (argc > 2) ? atoi(argv[2]) : 1;
+    int port = 20000 + getpid() % 20000;
+    char path[] = "/tmp/bench_pipeline_XXXXXX";
+
+    if (lines <= 0) lines = 10000;
+    if (delay_ms < 0) delay_ms = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = mkstemp(path);
+    FILE *script = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (!script) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < lines; i++) {
+        fputs("echo hi\n", script);
+    }
+    fclose(script);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        _exit(start_server("127.0.0.1", port, RDSH_SERVER_EVENT, RDSH_DEF_BACKLOG, 0) == OK_EXIT ? 0 : 1);
+    }
+    int sock = -1;
+    for (int tries = 0; sock < 0 && tries < 100; tries++) {
+        usleep(20000);
+        sock = connect_to(port);
+    }
+    if (sock < 0) {
+        fprintf(stderr, "server on port %d did not start\n", port);
+        kill(pid, SIGTERM);
+        return EXIT_FAILURE;
+    }
+    close(sock);
+    int slow_port = start_relay(port, delay_ms * 1000);
+
+    // A slow link needs fewer lines one at a time to show its rate
+    int slow_lines = lines / 20 + 1;
+    char slow_path[] = "/tmp/bench_pipeline_XXXXXX";
+    fd = mkstemp(slow_path);
+    script = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    for (int i = 0; script && i < slow_lines; i++) {
+        fputs("echo hi\n", script);
+    }
+    if (script) {
+        fclose(script);
+    }
+
+    printf("%-22s %16s %16s\n", "link", "one at a time/s", "pipelined/s");
+    printf("%-22s %16.0f %16.0f\n", "loopback",
+           run_script(path, port, lines, 1), run_script(path, port, lines, 0));
+    char label[32];
+    snprintf(label, sizeof(label), "+%dms each way", delay_ms);
+    printf("%-22s %16.0f %16.0f\n", label,
+           run_script(slow_path, slow_port, slow_lines, 1), run_script(path, slow_port, lines, 0));
+
+    unlink(path);
+    unlink(slow_path);
+    FILE *stop = fopen(path, "w");
+    if (stop) {
+        fputs("stop-server\n", stop);
+        fclose(stop);
+        run_script(path, port, 1, 0);
+        unlink(path);
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
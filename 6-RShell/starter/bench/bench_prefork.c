@@ -0,0 +1,175 @@
+/*
+ * bench_prefork.c
+ *
+ * Starts the remote shell server with -E in one process, then pre-forked
+ * (-P) with 1, 2, 4 and one worker per core, and drives each with 16
+ * concurrent clients. It reports the connection rate (connect, "exit",
+ * close) and the aggregate "echo hi" commands/sec over long-lived
+ * connections. Both should grow with the number of workers up to the
+ * number of cores; on one core they stay flat.
+ *
+ *   make bench && ./bench/bench_prefork [requests-per-client]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+#define CLIENTS 16
+
+typedef struct client_arg {
+    int port;
+    int requests;
+    int reconnect;           // a new connection per request
+    int failed;
+} client_arg_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* request(sock, cmd) - sends one command and reads its reply up to the EOF marker */
+static int request(int sock, const char *cmd) {
+    char buf[RDSH_COMM_BUFF_SZ];
+    ssize_t n;
+
+    if (send(sock, cmd, strlen(cmd) + 1, 0) < 0) {
+        return -1;
+    }
+    do {
+        if ((n = recv(sock, buf, sizeof(buf), 0)) <= 0) {
+            return -1;
+        }
+    } while (buf[n - 1] != RDSH_EOF_CHAR);
+    return 0;
+}
+
+/* connect_to(port) - a client socket without start_client's logging */
+static int connect_to(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int nodelay = 1;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+static void *client_thread(void *arg) {
+    client_arg_t *c = arg;
+    int sock = -1;
+
+    for (int i = 0; i < c->requests && !c->failed; i++) {
+        if (sock < 0 && (sock = connect_to(c->port)) < 0) {
+            c->failed = 1;
+            break;
+        }
+        c->failed = (request(sock, c->reconnect ? "exit" : "echo hi") < 0);
+        if (c->reconnect) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0) {
+        request(sock, "exit");
+        close(sock);
+    }
+    return NULL;
+}
+
+/* start_bench_server(port, workers) - forks a -E server, pre-forked if workers > 0 */
+static pid_t start_bench_server(int port, int workers) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        _exit(start_server("127.0.0.1", port, RDSH_SERVER_EVENT, RDSH_DEF_BACKLOG,
+                           workers) == OK_EXIT ? 0 : 1);
+    }
+    for (int tries = 0; pid > 0 && tries < 100; tries++) {
+        usleep(20000);
+        int sock = connect_to(port);
+        if (sock >= 0) {
+            request(sock, "exit");
+            close(sock);
+            return pid;
+        }
+    }
+    fprintf(stderr, "server on port %d did not start\n", port);
+    exit(EXIT_FAILURE);
+}
+
+static void stop_bench_server(pid_t pid, int port) {
+    int sock = connect_to(port);
+
+    if (sock >= 0) {
+        request(sock, "stop-server");
+        close(sock);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+/* run_clients(port, requests, reconnect) - aggregate requests/sec of CLIENTS clients */
+static double run_clients(int port, int requests, int reconnect) {
+    pthread_t threads[CLIENTS];
+    client_arg_t args[CLIENTS];
+
+    double start = now_ns();
+    for (int i = 0; i < CLIENTS; i++) {
+        args[i] = (client_arg_t){ port, requests, reconnect, 0 };
+        pthread_create(&threads[i], NULL, client_thread, &args[i]);
+    }
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].failed) {
+            fprintf(stderr, "client %d failed\n", i);
+        }
+    }
+    return CLIENTS * requests / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    int requests = (argc > 1) ? atoi(argv[1]) : 500;
+    int port = 20000 + getpid() % 20000;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers[] = {0, 1, 2, 4, (int)cores};
+
+    if (requests <= 0) requests = 500;
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d cores\n%-10s %14s %16s\n", (int)cores, "workers", "connects/s", "echo cmds/s");
+    for (size_t w = 0; w < sizeof(workers) / sizeof(workers[0]); w++) {
+        if (w == 4 && cores <= 4) {
+            break;
+        }
+        pid_t pid = start_bench_server(port, workers[w]);
+        double conns = run_clients(port, requests / 5 + 1, 1);
+        double cmds = run_clients(port, requests, 0);
+        stop_bench_server(pid, port);
+
+        char label[16];
+        snprintf(label, sizeof(label), workers[w] ? "-P -w %d" : "none", workers[w]);
+        printf("%-10s %14.0f %16.0f\n", label, conns, cmds);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# File: bench_script.sh
+#
+# Runs a generated script through dsh and reports commands per second.
+#
+#   ./bench/bench_script.sh [LINES] [COMMAND...]
+#
+# LINES defaults to 100000 and COMMAND to the "cd ." built-in, which keeps
+# the run about shell overhead (read, parse, dispatch) rather than process
+# launch cost. The same script is also fed through stdin, which runs as a
+# script too, and with DSH_PROMPT=1 through the prompting loop for
+# comparison.
+
+cd "$(dirname "$0")/.." || exit 1
+
+lines=${1:-100000}
+shift
+cmd=${*:-cd .}
+script=$(mktemp /tmp/dsh_bench_XXXXXX)
+trap 'rm -f "$script"' EXIT
+
+yes "$cmd" | head -n "$lines" > "$script"
+
+run() {
+    local label=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    awk -v l="$label" -v n="$lines" -v s="$start" -v e="$end" \
+        'BEGIN { t = e - s; printf "%-22s %8d cmds  %8.3f s  %12.0f cmds/s\n", l, n, t, n / t }'
+}
+
+echo "command: $cmd"
+run "dsh -f script" ./dsh -f "$script"
+run "dsh < script" sh -c './dsh < "$1"' sh "$script"
+run "dsh < script (prompt)" sh -c 'DSH_PROMPT=1 ./dsh < "$1"' sh "$script"
@@ -0,0 +1,169 @@
+/*
+ * bench_server.c
+ *
+ * Starts the remote shell server in a child process, single-threaded, with
+ * -x and with -E, and drives it with 1, 2, 4, 8 and 16 concurrent clients.
+ * Each client connects, sends its share of requests one at a time and
+ * waits for every reply. The aggregate commands/sec is reported per
+ * client count, for a built-in ("echo hi") and for an external command
+ * that mostly waits ("sleep 0.01"). A single-threaded server serves one
+ * client at a time, so its rate stays flat as clients are added.
+ *
+ *   make bench && ./bench/bench_server [requests-per-client]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+#define MAX_CLIENTS 16
+
+typedef struct client_arg {
+    int port;
+    const char *cmd;
+    int requests;
+    int failed;
+} client_arg_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * request(sock, cmd)
+ *
+ * Sends one command and reads its reply up to the EOF marker
+ */
+static int request(int sock, const char *cmd) {
+    char buf[RDSH_COMM_BUFF_SZ];
+    ssize_t n;
+
+    if (send(sock, cmd, strlen(cmd) + 1, 0) < 0) {
+        return -1;
+    }
+    do {
+        if ((n = recv(sock, buf, sizeof(buf), 0)) <= 0) {
+            return -1;
+        }
+    } while (buf[n - 1] != RDSH_EOF_CHAR);
+    return 0;
+}
+
+static void *client_thread(void *arg) {
+    client_arg_t *c = arg;
+    int sock = start_client("127.0.0.1", c->port);
+
+    if (sock < 0) {
+        c->failed = 1;
+        return NULL;
+    }
+    for (int i = 0; i < c->requests && !c->failed; i++) {
+        c->failed = (request(sock, c->cmd) < 0);
+    }
+    request(sock, "exit");
+    close(sock);
+    return NULL;
+}
+
+/*
+ * start_bench_server(port, mode)
+ *
+ * Forks a server with its log sent to /dev/null and waits until it accepts
+ */
+static pid_t start_bench_server(int port, int mode) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        signal(SIGPIPE, SIG_IGN);
+        _exit(start_server("127.0.0.1", port, mode, RDSH_DEF_BACKLOG, 0) == OK_EXIT ? 0 : 1);
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int tries = 0; pid > 0 && tries < 100; tries++) {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            request(sock, "exit");
+            close(sock);
+            return pid;
+        }
+        close(sock);
+        usleep(20000);
+    }
+    fprintf(stderr, "server on port %d did not start\n", port);
+    exit(EXIT_FAILURE);
+}
+
+static void stop_bench_server(pid_t pid, int port) {
+    int sock = start_client("127.0.0.1", port);
+
+    if (sock >= 0) {
+        request(sock, "stop-server");
+        close(sock);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * run_clients(port, cmd, nclients, requests)
+ *
+ * Runs nclients concurrent clients and returns the aggregate commands/sec
+ */
+static double run_clients(int port, const char *cmd, int nclients, int requests) {
+    pthread_t threads[MAX_CLIENTS];
+    client_arg_t args[MAX_CLIENTS];
+
+    double start = now_ns();
+    for (int i = 0; i < nclients; i++) {
+        args[i] = (client_arg_t){ port, cmd, requests, 0 };
+        pthread_create(&threads[i], NULL, client_thread, &args[i]);
+    }
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].failed) {
+            fprintf(stderr, "client %d failed\n", i);
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    return nclients * requests / secs;
+}
+
+int main(int argc, char *argv[]) {
+    int requests = (argc > 1) ? atoi(argv[1]) : 200;
+    const char *cmds[] = {"echo hi", "sleep 0.01"};
+    int port = 20000 + getpid() % 20000;
+
+    if (requests <= 0) requests = 200;
+    signal(SIGPIPE, SIG_IGN);
+    const int modes[] = {RDSH_SERVER_SINGLE, RDSH_SERVER_THREADED, RDSH_SERVER_EVENT};
+    printf("%-12s %8s %16s %16s %16s\n", "command", "clients", "single cmds/s", "-x cmds/s",
+           "-E cmds/s");
+    for (size_t c = 0; c < sizeof(cmds) / sizeof(cmds[0]); c++) {
+        // sleep is bounded by its own duration; keep the run short
+        int n = (c == 0) ? requests : requests / 10 + 1;
+        for (int clients = 1; clients <= MAX_CLIENTS; clients *= 2) {
+            double rate[3];
+            for (int m = 0; m < 3; m++) {
+                pid_t pid = start_bench_server(port, modes[m]);
+                rate[m] = run_clients(port, cmds[c], clients, n);
+                stop_bench_server(pid, port);
+            }
+            printf("%-12s %8d %16.0f %16.0f %16.0f\n", cmds[c], clients, rate[0], rate[1],
+                   rate[2]);
+        }
+    }
+    return 0;
+}
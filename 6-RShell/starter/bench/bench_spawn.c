@@ -0,0 +1,105 @@
+/*
+ * bench_spawn.c
+ *
+ * Measures the cost of starting /bin/true while the parent holds 0, 64,
+ * 256 and 1024 MiB of touched memory, with fork+execv, with posix_spawn
+ * and with launch_cmd going through the zygote (dsh -z), which is started
+ * before any of the memory is allocated. fork copies the parent's page
+ * tables, so its cost climbs with RSS; posix_spawn's vfork-style clone and
+ * the zygote, which clones itself rather than the parent, should stay flat.
+ *
+ *   make bench && ./bench/bench_spawn [launches]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "../dshlib.h"
+
+#define MIB (1024UL * 1024UL)
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_fork(int launches) {
+    char *argv[] = {"/bin/true", NULL};
+    double start = now_ns();
+
+    for (int i = 0; i < launches; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(argv[0], argv);
+            _exit(127);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+    }
+    return (now_ns() - start) / launches;
+}
+
+extern char **environ;
+
+static double time_spawn(int launches) {
+    char *argv[] = {"/bin/true", NULL};
+    double start = now_ns();
+
+    for (int i = 0; i < launches; i++) {
+        pid_t pid;
+        if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) == 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return (now_ns() - start) / launches;
+}
+
+static double time_zygote(int launches) {
+    char *argv[] = {"/bin/true", NULL};
+    cmd_buff_t cmd = { .argc = 1, .argv = argv };
+    launch_fds_t fds = { -1, -1, -1 };
+    double start = now_ns();
+
+    for (int i = 0; i < launches; i++) {
+        pid_t pid;
+        if (launch_cmd(&cmd, &fds, &pid) == OK) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return (now_ns() - start) / launches;
+}
+
+int main(int argc, char *argv[]) {
+    int launches = (argc > 1) ? atoi(argv[1]) : 200;
+    const size_t sizes[] = {0, 64, 256, 1024};
+
+    if (launches <= 0) launches = 200;
+    int have_zygote = (zygote_start() == OK);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char *ballast = NULL;
+        if (sizes[s] > 0) {
+            ballast = malloc(sizes[s] * MIB);
+            if (!ballast) {
+                printf("%6zu MiB  skipped, allocation failed\n", sizes[s]);
+                continue;
+            }
+            // Touch every page so it counts toward RSS
+            memset(ballast, 1, sizes[s] * MIB);
+        }
+
+        double fork_ns = time_fork(launches);
+        double spawn_ns = time_spawn(launches);
+        printf("%6zu MiB RSS  fork+exec %8.1f us/launch  posix_spawn %8.1f us/launch",
+               sizes[s], fork_ns / 1000, spawn_ns / 1000);
+        if (have_zygote && zygote_active()) {
+            printf("  zygote %8.1f us/launch", time_zygote(launches) / 1000);
+        }
+        printf("\n");
+        free(ballast);
+    }
+    return 0;
+}
@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "dshlib.h"
+#include "builtin_hash.h"
+
+/*
+ * Built-in commands
+ *
+ * Every built-in, local or remote, is an entry in builtins.def. Lookup is
+ * a single seeded hash into a table generated at build time plus one
+ * strcmp to confirm the hit, so an external command pays the same small
+ * cost however many built-ins exist.
+ *
+ * A built-in never touches the shell's stdio buffers; it writes to the
+ * descriptors it is handed, so the same code serves a lone command on the
+ * terminal, a pipeline stage running on its own thread and a remote
+ * client's socket. Output is gathered in a small buffer and written in as
+ * few write calls as possible.
+ */
+
+#define BUILTIN_OUT_SZ 4096
+
+typedef struct out_buf {
+    int fd;
+    int failed;          // a write failed; drop further output
+    size_t len;
+    char data[BUILTIN_OUT_SZ];
+} out_buf_t;
+
+/**
+ * Writes all of len bytes, retrying short writes and EINTR
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void ob_flush(out_buf_t *ob) {
+    if (ob->len > 0 && !ob->failed && write_all(ob->fd, ob->data, ob->len) < 0) {
+        ob->failed = 1;
+    }
+    ob->len = 0;
+}
+
+static void ob_write(out_buf_t *ob, const char *s, size_t len) {
+    if (ob->len + len > sizeof(ob->data)) {
+        ob_flush(ob);
+        if (len > sizeof(ob->data)) {
+            if (!ob->failed && write_all(ob->fd, s, len) < 0) {
+                ob->failed = 1;
+            }
+            return;
+        }
+    }
+    memcpy(ob->data + ob->len, s, len);
+    ob->len += len;
+}
+
+static void ob_putc(out_buf_t *ob, char c) {
+    ob_write(ob, &c, 1);
+}
+
+/**
+ * printf-style append; output too long for the buffer goes through the heap
+ */
+static void ob_format(out_buf_t *ob, const char *fmt, ...) {
+    va_list ap;
+    char small[256];
+
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < sizeof(small)) {
+        ob_write(ob, small, n);
+        return;
+    }
+
+    char *big = malloc(n + 1);
+    if (!big) {
+        ob->failed = 1;
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    ob_write(ob, big, n);
+    free(big);
+}
+
+/**
+ * Finishes a built-in's output; a failed write makes the command fail the
+ * way an external command dying on EPIPE would
+ */
+static int ob_finish(out_buf_t *ob, int status) {
+    ob_flush(ob);
+    return ob->failed ? 1 : status;
+}
+
+/*
+ * cd [dir]
+ */
+static int bi_cd(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    const char *dir = (cmd->argc > 1) ? cmd->argv[1] : getenv("HOME");
+
+    (void)in_fd; (void)out_fd;
+    // Without an argument or HOME there is nowhere to go
+    if (dir && chdir(dir) != 0) {
+        dprintf(err_fd, "cd: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int bi_dragon(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    out_buf_t ob = { .fd = out_fd };
+
+    (void)cmd; (void)in_fd; (void)err_fd;
+    ob_format(&ob, "Here be dragons!\n");
+    return ob_finish(&ob, 0);
+}
+
+/*
+ * memstat
+ *
+ * Reports the current session's arena, so it only runs inline on the
+ * session's own thread
+ */
+static int bi_memstat(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    out_buf_t ob = { .fd = out_fd };
+    cmd_arena_t *arena = &current_session()->arena;
+
+    (void)cmd; (void)in_fd; (void)err_fd;
+    ob_format(&ob, MEMSTAT_FMT, arena->lines, arena->heap_allocs, arena->size);
+    return ob_finish(&ob, 0);
+}
+
+/*
+ * echo [-n] [arg ...]
+ */
+static int bi_echo(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    out_buf_t ob = { .fd = out_fd };
+    int i = 1;
+    int newline = 1;
+
+    (void)in_fd; (void)err_fd;
+    while (i < cmd->argc && strcmp(cmd->argv[i], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; i < cmd->argc; i++) {
+        if (i > first) {
+            ob_putc(&ob, ' ');
+        }
+        ob_write(&ob, cmd->argv[i], strlen(cmd->argv[i]));
+    }
+    if (newline) {
+        ob_putc(&ob, '\n');
+    }
+    return ob_finish(&ob, 0);
+}
+
+/*
+ * pwd
+ */
+static int bi_pwd(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    out_buf_t ob = { .fd = out_fd };
+    char cwd[PATH_MAX];
+
+    (void)cmd; (void)in_fd;
+    if (!getcwd(cwd, sizeof(cwd))) {
+        dprintf(err_fd, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    ob_format(&ob, "%s\n", cwd);
+    return ob_finish(&ob, 0);
+}
+
+/**
+ * Parses a size with an optional K or M suffix
+ */
+static int parse_size(const char *s, long *out) {
+    char *end;
+
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || v < 0 || errno != 0) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        v = (v > INT_MAX / 1024) ? -1 : v * 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        v = (v > INT_MAX / (1024 * 1024)) ? -1 : v * 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || v < 0 || v > INT_MAX) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * set [option=value ...]
+ *
+ * Session options; without arguments lists them.
+ *
+ *   pipesize=SIZE   capacity of every pipe the session creates, with an
+ *                   optional K or M suffix; 0 restores the kernel default.
+ *                   The kernel rounds it up to a power-of-two page count
+ *                   and unprivileged users are capped at
+ *                   /proc/sys/fs/pipe-max-size.
+ *   stats=on|off    time every pipeline as if it were prefixed with time
+ *   pipefail=on|off a pipeline fails if any stage fails (on, the default)
+ *                   or only if its last stage does
+ *   parsecache=on|off
+ *                   reuse the parse of lines seen before (on, the default)
+ */
+static int bi_set(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    dsh_session_t *session = current_session();
+    out_buf_t ob = { .fd = out_fd };
+    int status = 0;
+
+    (void)in_fd;
+    if (cmd->argc == 1) {
+        if (session->pipe_size > 0) {
+            ob_format(&ob, "pipesize=%d\n", session->pipe_size);
+        } else {
+            ob_format(&ob, "pipesize=default\n");
+        }
+        ob_format(&ob, "stats=%s\n", session->stats ? "on" : "off");
+        ob_format(&ob, "pipefail=%s\n", session->pipefail ? "on" : "off");
+        ob_format(&ob, "parsecache=%s\n", session->parse_cache ? "on" : "off");
+        return ob_finish(&ob, 0);
+    }
+
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->argv[i];
+        long size;
+
+        if (strcmp(arg, "stats=on") == 0 || strcmp(arg, "stats=off") == 0) {
+            session->stats = (arg[7] == 'n');
+            continue;
+        }
+        if (strcmp(arg, "pipefail=on") == 0 || strcmp(arg, "pipefail=off") == 0) {
+            session->pipefail = (arg[10] == 'n');
+            continue;
+        }
+        if (strcmp(arg, "parsecache=on") == 0 || strcmp(arg, "parsecache=off") == 0) {
+            session->parse_cache = (arg[12] == 'n');
+            continue;
+        }
+        if (strncmp(arg, "pipesize=", 9) != 0) {
+            dprintf(err_fd, "set: %s: unknown option\n", arg);
+            status = 1;
+            continue;
+        }
+        if (parse_size(arg + 9, &size) < 0) {
+            dprintf(err_fd, "set: %s: invalid size\n", arg + 9);
+            status = 1;
+            continue;
+        }
+        if (size == 0) {
+            session->pipe_size = 0;
+            continue;
+        }
+
+        // Try it on a scratch pipe so a size the kernel refuses fails here
+        // and not on every pipeline, and remember what it rounded to
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) < 0) {
+            dprintf(err_fd, "set: pipe: %s\n", strerror(errno));
+            status = 1;
+            continue;
+        }
+        int actual = fcntl(p[1], F_SETPIPE_SZ, (int)size);
+        int err = errno;
+        close(p[0]);
+        close(p[1]);
+        if (actual < 0) {
+            dprintf(err_fd, "set: pipesize=%s: %s\n", arg + 9, strerror(err));
+            status = 1;
+            continue;
+        }
+        session->pipe_size = actual;
+    }
+    return status;
+}
+
+static int bi_true(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    (void)cmd; (void)in_fd; (void)out_fd; (void)err_fd;
+    return 0;
+}
+
+static int bi_false(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    (void)cmd; (void)in_fd; (void)out_fd; (void)err_fd;
+    return 1;
+}
+
+/**
+ * Emits the backslash escape starting at p and returns its last character
+ */
+static const char *printf_escape(out_buf_t *ob, const char *p) {
+    switch (p[1]) {
+        case 'n':  ob_putc(ob, '\n'); break;
+        case 't':  ob_putc(ob, '\t'); break;
+        case 'r':  ob_putc(ob, '\r'); break;
+        case 'a':  ob_putc(ob, '\a'); break;
+        case 'b':  ob_putc(ob, '\b'); break;
+        case 'f':  ob_putc(ob, '\f'); break;
+        case 'v':  ob_putc(ob, '\v'); break;
+        case '\\': ob_putc(ob, '\\'); break;
+        case '\0':
+            ob_putc(ob, '\\');
+            return p;
+        default:
+            ob_putc(ob, '\\');
+            ob_putc(ob, p[1]);
+            break;
+    }
+    return p + 1;
+}
+
+/**
+ * Converts a printf numeric argument, reporting text that is not a number
+ */
+static int printf_number(const char *arg, int is_signed, long long *sv,
+                         unsigned long long *uv, int err_fd) {
+    char *end;
+
+    errno = 0;
+    if (is_signed) {
+        *sv = strtoll(arg, &end, 0);
+    } else {
+        *uv = strtoull(arg, &end, 0);
+    }
+    if (end == arg || *end != '\0' || errno != 0) {
+        dprintf(err_fd, "printf: %s: invalid number\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * printf format [arg ...]
+ *
+ * Supports %s, %c, %d, %i, %u, %o, %x, %X and %% with flags, width and
+ * precision, plus the usual backslash escapes in the format. As in the
+ * POSIX utility, the format is reused until every argument is consumed.
+ */
+static int bi_printf(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    out_buf_t ob = { .fd = out_fd };
+    int status = 0;
+    int argi = 2;
+
+    (void)in_fd;
+    if (cmd->argc < 2) {
+        dprintf(err_fd, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char *fmt = cmd->argv[1];
+    int pass_start;
+    do {
+        pass_start = argi;
+        for (const char *p = fmt; *p; p++) {
+            if (*p == '\\') {
+                p = printf_escape(&ob, p);
+                continue;
+            }
+            if (*p != '%') {
+                ob_putc(&ob, *p);
+                continue;
+            }
+            if (p[1] == '%') {
+                ob_putc(&ob, '%');
+                p++;
+                continue;
+            }
+
+            // Copy "%[flags][width][.precision]" and append the length modifier
+            const char *start = p++;
+            p += strspn(p, "-+ #0");
+            p += strspn(p, "0123456789");
+            if (*p == '.') {
+                p++;
+                p += strspn(p, "0123456789");
+            }
+            char spec[32];
+            size_t speclen = p - start;
+            if (*p == '\0' || speclen > sizeof(spec) - 4) {
+                dprintf(err_fd, "printf: %s: invalid format\n", fmt);
+                return ob_finish(&ob, 1);
+            }
+            memcpy(spec, start, speclen);
+
+            const char *arg = (argi < cmd->argc) ? cmd->argv[argi++] : NULL;
+            long long sv = 0;
+            unsigned long long uv = 0;
+            switch (*p) {
+                case 's':
+                    strcpy(spec + speclen, "s");
+                    ob_format(&ob, spec, arg ? arg : "");
+                    break;
+                case 'c': {
+                    char c[2] = { arg ? arg[0] : '\0', '\0' };
+                    strcpy(spec + speclen, "s");
+                    ob_format(&ob, spec, c);
+                    break;
+                }
+                case 'd':
+                case 'i':
+                    if (arg) {
+                        status |= printf_number(arg, 1, &sv, &uv, err_fd);
+                    }
+                    strcpy(spec + speclen, "lld");
+                    ob_format(&ob, spec, sv);
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    if (arg) {
+                        status |= printf_number(arg, 0, &sv, &uv, err_fd);
+                    }
+                    spec[speclen] = 'l';
+                    spec[speclen + 1] = 'l';
+                    spec[speclen + 2] = *p;
+                    spec[speclen + 3] = '\0';
+                    ob_format(&ob, spec, uv);
+                    break;
+                default:
+                    dprintf(err_fd, "printf: %%%c: invalid directive\n", *p);
+                    return ob_finish(&ob, 1);
+            }
+        }
+    } while (argi < cmd->argc && argi > pass_start);
+
+    return ob_finish(&ob, status);
+}
+
+static const builtin_desc_t builtins[] = {
+#define BUILTIN(name, id, fn, flags) { name, id, fn, flags },
+#include "builtins.def"
+#undef BUILTIN
+};
+
+/**
+ * Finds a built-in in the registry
+ *
+ * @param name  Command name (argv[0])
+ * @param scope BUILTIN_LOCAL or BUILTIN_REMOTE; entries not available there
+ *              are not returned
+ * @return The registry entry, or NULL if the command must be launched
+ */
+const builtin_desc_t *builtin_lookup(const char *name, unsigned scope) {
+    if (!name) return NULL;
+
+    // Bounded length check first so long program names skip the hash
+    if (strnlen(name, BUILTIN_NAME_MAX + 1) > BUILTIN_NAME_MAX) {
+        return NULL;
+    }
+
+    uint32_t h = builtin_name_hash(BUILTIN_HASH_SEED, name);
+    int idx = builtin_hash_slots[h & (BUILTIN_HASH_SLOTS - 1)];
+    if (idx < 0 || strcmp(name, builtins[idx].name) != 0 ||
+        !(builtins[idx].flags & scope)) {
+        return NULL;
+    }
+    return &builtins[idx];
+}
+
+/**
+ * Runs a built-in with the command's redirections applied
+ *
+ * Redirection targets are opened the way launch_cmd's file actions would
+ * open them and replace the matching descriptor from fds, so a missing
+ * input file or an unwritable output file fails the command with the same
+ * message an external command gets. Here input is read from its memfd.
+ *
+ * @param bi  Registry entry with a handler
+ * @param cmd The parsed command
+ * @param fds Standard streams for the command (-1 keeps the shell's own)
+ * @return The command's exit status
+ */
+int run_builtin(const builtin_desc_t *bi, cmd_buff_t *cmd, const launch_fds_t *fds) {
+    int in_fd = (fds->in >= 0) ? fds->in : STDIN_FILENO;
+    int out_fd = (fds->out >= 0) ? fds->out : STDOUT_FILENO;
+    int err_fd = (fds->err >= 0) ? fds->err : STDERR_FILENO;
+    int in_file = -1;
+    int out_file = -1;
+
+    if (cmd->input_fd >= 0) {
+        in_fd = cmd->input_fd;
+    } else if (cmd->input_file) {
+        in_file = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (in_file < 0) {
+            dprintf(err_fd, "open input file: %s: %s\n", cmd->input_file, strerror(errno));
+            return 1;
+        }
+        in_fd = in_file;
+    }
+    if (cmd->output_file) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append_output ? O_APPEND : O_TRUNC);
+        out_file = open(cmd->output_file, flags, 0644);
+        if (out_file < 0) {
+            dprintf(err_fd, "open output file: %s: %s\n", cmd->output_file, strerror(errno));
+            if (in_file >= 0) {
+                close(in_file);
+            }
+            return 1;
+        }
+        out_fd = out_file;
+    }
+
+    int status = bi->fn(cmd, in_fd, out_fd, err_fd);
+
+    if (in_file >= 0) {
+        close(in_file);
+    }
+    if (out_file >= 0) {
+        close(out_file);
+    }
+    return status;
+}
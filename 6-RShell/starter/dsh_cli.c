@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <getopt.h>
 
@@ -19,7 +22,12 @@ typedef struct cmd_args{
   int   mode;
   char  ip[16];   //e.g., 192.168.100.101\0
   int   port;
-  int   threaded_server;
+  int   server_mode;  //RDSH_SERVER_SINGLE, _THREADED (-x) or _EVENT (-E)
+  int   backlog;      //listen backlog for the server
+  int   workers;      //pre-forked server processes, 0 to serve from this one
+  char  *script;  //run this file (or "-" for stdin) without prompting
+  int   fail_fast;
+  int   zygote;   //launch commands through a zygote helper
 }cmd_args_t;
 
 
@@ -30,26 +38,40 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x | -E] [-b BACKLOG] [-P [-w N]] [-z] [-f SCRIPT [-e]] [-h]\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
   printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -E            Serve every client from one event loop (only valid with -s)\n");
+  printf("  -b BACKLOG    Set the listen backlog (only valid with -s)\n");
+  printf("  -P            Serve from pre-forked worker processes, one per core (only valid with -s)\n");
+  printf("  -w N          Use N pre-forked workers (only valid with -P)\n");
+  printf("  -f SCRIPT     Run commands from SCRIPT (\"-\" for stdin) without prompts;\n");
+  printf("                with -c they are pipelined to the server\n");
+  printf("  -e            Stop a script at the first failing command (only valid with -f)\n");
+  printf("  -z            Launch commands through a zygote helper (not valid with -c)\n");
   printf("  -h            Show this help message\n");
+  printf("  Local input that is not a terminal runs as with -f -, unless %s is set\n",
+         SH_PROMPT_ENV);
   exit(0);
 }
 
 void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
   int opt;
+  int prefork = 0;
+  int workers_set = 0;
   memset(cargs, 0, sizeof(cmd_args_t));
 
   //defaults
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
+  cargs->server_mode = RDSH_SERVER_SINGLE;
+  cargs->backlog = RDSH_DEF_BACKLOG;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt(argc, argv, "csi:p:xEb:Pw:f:ezh")) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
@@ -91,7 +113,61 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
                   fprintf(stderr, "Error: -x can only be used with -s\n");
                   exit(EXIT_FAILURE);
               }
-              cargs->threaded_server = 1;
+              if (cargs->server_mode == RDSH_SERVER_EVENT) {
+                  fprintf(stderr, "Error: Cannot use both -x and -E\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->server_mode = RDSH_SERVER_THREADED;
+              break;
+          case 'E':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -E can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->server_mode == RDSH_SERVER_THREADED) {
+                  fprintf(stderr, "Error: Cannot use both -x and -E\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->server_mode = RDSH_SERVER_EVENT;
+              break;
+          case 'b':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -b can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->backlog = atoi(optarg);
+              if (cargs->backlog <= 0) {
+                  fprintf(stderr, "Error: Invalid backlog\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'P':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -P can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              prefork = 1;
+              if (!workers_set) {
+                  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                  cargs->workers = (cores > 0) ? cores : 1;
+              }
+              break;
+          case 'w':
+              cargs->workers = atoi(optarg);
+              if (cargs->workers <= 0) {
+                  fprintf(stderr, "Error: Invalid number of workers\n");
+                  exit(EXIT_FAILURE);
+              }
+              workers_set = 1;
+              break;
+          case 'f':
+              cargs->script = optarg;
+              break;
+          case 'e':
+              cargs->fail_fast = 1;
+              break;
+          case 'z':
+              cargs->zygote = 1;
               break;
           case 'h':
               print_usage(argv[0]);
@@ -101,19 +177,41 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       }
   }
 
-  if (cargs->threaded_server && cargs->mode != MODE_SSVR) {
-      fprintf(stderr, "Error: -x can only be used with -s\n");
+  if (cargs->server_mode != RDSH_SERVER_SINGLE && cargs->mode != MODE_SSVR) {
+      fprintf(stderr, "Error: -x and -E can only be used with -s\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (workers_set && !prefork) {
+      fprintf(stderr, "Error: -w can only be used with -P\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (cargs->script && cargs->mode == MODE_SSVR) {
+      fprintf(stderr, "Error: -f cannot be used with -s\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (cargs->zygote && cargs->mode == MODE_SCLI) {
+      fprintf(stderr, "Error: -z cannot be used with -c\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (cargs->fail_fast && !cargs->script) {
+      fprintf(stderr, "Error: -e can only be used with -f\n");
       exit(EXIT_FAILURE);
   }
 }
 
 
 
-/* DO NOT EDIT
+/*
  * main() logic fully implemented to:
  *    1. run locally (no parameters)
- *    2. start the server with the -s option
- *    3. start the client with the -c option
+ *    2. run a script locally, or on a server with -c, with the -f option or
+ *       by piping it to local mode
+ *    3. start the server with the -s option
+ *    4. start the client with the -c option
 */
 int main(int argc, char *argv[]){
   cmd_args_t cargs;
@@ -122,23 +220,67 @@ int main(int argc, char *argv[]){
   memset(&cargs, 0, sizeof(cmd_args_t));
   parse_args(argc, argv, &cargs);
 
+  //built-ins write straight into pipes and sockets; a reader that went
+  //away must show up as EPIPE rather than kill the shell
+  signal(SIGPIPE, SIG_IGN);
+
+  //the job reaper reads SIGCHLD from a signalfd, which only sees it if no
+  //thread ever has it unblocked; block it before any thread exists
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld, NULL);
+
+#ifdef DSH_TRACE
+  trace_init();
+#endif
+
+  //fork the zygote while the process is still small and single-threaded;
+  //without one commands are posix_spawn'd directly
+  if (cargs.zygote && zygote_start() != OK){
+    fprintf(stderr, "warning: zygote not started, using posix_spawn\n");
+  }
+
   switch(cargs.mode){
     case MODE_LCLI:
+      //input that is not a terminal is a script; DSH_PROMPT keeps the
+      //interactive transcript for callers that expect it
+      if (!cargs.script && !isatty(STDIN_FILENO)){
+        const char *keep = getenv(SH_PROMPT_ENV);
+        if (!keep || *keep == '\0'){
+          cargs.script = "-";
+        }
+      }
+      if (cargs.script){
+        //scripts only produce their commands' output
+        rc = exec_local_script(cargs.script, cargs.fail_fast);
+        return (rc == OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
       printf("local mode\n");
       rc = exec_local_cmd_loop();
       break;
     case MODE_SCLI:
+      if (cargs.script){
+        //commands are pipelined to the server; only their output is shown
+        rc = exec_remote_script(cargs.ip, cargs.port, cargs.script, cargs.fail_fast);
+        return (rc == OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
       printf("socket client mode:  addr:%s:%d\n", cargs.ip, cargs.port);
       rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
       break;
     case MODE_SSVR:
       printf("socket server mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      if (cargs.threaded_server){
+      if (cargs.server_mode == RDSH_SERVER_THREADED){
         printf("-> Multi-Threaded Mode\n");
+      } else if (cargs.server_mode == RDSH_SERVER_EVENT){
+        printf("-> Event-Driven Mode\n");
       } else {
         printf("-> Single-Threaded Mode\n");
       }
-      rc = start_server(cargs.ip, cargs.port, cargs.threaded_server);
+      if (cargs.workers > 0){
+        printf("-> Pre-forked, %d workers\n", cargs.workers);
+      }
+      rc = start_server(cargs.ip, cargs.port, cargs.server_mode, cargs.backlog, cargs.workers);
       break;
     default:
       printf("error unknown mode\n");
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "dshlib.h"
+
+/*
+ * Parsed command cache
+ *
+ * Polling loops in scripts and remote clients send the same lines again
+ * and again. build_cmd_list looks every line up here first, by an FNV-1a
+ * hash of the raw text confirmed with strcmp. A hit skips tokenizing. The
+ * list gets a fresh stage array in the session arena, one memcpy of the
+ * template's stages. argv vectors and words are borrowed from the
+ * template, which is immutable and reference counted. The executors only
+ * change the stage structs ("time" moves argv, cat drops input_fd), never
+ * what they point to. The list keeps its reference until free_cmd_list,
+ * so a template outlives its eviction while a line still runs from it.
+ *
+ * A line is stored after it parses, unless it needs expand_cmd_list.
+ * Expansion rewrites the tokenized words in place and its result depends
+ * on the filesystem and on command output. Lines longer than
+ * CMD_CACHE_LINE_MAX are not stored, and neither are lines that fail to
+ * parse. The cache holds CMD_CACHE_LINES lines, least recently used out
+ * first, and is shared by every session; "set parsecache=off" keeps a
+ * session out of it.
+ */
+
+#define CMD_CACHE_LINES    64
+#define CMD_CACHE_LINE_MAX 4096
+
+struct cmd_template {
+    uint32_t hash;
+    int refs;            // one for the cache, one per list running from it
+    unsigned long used;  // cache clock at the last lookup
+    unsigned long hits;
+    int num;
+    int background;
+    cmd_buff_t *commands;    // argv and words point into this block
+    char *key;           // the raw line
+};
+
+static struct {
+    pthread_mutex_t lock;
+    cmd_template_t *lines[CMD_CACHE_LINES];
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * FNV-1a over the raw line
+ */
+static uint32_t line_hash(const char *line) {
+    uint32_t h = 2166136261u;
+    while (*line) {
+        h ^= (unsigned char)*line++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Drops a reference; caller holds the lock
+ */
+static void template_unref(cmd_template_t *t) {
+    if (--t->refs == 0) {
+        free(t);
+    }
+}
+
+/**
+ * Finds a line's slot; caller holds the lock
+ */
+static int find_line(const char *line, uint32_t hash) {
+    for (int i = 0; i < CMD_CACHE_LINES; i++) {
+        cmd_template_t *t = cache.lines[i];
+        if (t && t->hash == hash && strcmp(t->key, line) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Copies a parsed list into one immutable block
+ *
+ * @param line  The raw line clist was parsed from
+ * @param len   strlen(line)
+ * @param clist A list fresh from build_cmd_list with expand unset, so
+ *              every word points into clist->_line
+ * @return The template with one reference, or NULL
+ */
+static cmd_template_t *template_create(const char *line, size_t len,
+                                       const command_list_t *clist) {
+    size_t ptrs = 0;
+
+    for (int i = 0; i < clist->num; i++) {
+        ptrs += clist->commands[i].argc + 1;
+    }
+    cmd_template_t *t = malloc(sizeof(*t) + clist->num * sizeof(cmd_buff_t) +
+                               ptrs * sizeof(char *) + 2 * (len + 1));
+    if (!t) {
+        return NULL;
+    }
+    t->refs = 1;
+    t->hits = 0;
+    t->num = clist->num;
+    t->background = clist->background;
+    t->commands = (cmd_buff_t *)(t + 1);
+    char **argv = (char **)(t->commands + t->num);
+    char *words = (char *)(argv + ptrs);
+    t->key = words + len + 1;
+    memcpy(words, clist->_line, len + 1);
+    memcpy(t->key, line, len + 1);
+
+// Same offset into the template's copy of the tokenized line
+#define REBASE(p) ((p) ? words + ((p) - clist->_line) : NULL)
+    for (int i = 0; i < t->num; i++) {
+        const cmd_buff_t *src = &clist->commands[i];
+        cmd_buff_t *dst = &t->commands[i];
+
+        *dst = *src;
+        dst->argv = argv;
+        dst->_argv_cap = src->argc + 1;
+        dst->_cmd_buffer = NULL;
+        dst->input_fd = -1;
+        dst->input_file = REBASE(src->input_file);
+        dst->output_file = REBASE(src->output_file);
+        for (int a = 0; a < src->argc; a++) {
+            argv[a] = REBASE(src->argv[a]);
+        }
+        argv[src->argc] = NULL;
+        argv += src->argc + 1;
+    }
+#undef REBASE
+    return t;
+}
+
+/**
+ * Builds a list from the cached parse of a line
+ *
+ * On a hit the list's stages are copied into the session arena and
+ * borrow the rest from the template; free_cmd_list lets go of it.
+ *
+ * @param line  The raw command line
+ * @param clist The list to fill; build_cmd_list has set _mark
+ * @return 1 on a hit, 0 if the line must be parsed
+ */
+int cmd_cache_lookup(const char *line, command_list_t *clist) {
+    cmd_template_t *t = NULL;
+
+    // Too long to have been stored; not worth hashing
+    if (strnlen(line, CMD_CACHE_LINE_MAX + 1) > CMD_CACHE_LINE_MAX) {
+        return 0;
+    }
+    uint32_t hash = line_hash(line);
+
+    pthread_mutex_lock(&cache.lock);
+    int slot = find_line(line, hash);
+    if (slot >= 0) {
+        t = cache.lines[slot];
+        t->refs++;
+        t->hits++;
+        t->used = ++cache.clock;
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    if (!t) {
+        return 0;
+    }
+
+    clist->commands = arena_alloc(&current_session()->arena, t->num * sizeof(cmd_buff_t));
+    if (!clist->commands) {
+        cmd_cache_release(t);
+        return 0;
+    }
+    memcpy(clist->commands, t->commands, t->num * sizeof(cmd_buff_t));
+    clist->num = t->num;
+    clist->_cap = t->num;
+    clist->background = t->background;
+    clist->expand = 0;
+    clist->_tmpl = t;
+    return 1;
+}
+
+/**
+ * Remembers the parse of a line, evicting the least recently used one
+ *
+ * @param line  The raw command line
+ * @param clist Its parse, fresh from build_cmd_list
+ */
+void cmd_cache_store(const char *line, const command_list_t *clist) {
+    size_t len = strnlen(line, CMD_CACHE_LINE_MAX + 1);
+
+    if (clist->expand || len > CMD_CACHE_LINE_MAX) {
+        return;
+    }
+    cmd_template_t *t = template_create(line, len, clist);
+    if (!t) {
+        return;
+    }
+    t->hash = line_hash(line);
+
+    pthread_mutex_lock(&cache.lock);
+    if (find_line(line, t->hash) >= 0) {
+        // Another session stored it first
+        template_unref(t);
+    } else {
+        int victim = 0;
+        for (int i = 0; i < CMD_CACHE_LINES; i++) {
+            if (!cache.lines[i]) {
+                victim = i;
+                break;
+            }
+            if (cache.lines[i]->used < cache.lines[victim]->used) {
+                victim = i;
+            }
+        }
+        if (cache.lines[victim]) {
+            template_unref(cache.lines[victim]);
+        }
+        t->used = ++cache.clock;
+        cache.lines[victim] = t;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Lets go of the template a list was built from
+ *
+ * @param t The list's _tmpl
+ */
+void cmd_cache_release(cmd_template_t *t) {
+    if (!t) return;
+
+    pthread_mutex_lock(&cache.lock);
+    template_unref(t);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Forgets every cached line; lists running from one keep it until freed
+ */
+void cmd_cache_clear(void) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < CMD_CACHE_LINES; i++) {
+        if (cache.lines[i]) {
+            template_unref(cache.lines[i]);
+            cache.lines[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Implements the parsecache built-in
+ *
+ *   parsecache      list cached lines with their hit counts and the
+ *                   cache's hit and miss totals
+ *   parsecache -r   forget every cached line and zero the totals
+ *
+ * @param cmd    The parsed parsecache command
+ * @param out_fd Descriptor for the listing
+ * @param err_fd Descriptor for usage errors
+ * @return 0, or 2 on a bad option
+ */
+int cmd_cache_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    (void)in_fd;
+    if (cmd->argc == 2 && strcmp(cmd->argv[1], "-r") == 0) {
+        cmd_cache_clear();
+        pthread_mutex_lock(&cache.lock);
+        cache.hits = 0;
+        cache.misses = 0;
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+    if (cmd->argc != 1) {
+        dprintf(err_fd, "usage: parsecache [-r]\n");
+        return 2;
+    }
+
+    // The listing can block on a full pipe, so it is written from a
+    // snapshot: each template is held by a reference, its key being
+    // immutable, and the lock is dropped before the first write
+    cmd_template_t *lines[CMD_CACHE_LINES];
+    unsigned long hits[CMD_CACHE_LINES];
+    int count = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < CMD_CACHE_LINES; i++) {
+        if (cache.lines[i]) {
+            lines[count] = cache.lines[i];
+            hits[count++] = cache.lines[i]->hits;
+            cache.lines[i]->refs++;
+        }
+    }
+    unsigned long total_hits = cache.hits;
+    unsigned long total_misses = cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+
+    for (int i = 0; i < count; i++) {
+        if (i == 0) {
+            dprintf(out_fd, "hits\tline\n");
+        }
+        dprintf(out_fd, "%4lu\t%s\n", hits[i], lines[i]->key);
+    }
+    dprintf(out_fd, "parsecache: %d of %d lines, %lu hits, %lu misses\n",
+            count, CMD_CACHE_LINES, total_hits, total_misses);
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < count; i++) {
+        template_unref(lines[i]);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include "dshlib.h"
+
+/*
+ * Zero-copy file I/O
+ *
+ * fd_copy moves everything readable on one descriptor to another without
+ * bouncing it through a user-space buffer when the kernel can avoid it:
+ *
+ *   file -> file        copy_file_range (reflink or in-kernel copy)
+ *   pipe on either end  splice
+ *   file -> anything    sendfile
+ *
+ * Each call works on the descriptors' own file offsets, so when a method
+ * turns out not to apply to this pair (a filesystem without
+ * copy_file_range, a terminal that cannot be spliced to, O_APPEND output)
+ * the next one resumes exactly where it stopped, ending with a plain
+ * read/write loop that works on anything. The cat built-in is the shell's
+ * user of it: "cat big | cmd", "cmd | cat > out" and "cat < a > b" all
+ * run at the speed of the device rather than of memcpy.
+ */
+
+#define COPY_CHUNK    0x7ffff000    // largest count sendfile moves per call
+#define SPLICE_CHUNK  (1 << 20)
+#define COPY_BUF_SZ   (64 * 1024)
+
+typedef enum {
+    VIA_COPY_RANGE,
+    VIA_SPLICE,
+    VIA_SENDFILE,
+} copy_via_t;
+
+typedef enum {
+    COPY_EOF,            // the source is exhausted
+    COPY_FAILED,         // errno says why
+    COPY_UNSUPPORTED,    // this method does not apply; try the next one
+} copy_result_t;
+
+/**
+ * Errors a zero-copy call reports for a descriptor pair it cannot handle,
+ * as opposed to an I/O error the copy as a whole should fail on
+ */
+static int not_supported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+           err == EOPNOTSUPP || err == ESPIPE;
+}
+
+static ssize_t copy_step(copy_via_t via, int in_fd, int out_fd) {
+    switch (via) {
+        case VIA_COPY_RANGE:
+            return copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        case VIA_SPLICE:
+            return splice(in_fd, NULL, out_fd, NULL, SPLICE_CHUNK,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+        case VIA_SENDFILE:
+            return sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Copies with one zero-copy method until EOF or until it stops applying
+ */
+static copy_result_t copy_via(copy_via_t via, int in_fd, int out_fd) {
+    while (1) {
+        ssize_t n = copy_step(via, in_fd, out_fd);
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return COPY_EOF;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return not_supported(errno) ? COPY_UNSUPPORTED : COPY_FAILED;
+    }
+}
+
+/**
+ * The portable fallback: read into a buffer, write it out
+ */
+static int copy_rw(int in_fd, int out_fd) {
+    char buf[COPY_BUF_SZ];
+
+    while (1) {
+        ssize_t r = read(in_fd, buf, sizeof(buf));
+        if (r == 0) {
+            return 0;
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t off = 0; off < r; ) {
+            ssize_t w = write(out_fd, buf + off, r - off);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            off += w;
+        }
+    }
+}
+
+/**
+ * Copies from in_fd's current offset to its end into out_fd
+ *
+ * @param in_fd  Source descriptor, read from its current offset
+ * @param out_fd Destination descriptor, written at its current offset
+ * @return 0 once the source is exhausted, -1 with errno set on an I/O error
+ */
+int fd_copy(int in_fd, int out_fd) {
+    struct stat ist, ost;
+    copy_result_t res = COPY_UNSUPPORTED;
+
+    if (fstat(in_fd, &ist) < 0 || fstat(out_fd, &ost) < 0) {
+        return -1;
+    }
+
+    // Pseudo-files report a zero size and copy_file_range would stop at once
+    if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode) && ist.st_size > 0) {
+        res = copy_via(VIA_COPY_RANGE, in_fd, out_fd);
+    }
+    if (res == COPY_UNSUPPORTED && (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))) {
+        res = copy_via(VIA_SPLICE, in_fd, out_fd);
+    }
+    if (res == COPY_UNSUPPORTED && (S_ISREG(ist.st_mode) || S_ISBLK(ist.st_mode))) {
+        res = copy_via(VIA_SENDFILE, in_fd, out_fd);
+    }
+
+    switch (res) {
+        case COPY_EOF:
+            return 0;
+        case COPY_FAILED:
+            return -1;
+        case COPY_UNSUPPORTED:
+            break;
+    }
+    return copy_rw(in_fd, out_fd);
+}
+
+/**
+ * Hands a cat with options to the real utility, with the standard streams
+ * the built-in was given
+ */
+static int cat_external(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    cmd_buff_t plain = *cmd;
+    launch_fds_t fds = { in_fd, out_fd, err_fd };
+    pid_t pid;
+    int ws = 0;
+
+    // run_builtin already applied the redirections to the descriptors
+    plain.input_file = NULL;
+    plain.input_fd = -1;
+    plain.output_file = NULL;
+    if (launch_cmd(&plain, &fds, &pid) != OK) {
+        return 127;
+    }
+    while (waitpid(pid, &ws, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+}
+
+/**
+ * Implements cat [file ...]
+ *
+ * Copies each file, or stdin for "-" or no arguments, to stdout with
+ * fd_copy. Any option is passed through to the external cat. A reader
+ * that goes away ends the copy with status 128 + SIGPIPE, the status an
+ * external cat killed by SIGPIPE would have.
+ *
+ * @param cmd    The parsed cat command
+ * @param in_fd  Descriptor read for "-"
+ * @param out_fd Descriptor the files are copied to
+ * @param err_fd Descriptor for errors
+ * @return 0, 1 if any file could not be copied, or 128 + SIGPIPE
+ */
+int cat_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    struct stat ost;
+    int have_ost = (fstat(out_fd, &ost) == 0);
+    int status = 0;
+
+    for (int i = 1; i < cmd->argc; i++) {
+        if (cmd->argv[i][0] == '-' && cmd->argv[i][1] != '\0') {
+            return cat_external(cmd, in_fd, out_fd, err_fd);
+        }
+    }
+
+    int nfiles = (cmd->argc > 1) ? cmd->argc - 1 : 1;
+    for (int i = 0; i < nfiles; i++) {
+        const char *name = (cmd->argc > 1) ? cmd->argv[i + 1] : "-";
+        int fd = in_fd;
+
+        if (strcmp(name, "-") != 0 && (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+            dprintf(err_fd, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        // Appending a file to itself would never reach EOF
+        struct stat ist;
+        if (have_ost && S_ISREG(ost.st_mode) && fstat(fd, &ist) == 0 &&
+            ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino && ist.st_size > 0) {
+            dprintf(err_fd, "cat: %s: input file is output file\n", name);
+            status = 1;
+        } else if (fd_copy(fd, out_fd) < 0) {
+            int err = errno;
+            if (err == EPIPE) {
+                if (fd != in_fd) {
+                    close(fd);
+                }
+                return 128 + SIGPIPE;
+            }
+            dprintf(err_fd, "cat: %s: %s\n", name, strerror(err));
+            status = 1;
+        }
+        if (fd != in_fd) {
+            close(fd);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dshlib.h"
+
+/*
+ * Here-strings, here-documents and command substitution
+ *
+ * "cmd <<< word", "cmd << DELIM" (the body is the lines that follow, up to
+ * one that is exactly DELIM) and "$(pipeline)" never touch the filesystem.
+ * The data for a here-string or here-document is written to a memfd that
+ * stands in for the command's input file: launch_cmd dup2s it onto stdin
+ * where it would otherwise open input_file, and run_builtin hands it to
+ * the built-in directly. A substitution runs its pipeline with stdout on
+ * a memfd, then splices the output, trailing newlines removed, into the
+ * word; outside double quotes the output is split into words on blanks.
+ * Writing to a memfd rather than a pipe means the shell never has to
+ * drain a command while it runs, however much it prints.
+ *
+ * tokenize_stage leaves the text of each $(...) between SUBST_OPEN (or
+ * SUBST_OPEN_QUOTED) and SUBST_CLOSE and sets clist->expand;
+ * expand_cmd_list does the rest before the line runs, ending with
+ * pathname expansion (dsh_glob.c) of the resulting words. Here-document
+ * bodies are taken literally. A remote client sends one line per
+ * request, so over rsh a here-document has no body.
+ */
+
+#define SUBST_BLANKS " \t\n"
+
+static const char subst_open[] = { SUBST_OPEN, SUBST_OPEN_QUOTED, '\0' };
+static const char glob_marks[] = { GLOB_ANY, GLOB_ONE, GLOB_CLASS, '\0' };
+static const char expand_marks[] = {
+    SUBST_OPEN, SUBST_OPEN_QUOTED, GLOB_ANY, GLOB_ONE, GLOB_CLASS, '\0'
+};
+
+// Words a stage expands to, built one field at a time
+typedef struct field_buf {
+    char *buf;           // field being built, on the heap
+    size_t len;
+    size_t cap;
+    int started;         // the field exists even if empty, as "$(true)" does
+    char **fields;       // finished fields; the strings are in the arena
+    int num;
+    int cap_fields;
+} field_buf_t;
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fb_append(field_buf_t *fb, const char *data, size_t len) {
+    if (fb->len + len + 1 > fb->cap) {
+        size_t cap = fb->cap ? fb->cap : 64;
+        while (cap < fb->len + len + 1) {
+            cap *= 2;
+        }
+        char *grown = realloc(fb->buf, cap);
+        if (!grown) {
+            return ERR_MEMORY;
+        }
+        fb->buf = grown;
+        fb->cap = cap;
+    }
+    memcpy(fb->buf + fb->len, data, len);
+    fb->len += len;
+    fb->started = 1;
+    return OK;
+}
+
+/**
+ * Adds an already finished word as a field
+ */
+static int fb_push(field_buf_t *fb, char *word) {
+    if (fb->num == fb->cap_fields) {
+        int cap = fb->cap_fields ? 2 * fb->cap_fields : CMD_ARGV_MAX;
+        char **grown = realloc(fb->fields, cap * sizeof(char *));
+        if (!grown) {
+            return ERR_MEMORY;
+        }
+        fb->fields = grown;
+        fb->cap_fields = cap;
+    }
+    fb->fields[fb->num++] = word;
+    return OK;
+}
+
+/**
+ * Ends the field being built, copying it into the arena, if there is one
+ */
+static int fb_finish(field_buf_t *fb) {
+    if (!fb->started) {
+        return OK;
+    }
+    char *word = arena_alloc(&current_session()->arena, fb->len + 1);
+    if (!word) {
+        return ERR_MEMORY;
+    }
+    memcpy(word, fb->buf, fb->len);
+    word[fb->len] = '\0';
+    fb->len = 0;
+    fb->started = 0;
+    return fb_push(fb, word);
+}
+
+/**
+ * Reads everything a substitution wrote to its memfd
+ *
+ * @return OK with *out on the heap, or ERR_MEMORY
+ */
+static int read_output(int fd, char **out, size_t *len) {
+    struct stat st;
+    size_t have = 0;
+
+    if (fstat(fd, &st) < 0) {
+        st.st_size = 0;
+    }
+    if (!(*out = malloc(st.st_size + 1))) {
+        return ERR_MEMORY;
+    }
+    while (have < (size_t)st.st_size) {
+        ssize_t n = pread(fd, *out + have, st.st_size - have, have);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        have += n;
+    }
+    while (have > 0 && (*out)[have - 1] == '\n') {
+        have--;
+    }
+    (*out)[have] = '\0';
+    *len = have;
+    return OK;
+}
+
+/**
+ * Runs the pipeline inside one $(...) and collects its output
+ *
+ * Locally the pipeline reads the shell's stdin, as in sh. For a client of
+ * the server that is the server's own stdin, so there it reads /dev/null,
+ * like the commands around it.
+ *
+ * @param text   The pipeline as written between the parentheses
+ * @param scope  BUILTIN_LOCAL or BUILTIN_REMOTE
+ * @param err_fd Descriptor for the pipeline's stderr
+ * @param out    Receives the output on the heap, trailing newlines removed
+ * @param len    Receives its length
+ * @return OK, ERR_CMD_ARGS_BAD if the text does not parse, ERR_EXEC_CMD or
+ *         ERR_MEMORY
+ */
+static int run_subst(char *text, unsigned scope, int err_fd, char **out, size_t *len) {
+    command_list_t inner;
+    int fd = memfd_create("dsh-subst", MFD_CLOEXEC);
+
+    if (fd < 0) {
+        dprintf(err_fd, "memfd_create: %s\n", strerror(errno));
+        return ERR_EXEC_CMD;
+    }
+
+    int rc = build_cmd_list(text, &inner);
+    if (rc == OK) {
+        rc = expand_cmd_list(&inner, scope, err_fd, NULL);
+    }
+    if (rc == OK) {
+        pipeline_stage_t *stages = arena_alloc(&current_session()->arena,
+                                               inner.num * sizeof(pipeline_stage_t));
+        if (!stages) {
+            rc = ERR_MEMORY;
+        } else {
+            memset(stages, 0, inner.num * sizeof(pipeline_stage_t));
+            launch_fds_t ends = { -1, fd, err_fd };
+            if (scope == BUILTIN_REMOTE &&
+                (ends.in = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+                dprintf(err_fd, "/dev/null: %s\n", strerror(errno));
+                rc = ERR_EXEC_CMD;
+            } else {
+                launch_pipeline(&inner, &ends, scope, stages);
+                wait_pipeline(stages, inner.num, NULL);
+                if (ends.in >= 0) {
+                    close(ends.in);
+                }
+            }
+        }
+    }
+    free_cmd_list(&inner);
+
+    // "$()" and "$(   )" are just empty
+    if (rc == WARN_NO_CMDS) {
+        rc = OK;
+    }
+    if (rc == OK) {
+        rc = read_output(fd, out, len);
+    }
+    close(fd);
+    return rc;
+}
+
+/**
+ * Expands the substitutions in one word into fields
+ *
+ * @param word   A word holding SUBST_OPEN ... SUBST_CLOSE sections
+ * @param split  Split unquoted output on blanks; otherwise the word stays
+ *               one field
+ * @param fb     Fields are appended here
+ * @return OK or the error run_subst reported
+ */
+static int expand_word(char *word, bool split, unsigned scope, int err_fd, field_buf_t *fb) {
+    char *p = word;
+    int rc = OK;
+
+    while (rc == OK && *p) {
+        if (*p != SUBST_OPEN && *p != SUBST_OPEN_QUOTED) {
+            size_t lit = strcspn(p, subst_open);
+            rc = fb_append(fb, p, lit);
+            p += lit;
+            continue;
+        }
+
+        bool quoted = (*p == SUBST_OPEN_QUOTED);
+        char *end = strchr(p, SUBST_CLOSE);
+        char *out = NULL;
+        size_t len = 0;
+
+        // The word is in the line's own buffer; end it there just long
+        // enough for build_cmd_list to take a copy
+        *end = '\0';
+        rc = run_subst(p + 1, scope, err_fd, &out, &len);
+        *end = SUBST_CLOSE;
+        p = end + 1;
+        if (rc != OK) {
+            break;
+        }
+
+        if (quoted || !split) {
+            rc = fb_append(fb, out, len);
+        } else {
+            for (char *o = out; rc == OK && *o; ) {
+                size_t run = strcspn(o, SUBST_BLANKS);
+                if (run > 0) {
+                    rc = fb_append(fb, o, run);
+                    o += run;
+                } else {
+                    rc = fb_finish(fb);
+                    o += strspn(o, SUBST_BLANKS);
+                }
+            }
+        }
+        free(out);
+    }
+    return rc;
+}
+
+/**
+ * Expands a redirection target or here-string to a single string
+ */
+static int expand_to_string(char **word, unsigned scope, int err_fd) {
+    field_buf_t fb = {0};
+
+    int rc = expand_word(*word, false, scope, err_fd, &fb);
+    fb.started = 1;
+    if (rc == OK && (rc = fb_finish(&fb)) == OK) {
+        *word = fb.fields[0];
+    }
+    free(fb.buf);
+    free(fb.fields);
+    return rc;
+}
+
+static int glob_emit(void *arg, const char *path) {
+    size_t len = strlen(path) + 1;
+    char *copy = arena_alloc(&current_session()->arena, len);
+
+    if (!copy) {
+        return ERR_MEMORY;
+    }
+    memcpy(copy, path, len);
+    return fb_push(arg, copy);
+}
+
+/**
+ * Adds a field to argv, or the paths it matches if it has wildcards
+ */
+static int glob_field(field_buf_t *fb, char *word) {
+    if (!strpbrk(word, glob_marks)) {
+        return fb_push(fb, word);
+    }
+    int n = glob_word(word, glob_emit, fb);
+    if (n < 0) {
+        return n;
+    }
+    if (n == 0) {
+        glob_unmark(word);
+        return fb_push(fb, word);
+    }
+    return OK;
+}
+
+/**
+ * Expands every substitution and wildcard in a stage's argv, and the
+ * substitutions in its redirections
+ *
+ * The new argv is sized to what the expansion produced, with no cap.
+ */
+static int expand_stage(cmd_buff_t *cmd, unsigned scope, int err_fd) {
+    int rc = OK;
+    bool marked = false;
+
+    for (int a = 0; a < cmd->argc && !marked; a++) {
+        marked = (strpbrk(cmd->argv[a], expand_marks) != NULL);
+    }
+    if (marked) {
+        field_buf_t words = {0};    // after substitution
+        field_buf_t fb = {0};       // after pathname expansion
+
+        for (int a = 0; rc == OK && a < cmd->argc; a++) {
+            if (strpbrk(cmd->argv[a], subst_open)) {
+                if ((rc = expand_word(cmd->argv[a], true, scope, err_fd, &words)) == OK) {
+                    rc = fb_finish(&words);
+                }
+            } else {
+                rc = fb_push(&words, cmd->argv[a]);
+            }
+        }
+        for (int i = 0; rc == OK && i < words.num; i++) {
+            rc = glob_field(&fb, words.fields[i]);
+        }
+        free(words.buf);
+        free(words.fields);
+
+        char **argv = NULL;
+        if (rc == OK && !(argv = arena_alloc(&current_session()->arena,
+                                             (fb.num + 1) * sizeof(char *)))) {
+            rc = ERR_MEMORY;
+        }
+        if (rc == OK) {
+            for (int a = 0; a < fb.num; a++) {
+                argv[a] = fb.fields[a];
+            }
+            argv[fb.num] = NULL;
+            cmd->argv = argv;
+            cmd->argc = fb.num;
+            cmd->_argv_cap = fb.num + 1;
+        }
+        free(fb.buf);
+        free(fb.fields);
+    }
+
+    if (rc == OK && cmd->output_file && strpbrk(cmd->output_file, subst_open)) {
+        rc = expand_to_string(&cmd->output_file, scope, err_fd);
+    }
+    if (rc == OK && cmd->input_file && cmd->input_kind != INPUT_HEREDOC &&
+        strpbrk(cmd->input_file, subst_open)) {
+        rc = expand_to_string(&cmd->input_file, scope, err_fd);
+    }
+    return rc;
+}
+
+/**
+ * Makes a here-string's memfd: the word and a newline
+ */
+static int load_herestring(cmd_buff_t *cmd, int err_fd) {
+    int fd = memfd_create("dsh-herestring", MFD_CLOEXEC);
+
+    if (fd < 0 || write_all(fd, cmd->input_file, strlen(cmd->input_file)) < 0 ||
+        write_all(fd, "\n", 1) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        dprintf(err_fd, "here-string: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ERR_EXEC_CMD;
+    }
+    cmd->input_fd = fd;
+    return OK;
+}
+
+/**
+ * Reads a here-document's body into a memfd, up to its delimiter line
+ *
+ * @param cmd    The stage; input_file is the delimiter
+ * @param rd     Where the body comes from, or NULL if there is none
+ * @param err_fd Descriptor for errors
+ * @return OK, or ERR_EXEC_CMD if the memfd could not be written
+ */
+static int load_heredoc(cmd_buff_t *cmd, line_reader_t *rd, int err_fd) {
+    int fd = memfd_create("dsh-heredoc", MFD_CLOEXEC);
+    int failed = (fd < 0);
+    char *line;
+
+    // The body is consumed even if it cannot be kept, so it never runs
+    while (1) {
+        if (!rd || !(line = reader_next_line(rd))) {
+            dprintf(err_fd, "warning: here-document ended by end of input (wanted '%s')\n",
+                    cmd->input_file);
+            break;
+        }
+        if (strcmp(line, cmd->input_file) == 0) {
+            break;
+        }
+        if (!failed) {
+            size_t len = strlen(line);
+            line[len] = '\n';       // the reader's '\0' stood where the newline was
+            failed = (write_all(fd, line, len + 1) < 0);
+            line[len] = '\0';
+        }
+    }
+
+    if (failed || lseek(fd, 0, SEEK_SET) < 0) {
+        dprintf(err_fd, "here-document: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ERR_EXEC_CMD;
+    }
+    cmd->input_fd = fd;
+    return OK;
+}
+
+/**
+ * Tells whether expanding a line would run a $(...) substitution
+ *
+ * Lets a caller that must not block, such as the -E event loop, move the
+ * expansion elsewhere only for the lines that need it.
+ *
+ * @param clist A list fresh from build_cmd_list
+ * @return 1 if a word or redirection of some stage holds a $(...), else 0
+ */
+int cmd_list_substitutes(const command_list_t *clist) {
+    if (!clist || !clist->expand) return 0;
+
+    for (int i = 0; i < clist->num; i++) {
+        const cmd_buff_t *cmd = &clist->commands[i];
+        for (int a = 0; a < cmd->argc; a++) {
+            if (strpbrk(cmd->argv[a], subst_open)) {
+                return 1;
+            }
+        }
+        if ((cmd->output_file && strpbrk(cmd->output_file, subst_open)) ||
+            (cmd->input_file && cmd->input_kind != INPUT_HEREDOC &&
+             strpbrk(cmd->input_file, subst_open))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Gets a parsed line ready to run: reads here-document bodies, runs
+ * command substitutions and loads here input into memfds
+ *
+ * Does nothing unless build_cmd_list set clist->expand. Here-document
+ * bodies are read first, in order, so they are consumed even when the line
+ * goes on to fail. A stage left with no words after expansion is dropped.
+ * On any return other than OK the caller frees the list as usual.
+ *
+ * @param clist  A list fresh from build_cmd_list
+ * @param scope  BUILTIN_LOCAL or BUILTIN_REMOTE, for substitutions
+ * @param err_fd Descriptor for substitutions' stderr and for errors
+ * @param rd     Reader the line came from, for here-document bodies, or NULL
+ * @return OK, WARN_NO_CMDS if nothing is left to run, ERR_CMD_ARGS_BAD if a
+ *         substitution does not parse, ERR_EXEC_CMD or ERR_MEMORY
+ */
+int expand_cmd_list(command_list_t *clist, unsigned scope, int err_fd, line_reader_t *rd) {
+    int rc = OK;
+
+    if (!clist || !clist->expand) return OK;
+
+    for (int i = 0; i < clist->num; i++) {
+        if (clist->commands[i].input_kind == INPUT_HEREDOC) {
+            int hrc = load_heredoc(&clist->commands[i], rd, err_fd);
+            if (rc == OK) {
+                rc = hrc;
+            }
+        }
+    }
+    for (int i = 0; rc == OK && i < clist->num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        if ((rc = expand_stage(cmd, scope, err_fd)) == OK &&
+            cmd->input_kind == INPUT_HERESTRING) {
+            rc = load_herestring(cmd, err_fd);
+        }
+    }
+    if (rc != OK) {
+        return rc;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < clist->num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        if (cmd->argc > 0) {
+            clist->commands[kept++] = *cmd;
+        } else if (cmd->input_fd >= 0) {
+            close(cmd->input_fd);
+        }
+    }
+    clist->num = kept;
+    clist->expand = 0;
+    return (kept > 0) ? OK : WARN_NO_CMDS;
+}
@@ -0,0 +1,476 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dshlib.h"
+
+/*
+ * Pathname expansion
+ *
+ * tokenize_stage swaps every unquoted '*', '?' and '[' in a command word
+ * for GLOB_ANY, GLOB_ONE and GLOB_CLASS, so quoted ones stay literal, and
+ * expand_cmd_list hands each such word to glob_word. The pattern is walked
+ * one path component at a time: a component without wildcards is taken
+ * as written, the others are matched against the directory's listing.
+ * Matches come out sorted. A leading '.' has to be matched by a literal
+ * '.', and "." and ".." never match. A word that matches nothing is kept
+ * as written. Only wildcards typed on the line expand; the output of a
+ * $(...) is not globbed.
+ *
+ * Listings are read with getdents64 into a GLOB_DENTS_BUF buffer, so a
+ * directory with hundreds of thousands of entries costs a few dozen
+ * system calls, then sorted once and cached under the directory's device
+ * and inode. A cached listing is used for as long as the directory's
+ * mtime, which moves whenever an entry is added, removed or renamed, is
+ * unchanged, so a glob over a known directory costs one stat. Timestamps
+ * are coarse, so a change in the same tick as the read can leave the
+ * mtime as it was; as git does with racy index entries, a listing is only
+ * cached once its mtime is from an earlier second than the read. The cache
+ * holds GLOB_CACHE_DIRS directories, least recently used out first, and
+ * is shared by every session; a listing is reference counted so one being
+ * matched outlives its eviction.
+ */
+
+#define GLOB_CACHE_DIRS 32
+#define GLOB_DENTS_BUF  (256 * 1024)
+
+typedef struct dir_entry {
+    uint32_t name;       // offset into the listing's names
+    unsigned char type;  // d_type
+} dir_entry_t;
+
+typedef struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *names;         // NUL-terminated names back to back
+    dir_entry_t *entries;    // sorted by name
+    size_t count;
+    int refs;            // one for the cache, one per glob using it
+    unsigned long used;  // cache clock at the last lookup
+} dir_listing_t;
+
+static struct {
+    pthread_mutex_t lock;
+    dir_listing_t *dirs[GLOB_CACHE_DIRS];
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Drops a reference; caller holds the lock
+ */
+static void listing_unref(dir_listing_t *dl) {
+    if (--dl->refs == 0) {
+        free(dl->names);
+        free(dl->entries);
+        free(dl);
+    }
+}
+
+static int entry_cmp(const void *a, const void *b, void *names) {
+    return strcmp((char *)names + ((const dir_entry_t *)a)->name,
+                  (char *)names + ((const dir_entry_t *)b)->name);
+}
+
+/**
+ * Reads a whole directory with getdents64 and sorts it
+ *
+ * @param fd Open directory, at its start
+ * @return The listing with no references, or NULL
+ */
+static dir_listing_t *read_listing(int fd) {
+    dir_listing_t *dl = calloc(1, sizeof(*dl));
+    char *buf = malloc(GLOB_DENTS_BUF);
+    size_t names_len = 0, names_cap = 0, cap = 0;
+    ssize_t n;
+
+    if (!dl || !buf) {
+        goto fail;
+    }
+    while ((n = getdents64(fd, buf, GLOB_DENTS_BUF)) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            size_t len = strlen(d->d_name) + 1;
+            if (names_len + len > names_cap) {
+                names_cap = names_cap ? 2 * names_cap : 16384;
+                while (names_cap < names_len + len) {
+                    names_cap *= 2;
+                }
+                char *grown = realloc(dl->names, names_cap);
+                if (!grown) {
+                    goto fail;
+                }
+                dl->names = grown;
+            }
+            if (dl->count == cap) {
+                cap = cap ? 2 * cap : 256;
+                dir_entry_t *grown = realloc(dl->entries, cap * sizeof(dir_entry_t));
+                if (!grown) {
+                    goto fail;
+                }
+                dl->entries = grown;
+            }
+            memcpy(dl->names + names_len, d->d_name, len);
+            dl->entries[dl->count].name = names_len;
+            dl->entries[dl->count].type = d->d_type;
+            dl->count++;
+            names_len += len;
+        }
+    }
+    if (n < 0) {
+        goto fail;
+    }
+    qsort_r(dl->entries, dl->count, sizeof(dir_entry_t), entry_cmp, dl->names);
+    free(buf);
+    return dl;
+
+fail:
+    if (dl) {
+        free(dl->names);
+        free(dl->entries);
+        free(dl);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Returns the listing of a directory, from the cache while its mtime holds
+ *
+ * @param dir Directory path, "." for the working directory
+ * @return A listing the caller releases with listing_put, or NULL if dir
+ *         is not a readable directory
+ */
+static dir_listing_t *listing_get(const char *dir) {
+    struct stat st;
+    dir_listing_t *dl = NULL;
+
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        dir_listing_t *c = cache.dirs[i];
+        if (c && c->dev == st.st_dev && c->ino == st.st_ino &&
+            c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            c->refs++;
+            c->used = ++cache.clock;
+            cache.hits++;
+            dl = c;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    if (dl) {
+        return dl;
+    }
+
+    // The key comes from the descriptor that is read, taken before the
+    // read, so a change made meanwhile moves the mtime past it unless it
+    // falls in the same tick; see racy below
+    struct timespec read_at;
+    clock_gettime(CLOCK_REALTIME_COARSE, &read_at);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (dl = read_listing(fd))) {
+        dl->dev = st.st_dev;
+        dl->ino = st.st_ino;
+        dl->mtime = st.st_mtim;
+    }
+    close(fd);
+    if (!dl) {
+        return NULL;
+    }
+
+    // A directory changed in the second it was read may change again without
+    // its mtime moving, so its listing serves this glob only
+    bool racy = dl->mtime.tv_sec >= read_at.tv_sec;
+
+    pthread_mutex_lock(&cache.lock);
+    cache.misses++;
+    if (racy) {
+        dl->refs = 1;
+        pthread_mutex_unlock(&cache.lock);
+        return dl;
+    }
+
+    // Replace this directory's stale listing, or else the least recently used
+    int slot = 0;
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        dir_listing_t *c = cache.dirs[i];
+        if (!c || (c->dev == dl->dev && c->ino == dl->ino)) {
+            slot = i;
+            break;
+        }
+        if (c->used < cache.dirs[slot]->used) {
+            slot = i;
+        }
+    }
+    if (cache.dirs[slot]) {
+        listing_unref(cache.dirs[slot]);
+    }
+    dl->refs = 2;
+    dl->used = ++cache.clock;
+    cache.dirs[slot] = dl;
+    pthread_mutex_unlock(&cache.lock);
+    return dl;
+}
+
+static void listing_put(dir_listing_t *dl) {
+    pthread_mutex_lock(&cache.lock);
+    listing_unref(dl);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * The character a wildcard marker stood for
+ */
+static char glob_literal(char c) {
+    switch (c) {
+        case GLOB_ANY:   return '*';
+        case GLOB_ONE:   return '?';
+        case GLOB_CLASS: return '[';
+    }
+    return c;
+}
+
+/**
+ * Matches c against the bracket expression starting just past a GLOB_CLASS
+ *
+ * @return Just past the closing ']', or NULL if there is none and the '['
+ *         is an ordinary character
+ */
+static const char *match_class(const char *p, const char *pend, unsigned char c, bool *hit) {
+    bool negate = (p < pend && (*p == '!' || *p == '^'));
+    const char *first;
+
+    p += negate;
+    first = p;
+    *hit = false;
+    // A ']' right after the '[' (or "[!") is a member, not the end
+    while (p < pend && (*p != ']' || p == first)) {
+        unsigned char lo = glob_literal(*p), hi = lo;
+        if (p + 2 < pend && p[1] == '-' && p[2] != ']') {
+            hi = glob_literal(p[2]);
+            p += 3;
+        } else {
+            p++;
+        }
+        if (lo <= c && c <= hi) {
+            *hit = true;
+        }
+    }
+    if (p >= pend) {
+        return NULL;
+    }
+    *hit = (*hit != negate);
+    return p + 1;
+}
+
+/**
+ * Matches a name against one component of a marked pattern
+ *
+ * Each GLOB_ANY remembers where it was so a failed match can resume one
+ * character further into the name, which keeps this linear for patterns
+ * with a single '*' and quadratic at worst.
+ */
+static bool match_component(const char *p, const char *pend, const char *name) {
+    const char *star_p = NULL, *star_n = NULL;
+    const char *n = name;
+
+    while (*n) {
+        if (p < pend && *p == GLOB_ANY) {
+            star_p = ++p;
+            star_n = n;
+            continue;
+        }
+        if (p < pend) {
+            const char *next = p + 1;
+            bool hit;
+            if (*p == GLOB_ONE) {
+                hit = true;
+            } else if (*p == GLOB_CLASS) {
+                const char *end = match_class(p + 1, pend, (unsigned char)*n, &hit);
+                if (end) {
+                    next = end;
+                } else {
+                    hit = (*n == '[');
+                }
+            } else {
+                hit = (*p == *n);
+            }
+            if (hit) {
+                p = next;
+                n++;
+                continue;
+            }
+        }
+        if (!star_p) {
+            return false;
+        }
+        p = star_p;
+        n = ++star_n;
+    }
+    while (p < pend && *p == GLOB_ANY) {
+        p++;
+    }
+    return p == pend;
+}
+
+typedef struct glob_walk {
+    char path[PATH_MAX];     // matched prefix
+    int (*emit)(void *arg, const char *path);
+    void *arg;
+    int matches;
+    int rc;
+} glob_walk_t;
+
+static bool has_wildcard(const char *p, const char *pend) {
+    for (; p < pend; p++) {
+        if (*p == GLOB_ANY || *p == GLOB_ONE || *p == GLOB_CLASS) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Whether a listed entry can be descended into
+ */
+static bool entry_is_dir(const char *path, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return true;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return false;
+    }
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Expands the rest of a pattern below the prefix in g->path[0..plen)
+ */
+static void glob_from(glob_walk_t *g, size_t plen, const char *pat) {
+    if (g->rc != OK) {
+        return;
+    }
+
+    const char *end = strchrnul(pat, '/');
+    const char *next = end + strspn(end, "/");
+    bool last = (*next == '\0');
+    bool want_dir = !last || *end == '/';
+    size_t clen = end - pat;
+
+    if (!has_wildcard(pat, end)) {
+        struct stat st;
+        if (plen + clen + 2 > sizeof(g->path)) {
+            return;
+        }
+        memcpy(g->path + plen, pat, clen);
+        plen += clen;
+        g->path[plen] = '\0';
+        if (!last) {
+            g->path[plen++] = '/';
+            g->path[plen] = '\0';
+            glob_from(g, plen, next);
+        } else if (want_dir ? (stat(g->path, &st) == 0 && S_ISDIR(st.st_mode))
+                            : lstat(g->path, &st) == 0) {
+            if (want_dir) {
+                g->path[plen++] = '/';
+                g->path[plen] = '\0';
+            }
+            g->matches++;
+            g->rc = g->emit(g->arg, g->path);
+        }
+        return;
+    }
+
+    dir_listing_t *dl = listing_get(plen ? g->path : ".");
+    if (!dl) {
+        return;
+    }
+    for (size_t i = 0; i < dl->count && g->rc == OK; i++) {
+        const char *name = dl->names + dl->entries[i].name;
+        size_t nlen = strlen(name);
+
+        if ((name[0] == '.' && pat[0] != '.') || !match_component(pat, end, name) ||
+            plen + nlen + 2 > sizeof(g->path)) {
+            continue;
+        }
+        memcpy(g->path + plen, name, nlen + 1);
+        if (want_dir && !entry_is_dir(g->path, dl->entries[i].type)) {
+            continue;
+        }
+        if (want_dir) {
+            g->path[plen + nlen] = '/';
+            g->path[plen + nlen + 1] = '\0';
+        }
+        if (last) {
+            g->matches++;
+            g->rc = g->emit(g->arg, g->path);
+        } else {
+            glob_from(g, plen + nlen + 1, next);
+        }
+    }
+    listing_put(dl);
+}
+
+/**
+ * Expands a word holding wildcard markers into the paths it matches
+ *
+ * @param word The word, as tokenize_stage left it
+ * @param emit Called with each match in sorted order; a return other than
+ *             OK stops the expansion and is passed back
+ * @param arg  Passed to emit
+ * @return The number of matches, or the error emit returned
+ */
+int glob_word(const char *word, int (*emit)(void *arg, const char *path), void *arg) {
+    glob_walk_t g;
+    size_t plen = 0;
+
+    g.emit = emit;
+    g.arg = arg;
+    g.matches = 0;
+    g.rc = OK;
+    if (*word == '/') {
+        g.path[plen++] = '/';
+        word += strspn(word, "/");
+    }
+    g.path[plen] = '\0';
+    glob_from(&g, plen, word);
+    return (g.rc == OK) ? g.matches : g.rc;
+}
+
+/**
+ * Turns wildcard markers back into the characters they stood for
+ *
+ * @param word The word to restore in place
+ */
+void glob_unmark(char *word) {
+    for (; *word; word++) {
+        *word = glob_literal(*word);
+    }
+}
+
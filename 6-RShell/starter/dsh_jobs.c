@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include "dshlib.h"
+
+/*
+ * Background jobs
+ *
+ * A line ending in '&' becomes a job: its command list is copied out of the
+ * session arena into a block the job owns, the pipeline is started from
+ * that copy and the shell moves on to the next line. A reaper thread reads
+ * SIGCHLD from a signalfd and collects the job's processes with
+ * waitpid(WNOHANG) on their own pids, so foreground waits are never robbed
+ * of a child. Built-in stages running on threads report completion through
+ * their on_done hook instead. jobs, wait and fg read the table; wait and fg
+ * sleep on a condition variable the reaper broadcasts when a job finishes.
+ *
+ * Every job in the process lives on one list guarded by one mutex. Job ids
+ * are per session. When a session ends its jobs keep running and are freed
+ * by the reaper once they finish.
+ *
+ * fg waits for the job and takes over its exit status. dsh does not put
+ * jobs in their own process groups, so there is no terminal hand-off and no
+ * stopped (^Z) state.
+ */
+
+typedef struct job {
+    struct job *next;
+    dsh_session_t *owner;        // NULL once the session has ended
+    int id;
+    int num;
+    int running;                 // stages not yet finished
+    int status;                  // pipeline's exit status once done
+    int pipefail;                // owner's pipefail setting at launch
+    int launched;                // stage pids are set and may be reaped
+    pipeline_stage_t *stages;
+    unsigned char *finished;     // per stage
+    command_list_t clist;        // private copy the stages run from
+    char *text;                  // command line as shown by jobs
+} job_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // broadcast when a job finishes
+    job_t *head;                 // oldest first
+    int sigfd;
+} jobs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, -1 };
+
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Copies s to *cur and advances it
+ */
+static char *copy_str(char **cur, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *dst = *cur;
+
+    memcpy(dst, s, len);
+    *cur += len;
+    return dst;
+}
+
+/**
+ * Appends s to the job text at *cur, leaving it terminated
+ */
+static void append_text(char **cur, const char *s) {
+    size_t len = strlen(s);
+
+    memcpy(*cur, s, len + 1);
+    *cur += len;
+}
+
+/**
+ * Allocates a job holding a private copy of clist
+ *
+ * Stages, command buffers, argv vectors, strings and the display text share
+ * one allocation, so the job outlives the arena the line was parsed in and
+ * is freed with a single free(), after closing the duplicates it holds of
+ * the line's here-input memfds.
+ */
+static job_t *job_create(command_list_t *clist) {
+    int num = clist->num;
+    size_t ptrs = 0;
+    size_t chars = 0;
+
+    for (int i = 0; i < num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        ptrs += cmd->argc + 1;
+        for (int a = 0; a < cmd->argc; a++) {
+            chars += 2 * (strlen(cmd->argv[a]) + 1);     // copy and text
+        }
+        if (cmd->input_file) {
+            chars += 2 * strlen(cmd->input_file) + 7;     // " <<< "
+        }
+        if (cmd->output_file) {
+            chars += 2 * strlen(cmd->output_file) + 6;
+        }
+        chars += 3;                                     // " | "
+    }
+
+    size_t size = sizeof(job_t) + num * (sizeof(pipeline_stage_t) + sizeof(cmd_buff_t)) +
+                  ptrs * sizeof(char *) + num + chars + 1;
+    job_t *job = calloc(1, size);
+    if (!job) {
+        return NULL;
+    }
+
+    job->num = num;
+    job->running = num;
+    job->stages = (pipeline_stage_t *)(job + 1);
+    job->clist.commands = (cmd_buff_t *)(job->stages + num);
+    job->clist.num = num;
+    job->clist._cap = num;
+    char **argv = (char **)(job->clist.commands + num);
+    job->finished = (unsigned char *)(argv + ptrs);
+    char *strings = (char *)(job->finished + num);
+
+    // Text goes at the end of the block, after every copied string
+    char *text = strings;
+    for (int i = 0; i < num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        for (int a = 0; a < cmd->argc; a++) {
+            text += strlen(cmd->argv[a]) + 1;
+        }
+        if (cmd->input_file) {
+            text += strlen(cmd->input_file) + 1;
+        }
+        if (cmd->output_file) {
+            text += strlen(cmd->output_file) + 1;
+        }
+    }
+    job->text = text;
+    *text = '\0';
+
+    for (int i = 0; i < num; i++) {
+        cmd_buff_t *src = &clist->commands[i];
+        cmd_buff_t *dst = &job->clist.commands[i];
+
+        dst->argc = src->argc;
+        dst->argv = argv;
+        dst->_argv_cap = src->argc + 1;
+        dst->append_output = src->append_output;
+        dst->input_kind = src->input_kind;
+        dst->input_fd = -1;
+        if (i > 0) {
+            append_text(&text, " | ");
+        }
+        for (int a = 0; a < src->argc; a++) {
+            dst->argv[a] = copy_str(&strings, src->argv[a]);
+            if (a > 0) {
+                append_text(&text, " ");
+            }
+            append_text(&text, src->argv[a]);
+        }
+        dst->argv[src->argc] = NULL;
+        argv += src->argc + 1;
+
+        if (src->input_file) {
+            static const char *const ops[] = {
+                [INPUT_FILE] = " < ", [INPUT_HERESTRING] = " <<< ", [INPUT_HEREDOC] = " << ",
+            };
+            dst->input_file = copy_str(&strings, src->input_file);
+            append_text(&text, ops[src->input_kind]);
+            append_text(&text, src->input_file);
+        }
+        // The line's memfd is closed with the line; the job keeps its own
+        if (src->input_fd >= 0) {
+            dst->input_fd = fcntl(src->input_fd, F_DUPFD_CLOEXEC, 0);
+        }
+        if (src->output_file) {
+            dst->output_file = copy_str(&strings, src->output_file);
+            append_text(&text, src->append_output ? " >> " : " > ");
+            append_text(&text, src->output_file);
+        }
+    }
+    return job;
+}
+
+/**
+ * Releases a finished job; caller holds the lock and has unlinked it
+ */
+static void job_free(job_t *job) {
+    for (int i = 0; i < job->num; i++) {
+        if (job->stages[i].threaded) {
+            pthread_join(job->stages[i].thread, NULL);
+        }
+        if (job->clist.commands[i].input_fd >= 0) {
+            close(job->clist.commands[i].input_fd);
+        }
+    }
+    free(job);
+}
+
+/**
+ * Unlinks and frees a job; caller holds the lock
+ */
+static void job_forget(job_t *job) {
+    for (job_t **pp = &jobs.head; *pp; pp = &(*pp)->next) {
+        if (*pp == job) {
+            *pp = job->next;
+            break;
+        }
+    }
+    job_free(job);
+}
+
+/**
+ * Records that stage i is done; caller holds the lock
+ */
+static void stage_finished(job_t *job, int i) {
+    if (job->finished[i]) {
+        return;
+    }
+    job->finished[i] = 1;
+    if (--job->running == 0) {
+        job->status = pipeline_status(job->stages, job->num, job->pipefail);
+        pthread_cond_broadcast(&jobs.changed);
+    }
+}
+
+/**
+ * on_done hook for built-in stages of a job
+ */
+static void stage_done(pipeline_stage_t *st) {
+    job_t *job = st->done_arg;
+
+    pthread_mutex_lock(&jobs.lock);
+    stage_finished(job, (int)(st - job->stages));
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/**
+ * Collects any of a job's processes that have exited; caller holds the lock
+ */
+static void reap_job(job_t *job) {
+    if (!job->launched) {
+        return;
+    }
+    for (int i = 0; i < job->num; i++) {
+        pipeline_stage_t *st = &job->stages[i];
+        int ws;
+
+        if (job->finished[i] || st->pid <= 0) {
+            continue;
+        }
+        pid_t r = waitpid(st->pid, &ws, WNOHANG);
+        if (r == st->pid) {
+            st->status = WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+            stage_finished(job, i);
+        } else if (r < 0 && errno == ECHILD) {
+            st->status = 127;
+            stage_finished(job, i);
+        }
+    }
+}
+
+/**
+ * Reaper thread: wakes on SIGCHLD and collects every job's exited stages
+ */
+static void *reaper_main(void *arg) {
+    struct signalfd_siginfo si;
+
+    (void)arg;
+    while (1) {
+        ssize_t n = read(jobs.sigfd, &si, sizeof(si));
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+
+        pthread_mutex_lock(&jobs.lock);
+        job_t *job = jobs.head;
+        while (job) {
+            job_t *next = job->next;
+            reap_job(job);
+            if (!job->owner && job->running == 0) {
+                job_forget(job);
+            }
+            job = next;
+        }
+        pthread_mutex_unlock(&jobs.lock);
+    }
+    return NULL;
+}
+
+/**
+ * Creates the SIGCHLD signalfd and the reaper thread, once per process
+ *
+ * SIGCHLD must be blocked in every thread for the signalfd to see it; the
+ * shell's main() blocks it before any thread exists, and it is blocked here
+ * too for callers that did not.
+ */
+static void reaper_start(void) {
+    sigset_t set;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    jobs.sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+    if (jobs.sigfd < 0) {
+        return;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, reaper_main, NULL) != 0) {
+        close(jobs.sigfd);
+        jobs.sigfd = -1;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Returns the session's job with the highest id, optionally skipping one;
+ * caller holds the lock
+ */
+static job_t *latest_job(dsh_session_t *session, job_t *skip) {
+    job_t *best = NULL;
+
+    for (job_t *job = jobs.head; job; job = job->next) {
+        if (job->owner == session && job != skip && (!best || job->id > best->id)) {
+            best = job;
+        }
+    }
+    return best;
+}
+
+/**
+ * Resolves a job spec: NULL or "%%"/"%+" for the current job, "%N" for job
+ * N, or a pid belonging to one of the job's stages; caller holds the lock
+ */
+static job_t *find_job(dsh_session_t *session, const char *spec) {
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return latest_job(session, NULL);
+    }
+
+    char *end;
+    bool by_id = (spec[0] == '%');
+    long n = strtol(spec + by_id, &end, 10);
+    if (end == spec + by_id || *end != '\0') {
+        return NULL;
+    }
+    for (job_t *job = jobs.head; job; job = job->next) {
+        if (job->owner != session) {
+            continue;
+        }
+        if (by_id && job->id == n) {
+            return job;
+        }
+        for (int i = 0; !by_id && i < job->num; i++) {
+            if (job->stages[i].pid == (pid_t)n) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Formats a job the way jobs and the completion notice show it
+ */
+static void format_job(job_t *job, char mark, char *buf, size_t size) {
+    char state[32];
+
+    if (job->running > 0) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (job->status == 0) {
+        snprintf(state, sizeof(state), "Done");
+    } else {
+        snprintf(state, sizeof(state), "Exit %d", job->status);
+    }
+    snprintf(buf, size, "[%d]%c  %-24s%s%s\n", job->id, mark, state, job->text,
+             (job->running > 0) ? " &" : "");
+}
+
+/**
+ * Returns '+' for the current job, '-' for the previous one, else ' '
+ */
+static char job_mark(job_t *job, job_t *current, job_t *previous) {
+    if (job == current) return '+';
+    if (job == previous) return '-';
+    return ' ';
+}
+
+/**
+ * Starts a command list as a background job of the current session
+ *
+ * Prints "[id] pid" with the pid of the last stage, as other shells do, or
+ * just "[id]" when the last stage is a built-in.
+ *
+ * @param clist Parsed line; it is copied, so the caller may free it
+ * @return OK, ERR_MEMORY, or ERR_EXEC_CMD if a stage failed to launch
+ */
+int jobs_start(command_list_t *clist) {
+    dsh_session_t *session = current_session();
+
+    pthread_once(&reaper_once, reaper_start);
+    if (jobs.sigfd < 0) {
+        fprintf(stderr, "jobs: cannot watch for child exits\n");
+        return ERR_EXEC_CMD;
+    }
+
+    job_t *job = job_create(clist);
+    if (!job) {
+        return ERR_MEMORY;
+    }
+    job->owner = session;
+    job->pipefail = session->pipefail;
+    // Nothing may run on the shell's thread: a lone parallel would hold the
+    // prompt, and wait or fg would wait for the job they are part of
+    for (int i = 0; i < job->num; i++) {
+        job->stages[i].detached = 1;
+        job->stages[i].on_done = stage_done;
+        job->stages[i].done_arg = job;
+    }
+
+    pthread_mutex_lock(&jobs.lock);
+    job_t *last = latest_job(session, NULL);
+    job->id = last ? last->id + 1 : 1;
+    job_t **tail = &jobs.head;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+    pthread_mutex_unlock(&jobs.lock);
+
+    // Launching without the lock lets built-in stages report in as they
+    // finish. The pids are written unlocked, so the reaper leaves the job
+    // alone until it is marked launched; processes that exit before then
+    // are picked up by the reap below
+    launch_fds_t ends = { -1, -1, -1 };
+    int rc = launch_pipeline(&job->clist, &ends, BUILTIN_LOCAL, job->stages);
+
+    pthread_mutex_lock(&jobs.lock);
+    job->launched = 1;
+    for (int i = 0; i < job->num; i++) {
+        if (job->stages[i].pid <= 0 && !job->stages[i].threaded) {
+            stage_finished(job, i);
+        }
+    }
+    reap_job(job);
+    pid_t last_pid = job->stages[job->num - 1].pid;
+    if (last_pid > 0) {
+        printf("[%d] %d\n", job->id, (int)last_pid);
+    } else {
+        printf("[%d]\n", job->id);
+    }
+    // Commands write to fd 1 directly; keep the announcement ahead of them
+    fflush(stdout);
+    pthread_mutex_unlock(&jobs.lock);
+
+    return rc;
+}
+
+/**
+ * Reports and forgets the current session's finished jobs
+ *
+ * Called by the interactive loop before each prompt.
+ */
+void jobs_notify(void) {
+    dsh_session_t *session = current_session();
+    char line[512];
+
+    pthread_mutex_lock(&jobs.lock);
+    job_t *current = latest_job(session, NULL);
+    job_t *previous = current ? latest_job(session, current) : NULL;
+    job_t *job = jobs.head;
+    while (job) {
+        job_t *next = job->next;
+        if (job->owner == session && job->running == 0) {
+            format_job(job, job_mark(job, current, previous), line, sizeof(line));
+            printf("%s", line);
+            fflush(stdout);
+            job_forget(job);
+        }
+        job = next;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/**
+ * Hands a session's jobs to the reaper when the session ends
+ *
+ * @param session The session being destroyed
+ */
+void jobs_detach(dsh_session_t *session) {
+    pthread_mutex_lock(&jobs.lock);
+    job_t *job = jobs.head;
+    while (job) {
+        job_t *next = job->next;
+        if (job->owner == session) {
+            job->owner = NULL;
+            if (job->running == 0) {
+                job_forget(job);
+            }
+        }
+        job = next;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/**
+ * Implements the jobs built-in: lists the session's jobs and forgets the
+ * ones that have finished
+ */
+int jobs_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    dsh_session_t *session = current_session();
+    char line[512];
+
+    (void)cmd; (void)in_fd; (void)err_fd;
+    pthread_mutex_lock(&jobs.lock);
+    job_t *current = latest_job(session, NULL);
+    job_t *previous = current ? latest_job(session, current) : NULL;
+    job_t *job = jobs.head;
+    while (job) {
+        job_t *next = job->next;
+        if (job->owner == session) {
+            reap_job(job);
+            format_job(job, job_mark(job, current, previous), line, sizeof(line));
+            dprintf(out_fd, "%s", line);
+            if (job->running == 0) {
+                job_forget(job);
+            }
+        }
+        job = next;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return 0;
+}
+
+/**
+ * Implements wait [job ...]
+ *
+ * Without arguments waits for every job of the session and returns 0;
+ * otherwise waits for each job named and returns the last one's status.
+ */
+int jobs_wait_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    dsh_session_t *session = current_session();
+    int status = 0;
+
+    (void)in_fd; (void)out_fd;
+    pthread_mutex_lock(&jobs.lock);
+    if (cmd->argc == 1) {
+        job_t *job;
+        while ((job = latest_job(session, NULL)) != NULL) {
+            while (job->running > 0) {
+                pthread_cond_wait(&jobs.changed, &jobs.lock);
+            }
+            job_forget(job);
+        }
+    }
+    for (int i = 1; i < cmd->argc; i++) {
+        job_t *job = find_job(session, cmd->argv[i]);
+        if (!job) {
+            dprintf(err_fd, "wait: %s: no such job\n", cmd->argv[i]);
+            status = 127;
+            continue;
+        }
+        while (job->running > 0) {
+            pthread_cond_wait(&jobs.changed, &jobs.lock);
+        }
+        status = job->status;
+        job_forget(job);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return status;
+}
+
+/**
+ * Implements fg [job]: shows the job's command, waits for it and returns
+ * its exit status
+ */
+int jobs_fg_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    dsh_session_t *session = current_session();
+    const char *spec = (cmd->argc > 1) ? cmd->argv[1] : NULL;
+
+    (void)in_fd;
+    pthread_mutex_lock(&jobs.lock);
+    job_t *job = find_job(session, spec);
+    if (!job) {
+        pthread_mutex_unlock(&jobs.lock);
+        if (spec) {
+            dprintf(err_fd, "fg: %s: no such job\n", spec);
+        } else {
+            dprintf(err_fd, "fg: no current job\n");
+        }
+        return 1;
+    }
+    dprintf(out_fd, "%s\n", job->text);
+    while (job->running > 0) {
+        pthread_cond_wait(&jobs.changed, &jobs.lock);
+    }
+    int status = job->status;
+    job_forget(job);
+    pthread_mutex_unlock(&jobs.lock);
+    return status;
+}
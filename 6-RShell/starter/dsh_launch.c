@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "dshlib.h"
+
+extern char **environ;
+
+/*
+ * Process launcher
+ *
+ * Every external command the shell or the server runs is started here with
+ * posix_spawn. glibc implements it with clone(CLONE_VM | CLONE_VFORK), so
+ * the child borrows the parent's address space until it execs and launch
+ * cost does not grow with the parent's RSS the way fork's page-table copy
+ * does. Pipe wiring and the <, > and >> redirections are expressed as spawn
+ * file actions; nothing runs in the child between clone and exec.
+ *
+ * Pipes are created with O_CLOEXEC one stage at a time. dup2 onto 0, 1 or 2
+ * clears the flag on the copy, so a child keeps exactly its own two ends
+ * and no close list is needed. The parent drops each end as soon as the
+ * stage that uses it has been launched, so at most two pipe descriptors are
+ * open at once however long the pipeline is. Each pipe gets the session's
+ * pipesize option, if set, so high-volume stages move more data per
+ * context switch.
+ *
+ * Registry built-ins are not launched at all. A lone built-in runs inline;
+ * inside a pipeline a pipeline-safe one runs on its own thread, which
+ * owns the pipe ends it was given and closes them when it returns. The
+ * shell ignores SIGPIPE so a built-in writing into a closed pipe gets
+ * EPIPE instead of killing the shell; spawned children get the default
+ * disposition back.
+ *
+ * Processes are reaped with wait4 in the order they exit, watched through
+ * pidfds, so every stage's end time and rusage are its own. A built-in
+ * stage of a timed pipeline measures its thread with RUSAGE_THREAD.
+ *
+ * Once the last stage has exited nothing will read what the others
+ * produce, so any upstream process still running is sent SIGPIPE through
+ * its pidfd, which cannot hit a recycled pid. A producer that is writing
+ * would get SIGPIPE on its next write anyway; this also stops one that is
+ * computing or sleeping before it writes. When the last stage is a
+ * built-in thread, closing its read end is what delivers the SIGPIPE.
+ */
+
+/**
+ * Probes whether a redirection target can be opened the way the child would
+ *
+ * @param path  File to open
+ * @param flags Open flags; O_TRUNC is dropped so probing never clobbers
+ * @return 0 if it opens, otherwise the errno open failed with
+ */
+static int probe_open(const char *path, int flags) {
+    int fd = open(path, (flags & ~O_TRUNC) | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Reports why a command could not be started
+ *
+ * A failed file action and a failed exec come back as the same errno, so
+ * redirection targets are probed first to blame the right one.
+ *
+ * @param cmd    The command that failed
+ * @param err_fd Descriptor to write the message to
+ * @param err    Error returned by posix_spawn
+ */
+static void report_launch_error(cmd_buff_t *cmd, int err_fd, int err) {
+    int open_err;
+
+    if (cmd->input_fd < 0 && cmd->input_file &&
+        (open_err = probe_open(cmd->input_file, O_RDONLY)) != 0) {
+        dprintf(err_fd, "open input file: %s: %s\n", cmd->input_file, strerror(open_err));
+    } else if (cmd->output_file &&
+               (open_err = probe_open(cmd->output_file, O_WRONLY | O_CREAT)) != 0) {
+        dprintf(err_fd, "open output file: %s: %s\n", cmd->output_file, strerror(open_err));
+    } else {
+        dprintf(err_fd, "execvp: %s: %s\n", cmd->argv[0], strerror(err));
+    }
+}
+
+/**
+ * Launches through the zygote, opening the redirections here since the
+ * zygote does not share the shell's working directory
+ *
+ * @return OK, ERR_EXEC_CMD after reporting the failure, or WARN_NO_CMDS if
+ *         the zygote is gone and posix_spawn should be used instead
+ */
+static int launch_via_zygote(cmd_buff_t *cmd, const launch_fds_t *fds, const char *path,
+                             bool resolved, int err_fd, pid_t *pid) {
+    int std[3] = {
+        (fds->in >= 0) ? fds->in : STDIN_FILENO,
+        (fds->out >= 0) ? fds->out : STDOUT_FILENO,
+        err_fd,
+    };
+    int in_file = -1, out_file = -1;
+    int rc = OK;
+
+    if (cmd->input_fd >= 0) {
+        std[0] = cmd->input_fd;
+    } else if (cmd->input_file) {
+        if ((in_file = open(cmd->input_file, O_RDONLY | O_CLOEXEC)) < 0) {
+            dprintf(err_fd, "open input file: %s: %s\n", cmd->input_file, strerror(errno));
+            return ERR_EXEC_CMD;
+        }
+        std[0] = in_file;
+    }
+    if (cmd->output_file) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append_output ? O_APPEND : O_TRUNC);
+        if ((out_file = open(cmd->output_file, flags, 0644)) < 0) {
+            dprintf(err_fd, "open output file: %s: %s\n", cmd->output_file, strerror(errno));
+            if (in_file >= 0) {
+                close(in_file);
+            }
+            return ERR_EXEC_CMD;
+        }
+        std[1] = out_file;
+    }
+
+    int err = zygote_spawn(resolved ? path : cmd->argv[0], resolved, cmd->argv, std, pid);
+    if (err < 0) {
+        rc = WARN_NO_CMDS;
+    } else if (err > 0) {
+        dprintf(err_fd, "execvp: %s: %s\n", cmd->argv[0], strerror(err));
+        rc = ERR_EXEC_CMD;
+    }
+    if (in_file >= 0) {
+        close(in_file);
+    }
+    if (out_file >= 0) {
+        close(out_file);
+    }
+    return rc;
+}
+
+/**
+ * Starts an external command without forking the shell
+ *
+ * The child's stdin, stdout and stderr are wired to fds (-1 keeps the
+ * shell's own), then the command's redirections are applied on top, so a
+ * file named with <, > or >> (or the memfd behind <<< or <<) takes
+ * precedence over a pipe. Every other descriptor the shell holds is
+ * O_CLOEXEC, so the child inherits nothing else. With -z the command is
+ * created by the zygote instead (see dsh_zygote.c) and is still the
+ * shell's child.
+ *
+ * @param cmd The command to start
+ * @param fds Descriptors for the child's standard streams
+ * @param pid Receives the child's pid
+ * @return OK on success, ERR_EXEC_CMD after reporting the failure to the
+ *         command's stderr
+ */
+int launch_cmd(cmd_buff_t *cmd, const launch_fds_t *fds, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdef, sigmask;
+    int err_fd = (fds->err >= 0) ? fds->err : STDERR_FILENO;
+    int rc;
+
+    *pid = -1;
+    if (!cmd || cmd->argc == 0) return ERR_EXEC_CMD;
+
+    char path[PATH_MAX];
+    bool resolved = (path_lookup(cmd->argv[0], path, sizeof(path)) == OK);
+
+    if (zygote_active()) {
+        TRACE_BEGIN(zygote_ns);
+        rc = launch_via_zygote(cmd, fds, path, resolved, err_fd, pid);
+        TRACE_END(zygote_ns, "spawn", *pid);
+        if (rc != WARN_NO_CMDS) {
+            return rc;
+        }
+    }
+
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0) {
+        dprintf(err_fd, "posix_spawn: %s\n", strerror(rc));
+        return ERR_EXEC_CMD;
+    }
+    if ((rc = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        dprintf(err_fd, "posix_spawn: %s\n", strerror(rc));
+        return ERR_EXEC_CMD;
+    }
+
+    // The shell ignores SIGPIPE and blocks SIGCHLD for the job reaper;
+    // commands expect the default disposition and an empty mask
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    if (fds->in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds->in, STDIN_FILENO);
+    }
+    if (fds->out >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds->out, STDOUT_FILENO);
+    }
+    if (fds->err >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds->err, STDERR_FILENO);
+    }
+    if (cmd->input_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, cmd->input_fd, STDIN_FILENO);
+    } else if (cmd->input_file) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->input_file,
+                                         O_RDONLY, 0);
+    }
+    if (cmd->output_file) {
+        int flags = O_WRONLY | O_CREAT | (cmd->append_output ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->output_file,
+                                         flags, 0644);
+    }
+
+    TRACE_BEGIN(spawn_ns);
+    if (resolved) {
+        rc = posix_spawn(pid, path, &actions, &attr, cmd->argv, environ);
+    } else {
+        rc = posix_spawnp(pid, cmd->argv[0], &actions, &attr, cmd->argv, environ);
+    }
+    TRACE_END(spawn_ns, "spawn", *pid);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) {
+        *pid = -1;
+        report_launch_error(cmd, err_fd, rc);
+        return ERR_EXEC_CMD;
+    }
+    return OK;
+}
+
+/**
+ * Runs a stage's built-in, measuring the calling thread if the stage is timed
+ */
+static void run_stage_builtin(pipeline_stage_t *st) {
+    struct rusage before, after;
+
+    if (st->timed) {
+        getrusage(RUSAGE_THREAD, &before);
+    }
+    st->status = run_builtin(st->builtin, st->cmd, &st->fds);
+    if (st->timed) {
+        getrusage(RUSAGE_THREAD, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &st->usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &st->usage.ru_stime);
+        st->usage.ru_maxrss = after.ru_maxrss;
+        st->usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+        st->usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    }
+    st->end_ns = monotonic_ns();
+}
+
+/**
+ * Thread body for a built-in pipeline stage
+ */
+static void *stage_thread(void *arg) {
+    pipeline_stage_t *st = arg;
+
+    if (st->own_cwd && (unshare(CLONE_FS) < 0 || fchdir(st->cwd_fd) < 0)) {
+        int err_fd = (st->fds.err >= 0) ? st->fds.err : STDERR_FILENO;
+        dprintf(err_fd, "%s: %s\n", st->cmd->argv[0], strerror(errno));
+        st->status = 1;
+        st->end_ns = monotonic_ns();
+    } else {
+        run_stage_builtin(st);
+    }
+    if (st->own_in) {
+        close(st->fds.in);
+    }
+    if (st->own_out) {
+        close(st->fds.out);
+    }
+    if (st->on_done) {
+        st->on_done(st);
+    }
+    return NULL;
+}
+
+/**
+ * Starts one stage: inline or on a thread for a built-in, spawned otherwise
+ *
+ * @param st        The stage, with cmd, fds and ownership filled in
+ * @param scope     BUILTIN_LOCAL or BUILTIN_REMOTE
+ * @param inline_ok The stage has no pipe to block on and may run inline
+ * @return OK, or ERR_EXEC_CMD if the stage could not be started
+ */
+static int start_stage(pipeline_stage_t *st, unsigned scope, bool inline_ok) {
+    const builtin_desc_t *bi = builtin_lookup(st->cmd->argv[0], scope);
+
+    st->pid = -1;
+    st->threaded = 0;
+    st->status = 0;
+    st->builtin = NULL;
+    st->start_ns = monotonic_ns();
+    st->spawn_ns = st->end_ns = 0;
+    memset(&st->usage, 0, sizeof(st->usage));
+
+    if (bi && bi->fn && inline_ok && !(st->async && (bi->flags & BUILTIN_PIPELINE))) {
+        st->builtin = bi;
+        run_stage_builtin(st);
+        return OK;
+    }
+    if (bi && bi->fn && (bi->flags & BUILTIN_PIPELINE)) {
+        st->builtin = bi;
+        if (pthread_create(&st->thread, NULL, stage_thread, st) == 0) {
+            st->threaded = 1;
+            return OK;
+        }
+    }
+
+    // Not a built-in here, or no thread to run it on: launch a real command
+    st->own_in = st->own_out = 0;
+    if (launch_cmd(st->cmd, &st->fds, &st->pid) != OK) {
+        st->status = 127;
+        st->end_ns = monotonic_ns();
+        return ERR_EXEC_CMD;
+    }
+    st->spawn_ns = monotonic_ns();
+    return OK;
+}
+
+/**
+ * Starts every stage of a pipeline
+ *
+ * ends gives the first stage's stdin, the last stage's stdout and every
+ * stage's stderr (-1 keeps the shell's own). scope selects which registry
+ * built-ins run in-process. The caller sets each stage's on_done (NULL for
+ * none), timed, async, detached and own_cwd beforehand; on_done is called
+ * on the stage's thread when a threaded built-in finishes. A stage that
+ * fails to launch gets status 127 and its neighbours see EOF or EPIPE on
+ * the pipe between them. Every started stage must be collected, with
+ * wait_pipeline or one by one with reap_stage and pthread_join.
+ *
+ * @param clist  The pipeline to start
+ * @param ends   Descriptors for the pipeline's outer ends
+ * @param scope  BUILTIN_LOCAL or BUILTIN_REMOTE
+ * @param stages Receives one entry per stage, clist->num entries
+ * @return OK if every stage started, ERR_EXEC_CMD otherwise
+ */
+int launch_pipeline(command_list_t *clist, const launch_fds_t *ends,
+                    unsigned scope, pipeline_stage_t *stages) {
+    int err_fd = (ends->err >= 0) ? ends->err : STDERR_FILENO;
+    int pipe_size = current_session()->pipe_size;
+    int prev_read = ends->in;
+    int rc = OK;
+    int i;
+
+    for (i = 0; i < clist->num; i++) {
+        pipeline_stage_t *st = &stages[i];
+        bool last = (i == clist->num - 1);
+        int p[2] = {-1, -1};
+
+        if (!last && pipe2(p, O_CLOEXEC) < 0) {
+            dprintf(err_fd, "pipe: %s\n", strerror(errno));
+            rc = ERR_EXEC_CMD;
+            break;
+        }
+        // The size was accepted by set; a refusal now, e.g. over the user's
+        // pipe quota, leaves a working default-sized pipe
+        if (!last && pipe_size > 0) {
+            fcntl(p[1], F_SETPIPE_SZ, pipe_size);
+        }
+
+        st->cmd = &clist->commands[i];
+        st->fds.in = prev_read;
+        st->fds.out = last ? ends->out : p[1];
+        st->fds.err = ends->err;
+        st->own_in = (i > 0);
+        st->own_out = !last;
+        if (start_stage(st, scope, clist->num == 1 && !st->detached) != OK) {
+            rc = ERR_EXEC_CMD;
+        }
+
+        // A thread keeps its ends; otherwise the child has its own copies and
+        // the parent only keeps the next read end
+        if (!st->threaded) {
+            if (i > 0) {
+                close(prev_read);
+            }
+            if (!last) {
+                close(p[1]);
+            }
+        }
+        prev_read = p[0];
+    }
+
+    if (i < clist->num) {
+        if (i > 0) {
+            close(prev_read);
+        }
+        for (; i < clist->num; i++) {
+            stages[i].pid = -1;
+            stages[i].threaded = 0;
+            stages[i].status = 127;
+        }
+    }
+    return rc;
+}
+
+/**
+ * Reaps one process stage with wait4, recording when and how it ended
+ *
+ * @param st A stage whose pid is a child of the caller
+ */
+void reap_stage(pipeline_stage_t *st) {
+    int ws = 0;
+
+    TRACE_BEGIN(wait_ns);
+    while (wait4(st->pid, &ws, 0, &st->usage) < 0 && errno == EINTR) {
+    }
+    TRACE_END(wait_ns, "wait", st->pid);
+    st->end_ns = monotonic_ns();
+    if (WIFEXITED(ws)) {
+        st->status = WEXITSTATUS(ws);
+    } else {
+        st->status = 128 + WTERMSIG(ws);
+    }
+}
+
+/**
+ * Reaps process stages as they exit by polling their pidfds, tearing
+ * the rest of the pipeline down once the last stage is gone
+ *
+ * Stages whose pidfd cannot be opened (an old kernel, no descriptors left)
+ * are left for the caller to reap in order.
+ */
+static void reap_in_exit_order(pipeline_stage_t *stages, int num) {
+    struct pollfd *pfds = malloc(num * sizeof(struct pollfd));
+    int *which = malloc(num * sizeof(int));
+    int n = 0;
+
+    if (!pfds || !which) {
+        free(pfds);
+        free(which);
+        return;
+    }
+    for (int i = 0; i < num; i++) {
+        if (stages[i].pid <= 0) {
+            continue;
+        }
+        int fd = syscall(SYS_pidfd_open, stages[i].pid, 0);
+        if (fd >= 0) {
+            pfds[n].fd = fd;
+            pfds[n].events = POLLIN;
+            which[n++] = i;
+        }
+    }
+
+    for (int pending = n; pending > 0; ) {
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int k = 0; k < n; k++) {
+            if (pfds[k].fd >= 0 && pfds[k].revents) {
+                reap_stage(&stages[which[k]]);
+                close(pfds[k].fd);
+                pfds[k].fd = -1;    // poll skips negative descriptors
+                pending--;
+                if (which[k] == num - 1) {
+                    for (int j = 0; j < n; j++) {
+                        if (pfds[j].fd >= 0) {
+                            syscall(SYS_pidfd_send_signal, pfds[j].fd, SIGPIPE, NULL, 0);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        if (pfds[k].fd >= 0) {
+            close(pfds[k].fd);
+        }
+    }
+    free(pfds);
+    free(which);
+}
+
+/**
+ * The exit status of a pipeline whose stages have all been collected
+ *
+ * A stage that ended because its reader went away, a process killed by
+ * SIGPIPE or a built-in that returned 128 + SIGPIPE, counts as successful.
+ * With pipefail (the session default) the pipeline's status is that of the
+ * rightmost stage that failed; with set pipefail=off it is the last
+ * stage's, as in POSIX sh.
+ *
+ * @param stages   The collected stages
+ * @param num      Number of stages
+ * @param pipefail The pipefail setting of the session that ran the line
+ * @return The pipeline's exit status
+ */
+int pipeline_status(const pipeline_stage_t *stages, int num, int pipefail) {
+    int result = 0;
+
+    for (int i = 0; i < num; i++) {
+        int st_status = (stages[i].status == 128 + SIGPIPE) ? 0 : stages[i].status;
+        if (pipefail ? st_status != 0 : i == num - 1) {
+            result = st_status;
+        }
+    }
+    return result;
+}
+
+/**
+ * Waits for every stage of a pipeline started with launch_pipeline
+ *
+ * Every stage is collected, whatever the others did; see pipeline_status
+ * for how the status is chosen.
+ *
+ * @param stages The stages to collect
+ * @param num    Number of stages
+ * @param status Receives the pipeline's exit status, may be NULL
+ * @return OK if the status is 0, ERR_EXEC_CMD otherwise
+ */
+int wait_pipeline(pipeline_stage_t *stages, int num, int *status) {
+    int procs = 0;
+
+    for (int i = 0; i < num; i++) {
+        procs += (stages[i].pid > 0);
+    }
+    if (procs > 1) {
+        reap_in_exit_order(stages, num);
+    }
+
+    for (int i = 0; i < num; i++) {
+        pipeline_stage_t *st = &stages[i];
+        if (st->pid > 0 && st->end_ns == 0) {
+            reap_stage(st);
+        } else if (st->threaded) {
+            pthread_join(st->thread, NULL);
+        }
+    }
+
+    int result = pipeline_status(stages, num, current_session()->pipefail);
+    if (status) {
+        *status = result;
+    }
+    return (result == 0) ? OK : ERR_EXEC_CMD;
+}
@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "dshlib.h"
+
+/*
+ * parallel [-j N] [-k] command [arg ...] ::: value ...
+ *
+ * Runs command once per value, appending the value to its arguments or
+ * substituting it for every "{}" in them. A pool of at most N workers
+ * (default: the CPUs this process may run on) pulls values off a shared
+ * counter; the shell's own thread is one of them. Each instance's stdout
+ * and stderr go to their own memfd and are copied out whole when it
+ * finishes, so output from different instances never interleaves. With -k
+ * output is released in argument order instead of completion order, and a
+ * worker waits before starting a value more than PARALLEL_KEEP_AHEAD * N
+ * past the oldest unreleased one, so one slow instance cannot keep the
+ * memfds of every later result open. Pipeline-safe built-ins run on the
+ * worker thread, anything else is spawned. Instances read /dev/null rather
+ * than competing for the shell's stdin.
+ *
+ * The exit status is the number of failed instances, capped at 101 as GNU
+ * parallel does.
+ */
+
+#define PARALLEL_SEP       ":::"
+#define PARALLEL_MAX_JOBS  1024
+#define PARALLEL_MAX_FAILS 101
+#define PARALLEL_KEEP_AHEAD 4
+
+typedef struct par_result {
+    int out_fd;          // memfds holding the instance's output
+    int err_fd;
+    int done;
+} par_result_t;
+
+typedef struct par_pool {
+    pthread_mutex_t lock;       // guards next
+    pthread_mutex_t out_lock;   // guards results, emitted, failures and output
+    pthread_cond_t released;    // -k: broadcast when emitted advances
+    char **tmpl;         // command words, may contain "{}"
+    int ntmpl;
+    char **values;
+    int nvalues;
+    int next;            // next value to hand out
+    int emitted;         // -k: results released so far
+    int keep_order;
+    int window;          // -k: values that may run ahead of emitted
+    int failures;
+    int out_fd;
+    int err_fd;
+    int null_fd;
+    par_result_t *results;
+} par_pool_t;
+
+/**
+ * Number of CPUs this process may run on
+ */
+static int cpu_count(void) {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+/**
+ * Copies everything in a memfd to dst without a user-space bounce
+ */
+static void drain_memfd(int src, int dst) {
+    if (lseek(src, 0, SEEK_SET) == 0) {
+        fd_copy(src, dst);
+    }
+}
+
+/**
+ * Copies out one instance's output and closes its memfds; caller holds
+ * out_lock so outputs never interleave
+ */
+static void emit_result(par_pool_t *pool, par_result_t *res) {
+    drain_memfd(res->out_fd, pool->out_fd);
+    drain_memfd(res->err_fd, pool->err_fd);
+    close(res->out_fd);
+    close(res->err_fd);
+    res->out_fd = res->err_fd = -1;
+}
+
+/**
+ * Builds "word" with every "{}" replaced by value
+ */
+static char *substitute(const char *word, const char *value) {
+    size_t vlen = strlen(value);
+    size_t len = 0;
+
+    for (const char *p = word; *p; ) {
+        if (p[0] == '{' && p[1] == '}') {
+            len += vlen;
+            p += 2;
+        } else {
+            len++;
+            p++;
+        }
+    }
+
+    char *out = malloc(len + 1);
+    if (!out) {
+        return NULL;
+    }
+    char *w = out;
+    for (const char *p = word; *p; ) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(w, value, vlen);
+            w += vlen;
+            p += 2;
+        } else {
+            *w++ = *p++;
+        }
+    }
+    *w = '\0';
+    return out;
+}
+
+/**
+ * Runs the instance for value i and returns its exit status
+ */
+static int run_instance(par_pool_t *pool, int i, par_result_t *res) {
+    const char *value = pool->values[i];
+    char **argv = calloc(pool->ntmpl + 2, sizeof(char *));
+    int argc = 0;
+    bool substituted = false;
+    int status = 127;
+
+    if (!argv) {
+        dprintf(res->err_fd, "parallel: %s\n", strerror(ENOMEM));
+        return status;
+    }
+    for (int t = 0; t < pool->ntmpl; t++) {
+        if (strstr(pool->tmpl[t], "{}")) {
+            argv[argc] = substitute(pool->tmpl[t], value);
+            substituted = true;
+        } else {
+            argv[argc] = strdup(pool->tmpl[t]);
+        }
+        if (!argv[argc++]) {
+            dprintf(res->err_fd, "parallel: %s\n", strerror(ENOMEM));
+            goto done;
+        }
+    }
+    if (!substituted && !(argv[argc++] = strdup(value))) {
+        dprintf(res->err_fd, "parallel: %s\n", strerror(ENOMEM));
+        goto done;
+    }
+
+    cmd_buff_t cmd = { .argc = argc, .argv = argv, ._argv_cap = argc + 1 };
+    launch_fds_t fds = { pool->null_fd, res->out_fd, res->err_fd };
+    const builtin_desc_t *bi = builtin_lookup(argv[0], BUILTIN_PIPELINE);
+    pid_t pid;
+
+    if (bi && bi->fn) {
+        status = run_builtin(bi, &cmd, &fds);
+    } else if (launch_cmd(&cmd, &fds, &pid) == OK) {
+        int ws = 0;
+        while (waitpid(pid, &ws, 0) < 0 && errno == EINTR) {
+        }
+        status = WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+    }
+
+done:
+    for (int a = 0; a < argc; a++) {
+        free(argv[a]);
+    }
+    free(argv);
+    return status;
+}
+
+/**
+ * Worker body: takes values off the shared counter until none are left
+ */
+static void *worker(void *arg) {
+    par_pool_t *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nvalues) {
+            break;
+        }
+        if (pool->keep_order) {
+            // Values go out in order, so the one holding emitted back is
+            // already running and this wait always ends
+            pthread_mutex_lock(&pool->out_lock);
+            while (i >= pool->emitted + pool->window) {
+                pthread_cond_wait(&pool->released, &pool->out_lock);
+            }
+            pthread_mutex_unlock(&pool->out_lock);
+        }
+
+        par_result_t *res = &pool->results[i];
+        res->out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+        res->err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+        int status = 127;
+        if (res->out_fd >= 0 && res->err_fd >= 0) {
+            status = run_instance(pool, i, res);
+        } else {
+            dprintf(pool->err_fd, "parallel: memfd_create: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_lock(&pool->out_lock);
+        res->done = 1;
+        if (status != 0) {
+            pool->failures++;
+        }
+        if (res->out_fd < 0 || res->err_fd < 0) {
+            if (res->out_fd >= 0) close(res->out_fd);
+            if (res->err_fd >= 0) close(res->err_fd);
+            res->out_fd = res->err_fd = -1;
+        } else if (!pool->keep_order) {
+            emit_result(pool, res);
+        }
+        int before = pool->emitted;
+        while (pool->keep_order && pool->emitted < pool->nvalues &&
+               pool->results[pool->emitted].done) {
+            par_result_t *ready = &pool->results[pool->emitted++];
+            if (ready->out_fd >= 0) {
+                emit_result(pool, ready);
+            }
+        }
+        if (pool->emitted != before) {
+            pthread_cond_broadcast(&pool->released);
+        }
+        pthread_mutex_unlock(&pool->out_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Implements the parallel built-in
+ *
+ * @param cmd    The parsed parallel command
+ * @param out_fd Descriptor instance output is copied to
+ * @param err_fd Descriptor instance errors are copied to
+ * @return Number of failed instances (at most 101), or 255 on a usage error
+ */
+int parallel_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    int jobs = cpu_count();
+    int keep_order = 0;
+    int i = 1;
+
+    (void)in_fd;
+    // Options come first: -j N, -jN, -k
+    for (; i < cmd->argc && cmd->argv[i][0] == '-'; i++) {
+        const char *opt = cmd->argv[i];
+        if (strcmp(opt, "-k") == 0) {
+            keep_order = 1;
+        } else if (strncmp(opt, "-j", 2) == 0) {
+            const char *n = opt[2] ? opt + 2 : (i + 1 < cmd->argc ? cmd->argv[++i] : "");
+            char *end;
+            long v = strtol(n, &end, 10);
+            if (*n == '\0' || *end != '\0' || v < 1) {
+                dprintf(err_fd, "parallel: -j needs a positive number\n");
+                return 255;
+            }
+            jobs = (v > PARALLEL_MAX_JOBS) ? PARALLEL_MAX_JOBS : (int)v;
+        } else {
+            break;
+        }
+    }
+
+    int sep = i;
+    while (sep < cmd->argc && strcmp(cmd->argv[sep], PARALLEL_SEP) != 0) {
+        sep++;
+    }
+    if (sep == i || sep == cmd->argc) {
+        dprintf(err_fd, "usage: parallel [-j N] [-k] command [arg ...] ::: value ...\n");
+        return 255;
+    }
+
+    par_pool_t pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .out_lock = PTHREAD_MUTEX_INITIALIZER,
+        .released = PTHREAD_COND_INITIALIZER,
+        .tmpl = &cmd->argv[i],
+        .ntmpl = sep - i,
+        .values = &cmd->argv[sep + 1],
+        .nvalues = cmd->argc - sep - 1,
+        .keep_order = keep_order,
+        .out_fd = out_fd,
+        .err_fd = err_fd,
+    };
+    if (pool.nvalues == 0) {
+        return 0;
+    }
+    if (jobs > pool.nvalues) {
+        jobs = pool.nvalues;
+    }
+    pool.window = jobs * PARALLEL_KEEP_AHEAD;
+
+    pool.results = calloc(pool.nvalues, sizeof(par_result_t));
+    pthread_t *tids = calloc(jobs, sizeof(pthread_t));
+    pool.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (!pool.results || !tids || pool.null_fd < 0) {
+        dprintf(err_fd, "parallel: %s\n", strerror(pool.null_fd < 0 ? errno : ENOMEM));
+        free(pool.results);
+        free(tids);
+        if (pool.null_fd >= 0) close(pool.null_fd);
+        return 255;
+    }
+
+    // The calling thread is worker 0
+    int started = 1;
+    for (; started < jobs; started++) {
+        if (pthread_create(&tids[started], NULL, worker, &pool) != 0) {
+            break;
+        }
+    }
+    worker(&pool);
+    for (int t = 1; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    close(pool.null_fd);
+    free(pool.results);
+    free(tids);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_mutex_destroy(&pool.out_lock);
+    pthread_cond_destroy(&pool.released);
+    return (pool.failures > PARALLEL_MAX_FAILS) ? PARALLEL_MAX_FAILS : pool.failures;
+}
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "dshlib.h"
+
+/*
+ * Executable lookup cache
+ *
+ * Maps a command name to the absolute path it resolved to on PATH so
+ * commands can be launched with a single exec instead of execvp's walk
+ * over every PATH directory. The cache is dropped whenever PATH changes or
+ * inotify reports that an entry was added, removed or renamed in any PATH
+ * directory, so a newly installed binary that shadows a cached one is
+ * picked up on the next launch. One cache is shared by every session in
+ * the process and guarded by a mutex.
+ */
+
+#define PATH_CACHE_MIN_SLOTS 64
+#define PATH_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Search path used by execvp when PATH is unset
+#define PATH_DEFAULT "/bin:/usr/bin"
+
+typedef struct path_entry {
+    char *name;          // NULL marks an empty slot
+    char *path;
+    uint32_t hash;
+    unsigned long hits;
+} path_entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    path_entry_t *slots;
+    size_t nslots;       // power of two
+    size_t count;
+    char *path_env;      // PATH the entries were resolved against
+    int inotify_fd;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1 };
+
+/**
+ * FNV-1a over the command name
+ */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Empties the table but keeps its slots; caller holds the lock
+ */
+static void drop_entries(void) {
+    for (size_t i = 0; i < cache.nslots; i++) {
+        free(cache.slots[i].name);
+        free(cache.slots[i].path);
+        cache.slots[i].name = NULL;
+        cache.slots[i].path = NULL;
+    }
+    cache.count = 0;
+}
+
+/**
+ * Replaces the inotify instance with one watching every PATH directory;
+ * caller holds the lock. Without inotify the cache still works, it just
+ * only notices PATH changes.
+ */
+static void watch_path_dirs(const char *path_env) {
+    if (cache.inotify_fd >= 0) {
+        close(cache.inotify_fd);
+    }
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotify_fd < 0) {
+        return;
+    }
+
+    char dir[PATH_MAX];
+    const char *p = path_env;
+    while (1) {
+        size_t len = strcspn(p, ":");
+        if (len > 0 && len < sizeof(dir)) {
+            memcpy(dir, p, len);
+            dir[len] = '\0';
+            // Missing directories are fine; they cannot hold commands
+            inotify_add_watch(cache.inotify_fd, dir, PATH_WATCH_EVENTS);
+        }
+        if (p[len] == '\0') {
+            break;
+        }
+        p += len + 1;
+    }
+}
+
+/**
+ * Drops the cache if PATH changed or a PATH directory changed since the
+ * last lookup; caller holds the lock
+ */
+static void revalidate(void) {
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = PATH_DEFAULT;
+    }
+
+    if (!cache.path_env || strcmp(cache.path_env, path_env) != 0) {
+        drop_entries();
+        free(cache.path_env);
+        cache.path_env = strdup(path_env);
+        watch_path_dirs(path_env);
+        return;
+    }
+
+    if (cache.inotify_fd >= 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        while (read(cache.inotify_fd, events, sizeof(events)) > 0) {
+            changed = true;
+        }
+        if (changed) {
+            drop_entries();
+        }
+    }
+}
+
+/**
+ * Linear probe for name; returns its slot or the empty slot it would
+ * occupy. Caller holds the lock and guarantees a free slot exists.
+ */
+static path_entry_t *find_slot(const char *name, uint32_t hash) {
+    size_t mask = cache.nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        path_entry_t *e = &cache.slots[i];
+        if (!e->name || (e->hash == hash && strcmp(e->name, name) == 0)) {
+            return e;
+        }
+    }
+}
+
+/**
+ * Doubles the slot array once it is half full; caller holds the lock
+ */
+static int grow_table(void) {
+    size_t nslots = cache.nslots ? cache.nslots * 2 : PATH_CACHE_MIN_SLOTS;
+    path_entry_t *old = cache.slots;
+    size_t old_n = cache.nslots;
+
+    cache.slots = calloc(nslots, sizeof(path_entry_t));
+    if (!cache.slots) {
+        cache.slots = old;
+        return ERR_MEMORY;
+    }
+    cache.nslots = nslots;
+    for (size_t i = 0; i < old_n; i++) {
+        if (old[i].name) {
+            *find_slot(old[i].name, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return OK;
+}
+
+/**
+ * Walks PATH the way execvp does and stores the first executable regular
+ * file found. Hits in relative PATH entries depend on the working directory
+ * and are reported as not cacheable.
+ */
+static int search_path(const char *name, char *out, size_t outsz, bool *cacheable) {
+    const char *p = cache.path_env ? cache.path_env : PATH_DEFAULT;
+    struct stat st;
+
+    while (1) {
+        size_t len = strcspn(p, ":");
+        int n = (len == 0) ? snprintf(out, outsz, "%s", name)
+                           : snprintf(out, outsz, "%.*s/%s", (int)len, p, name);
+        if (n > 0 && (size_t)n < outsz && access(out, X_OK) == 0 &&
+            stat(out, &st) == 0 && S_ISREG(st.st_mode)) {
+            *cacheable = (len > 0 && p[0] == '/');
+            return OK;
+        }
+        if (p[len] == '\0') {
+            return ERR_EXEC_CMD;
+        }
+        p += len + 1;
+    }
+}
+
+/**
+ * Resolves a command name to the path execve should run
+ *
+ * Names containing '/' are returned unchanged. Everything else is looked up
+ * in the cache and, on a miss, on PATH.
+ *
+ * @param name  Command name (argv[0])
+ * @param out   Buffer that receives the path
+ * @param outsz Size of out
+ * @return OK when out holds a path, ERR_EXEC_CMD if name is not on PATH
+ */
+int path_lookup(const char *name, char *out, size_t outsz) {
+    if (!name || !*name) return ERR_EXEC_CMD;
+
+    if (strchr(name, '/')) {
+        if (strlen(name) >= outsz) return ERR_EXEC_CMD;
+        strcpy(out, name);
+        return OK;
+    }
+
+    int rc = OK;
+    uint32_t hash = name_hash(name);
+
+    pthread_mutex_lock(&cache.lock);
+    revalidate();
+
+    if (cache.count * 2 >= cache.nslots && grow_table() != OK) {
+        bool ignored;
+        rc = search_path(name, out, outsz, &ignored);
+        pthread_mutex_unlock(&cache.lock);
+        return rc;
+    }
+
+    path_entry_t *e = find_slot(name, hash);
+    if (e->name) {
+        if (strlen(e->path) < outsz) {
+            strcpy(out, e->path);
+            e->hits++;
+        } else {
+            rc = ERR_EXEC_CMD;
+        }
+    } else {
+        bool cacheable = false;
+        rc = search_path(name, out, outsz, &cacheable);
+        if (rc == OK && cacheable) {
+            e->name = strdup(name);
+            e->path = strdup(out);
+            if (e->name && e->path) {
+                e->hash = hash;
+                e->hits = 1;
+                cache.count++;
+            } else {
+                free(e->name);
+                free(e->path);
+                e->name = e->path = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+    return rc;
+}
+
+/**
+ * Forgets every cached path
+ */
+void path_cache_clear(void) {
+    pthread_mutex_lock(&cache.lock);
+    drop_entries();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Writes the hash listing from a copy taken under the lock, so a reader
+ * that stops reading blocks only this command, not every lookup
+ *
+ * @param out_fd Descriptor for the listing
+ * @return 0, or 1 if the copy could not be allocated
+ */
+static int list_entries(int out_fd) {
+    pthread_mutex_lock(&cache.lock);
+    revalidate();
+    size_t count = cache.count;
+    size_t chars = 0;
+    for (size_t i = 0; i < cache.nslots; i++) {
+        if (cache.slots[i].name) {
+            chars += strlen(cache.slots[i].path) + 1;
+        }
+    }
+    unsigned long *hits = malloc(count * sizeof(unsigned long) + chars + 1);
+    if (!hits) {
+        pthread_mutex_unlock(&cache.lock);
+        return 1;
+    }
+    char *paths = (char *)(hits + count);
+    char *p = paths;
+    size_t n = 0;
+    for (size_t i = 0; i < cache.nslots; i++) {
+        if (cache.slots[i].name) {
+            size_t len = strlen(cache.slots[i].path) + 1;
+            memcpy(p, cache.slots[i].path, len);
+            p += len;
+            hits[n++] = cache.slots[i].hits;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (count == 0) {
+        dprintf(out_fd, "hash: hash table empty\n");
+    } else {
+        dprintf(out_fd, "hits\tcommand\n");
+    }
+    p = paths;
+    for (size_t i = 0; i < n; i++) {
+        dprintf(out_fd, "%4lu\t%s\n", hits[i], p);
+        p += strlen(p) + 1;
+    }
+    free(hits);
+    return 0;
+}
+
+/**
+ * Implements the hash built-in
+ *
+ *   hash          list cached commands with their hit counts
+ *   hash -r       forget every cached path
+ *   hash NAME...  look NAME up now and remember it
+ *
+ * @param cmd    The parsed hash command
+ * @param out_fd Descriptor for the listing
+ * @param err_fd Descriptor for lookup failures
+ * @return 0, or 1 if a NAME was not found
+ */
+int path_cache_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    int rc = 0;
+
+    (void)in_fd;
+    if (cmd->argc == 1) {
+        return list_entries(out_fd);
+    }
+
+    for (int i = 1; i < cmd->argc; i++) {
+        char path[PATH_MAX];
+        if (strcmp(cmd->argv[i], "-r") == 0) {
+            path_cache_clear();
+        } else if (path_lookup(cmd->argv[i], path, sizeof(path)) != OK) {
+            dprintf(err_fd, "hash: %s: not found\n", cmd->argv[i]);
+            rc = 1;
+        }
+    }
+    return rc;
+}
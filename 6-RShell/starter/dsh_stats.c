@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dshlib.h"
+
+/*
+ * Timing and resource accounting
+ *
+ * "time pipeline", or any pipeline once "set stats=on" is in effect, is
+ * run through launch_pipeline as usual and then summarized one line per
+ * stage: wall time from launch to exit, user and system CPU, peak RSS and
+ * voluntary/involuntary context switches, all from wait4's rusage (or
+ * RUSAGE_THREAD for a built-in stage), plus how long posix_spawn took to
+ * get the process exec'd. The slowest stage is starred. The footer adds
+ * up the stages and shows the shell's own overhead for the line: parse
+ * time and total spawn latency.
+ *
+ * The summary goes to the pipeline's stderr, so a remote client sees it
+ * too. Background jobs are not timed; "time cmd &" just runs cmd.
+ */
+
+#define STATS_CMD_WIDTH 32
+
+/**
+ * Reads CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Decides whether a pipeline is timed, stripping a leading "time" word
+ *
+ * A "time" with nothing after it in its stage drops the stage, so
+ * "time | wc" times wc and a bare "time" leaves an empty list.
+ *
+ * @param clist The parsed pipeline
+ * @param scope BUILTIN_LOCAL or BUILTIN_REMOTE
+ * @return 1 if the pipeline should be reported with stats_report
+ */
+int stats_begin(command_list_t *clist, unsigned scope) {
+    cmd_buff_t *first = &clist->commands[0];
+    const builtin_desc_t *bi = builtin_lookup(first->argv[0], scope);
+
+    if (!bi || bi->id != BI_CMD_TIME) {
+        return current_session()->stats;
+    }
+    first->argv++;
+    first->argc--;
+    first->_argv_cap--;
+    if (first->argc == 0) {
+        if (first->input_fd >= 0) {
+            close(first->input_fd);
+        }
+        clist->commands++;
+        clist->num--;
+        clist->_cap--;
+    }
+    return 1;
+}
+
+static double tv_secs(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Writes argv as one line, cut to STATS_CMD_WIDTH characters
+ */
+static void format_cmd(char *out, size_t outsz, cmd_buff_t *cmd) {
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (int a = 0; a < cmd->argc && len < outsz; a++) {
+        len += snprintf(out + len, outsz - len, "%s%s", a ? " " : "", cmd->argv[a]);
+    }
+    if (len >= outsz && outsz > 4) {
+        strcpy(out + outsz - 4, "...");
+    }
+}
+
+/**
+ * Prints the per-stage summary of a timed pipeline
+ *
+ * @param fd       Descriptor to write the summary to
+ * @param clist    The pipeline that ran
+ * @param stages   Its collected stages, clist->num entries
+ * @param start_ns When the line started executing
+ * @param end_ns   When its last stage was collected
+ */
+void stats_report(int fd, command_list_t *clist, pipeline_stage_t *stages,
+                  uint64_t start_ns, uint64_t end_ns) {
+    double user = 0, sys = 0;
+    uint64_t spawn_total = 0;
+    int slowest = -1;
+
+    for (int i = 0; i < clist->num; i++) {
+        if (slowest < 0 || stages[i].end_ns - stages[i].start_ns >
+                           stages[slowest].end_ns - stages[slowest].start_ns) {
+            slowest = i;
+        }
+    }
+
+    dprintf(fd, "%-6s %9s %9s %9s %9s %6s %6s %9s  %s\n", "stage", "real", "user",
+            "sys", "maxrss", "vcsw", "ivcsw", "spawn", "command");
+    for (int i = 0; i < clist->num; i++) {
+        pipeline_stage_t *st = &stages[i];
+        char cmd[STATS_CMD_WIDTH + 1];
+        char spawn[24];
+        char id[16];
+
+        format_cmd(cmd, sizeof(cmd), st->cmd);
+        if (st->spawn_ns > 0) {
+            snprintf(spawn, sizeof(spawn), "%luus",
+                     (unsigned long)((st->spawn_ns - st->start_ns) / 1000));
+            spawn_total += st->spawn_ns - st->start_ns;
+        } else {
+            snprintf(spawn, sizeof(spawn), "%s", st->builtin ? "builtin" : "-");
+        }
+        snprintf(id, sizeof(id), "%d%s", i + 1,
+                 (clist->num > 1 && i == slowest) ? "*" : "");
+        user += tv_secs(st->usage.ru_utime);
+        sys += tv_secs(st->usage.ru_stime);
+
+        dprintf(fd, "%-6s %8.3fs %8.3fs %8.3fs %8ldK %6ld %6ld %9s  %s\n", id,
+                (st->end_ns - st->start_ns) / 1e9, tv_secs(st->usage.ru_utime),
+                tv_secs(st->usage.ru_stime), st->usage.ru_maxrss, st->usage.ru_nvcsw,
+                st->usage.ru_nivcsw, spawn, cmd);
+    }
+    dprintf(fd, "%-6s %8.3fs %8.3fs %8.3fs  parse %luus, spawn %luus\n", "total",
+            (end_ns - start_ns) / 1e9, user, sys,
+            (unsigned long)(clist->parse_ns / 1000), (unsigned long)(spawn_total / 1000));
+}
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dshlib.h"
+
+/*
+ * Event tracing
+ *
+ * Built with "make TRACE=1" (-DDSH_TRACE), trace points around parsing,
+ * spawning, waiting and the server's socket I/O record complete events
+ * into a ring buffer owned by the recording thread. Recording is a clock
+ * read and a few stores with no lock and no shared cache line: each ring
+ * has one writer, which publishes its head with a release store. Rings
+ * are pushed onto a global list with a CAS when a thread first records
+ * and are handed to a later thread when their owner exits, so the short
+ * lived pipeline threads do not each cost a ring. A full ring overwrites
+ * its oldest events.
+ *
+ * "trace FILE" or DSH_TRACE_FILE=FILE (written at exit) dumps every ring
+ * as Chrome trace JSON, which Perfetto and chrome://tracing open
+ * directly. A ring being written while it is dumped may contribute an
+ * event torn by the overwrite; the dump is a diagnostic, not a log.
+ *
+ * Without DSH_TRACE the trace points are empty macros and only the trace
+ * built-in remains, to say how to turn tracing on.
+ */
+
+#ifdef DSH_TRACE
+
+#define TRACE_RING_EVENTS 4096      // power of two
+
+typedef struct trace_event {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    long arg;
+    pid_t tid;           // a ring outlives the threads that record on it
+} trace_event_t;
+
+typedef struct trace_ring {
+    struct trace_ring *next;     // global list, never unlinked
+    atomic_int owned;            // a live thread is recording here
+    pid_t tid;                   // current owner
+    atomic_ulong head;           // events ever written
+    trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static _Atomic(trace_ring_t *) rings;
+static __thread trace_ring_t *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Thread exit hook: lets another thread take the ring over
+ */
+static void ring_release(void *arg) {
+    trace_ring_t *ring = arg;
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * Finds the calling thread's ring, claiming a released one or adding one
+ */
+static trace_ring_t *ring_get(void) {
+    if (my_ring) {
+        return my_ring;
+    }
+    pthread_once(&ring_key_once, ring_key_init);
+
+    trace_ring_t *ring;
+    for (ring = atomic_load(&rings); ring; ring = ring->next) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &free_ring, 1)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_store(&ring->owned, 1);
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+        }
+    }
+    ring->tid = gettid();
+    my_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/**
+ * Records one complete event on the calling thread's ring
+ *
+ * @param name     Static event name
+ * @param start_ns monotonic_ns() when the traced operation began
+ * @param end_ns   monotonic_ns() when it ended
+ * @param arg      Shown in the event's args: a pid, a byte count, ...
+ */
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, long arg) {
+    trace_ring_t *ring = ring_get();
+    if (!ring) {
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *ev = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    ev->name = name;
+    ev->start_ns = start_ns;
+    ev->dur_ns = end_ns - start_ns;
+    ev->arg = arg;
+    ev->tid = ring->tid;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Writes every ring as Chrome trace JSON
+ *
+ * @param path File to write
+ * @return 0, or -1 with errno set if the file cannot be written
+ */
+int trace_dump(const char *path) {
+    FILE *f = fopen(path, "we");
+    pid_t pid = getpid();
+    const char *sep = "";
+
+    if (!f) {
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (trace_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+
+        for (unsigned long i = first; i < head; i++) {
+            trace_event_t *ev = &ring->events[i & (TRACE_RING_EVENTS - 1)];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"dsh\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"arg\":%ld}}",
+                    sep, ev->name, ev->start_ns / 1e3, ev->dur_ns / 1e3, pid,
+                    ev->tid, ev->arg);
+            sep = ",";
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return (fclose(f) == 0) ? 0 : -1;
+}
+
+static void trace_dump_at_exit(void) {
+    const char *path = getenv("DSH_TRACE_FILE");
+    if (path && trace_dump(path) < 0) {
+        fprintf(stderr, "trace: %s: %s\n", path, strerror(errno));
+    }
+}
+
+/**
+ * Arranges for DSH_TRACE_FILE, if set, to be written when the process exits
+ */
+void trace_init(void) {
+    if (getenv("DSH_TRACE_FILE")) {
+        atexit(trace_dump_at_exit);
+    }
+}
+
+#endif
+
+/*
+ * trace FILE
+ *
+ * Dumps the events recorded so far to FILE as Chrome trace JSON
+ */
+int trace_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    (void)in_fd; (void)out_fd;
+#ifdef DSH_TRACE
+    if (cmd->argc != 2) {
+        dprintf(err_fd, "usage: trace FILE\n");
+        return 2;
+    }
+    if (trace_dump(cmd->argv[1]) < 0) {
+        dprintf(err_fd, "trace: %s: %s\n", cmd->argv[1], strerror(errno));
+        return 1;
+    }
+    return 0;
+#else
+    (void)cmd;
+    dprintf(err_fd, "trace: not compiled in; rebuild with make TRACE=1\n");
+    return 1;
+#endif
+}
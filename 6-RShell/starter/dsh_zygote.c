@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/sched.h>
+#include "dshlib.h"
+
+extern char **environ;
+
+/*
+ * Zygote launcher
+ *
+ * With -z the shell forks a helper at startup, while it is still small,
+ * and from then on hands every external command to it over a Unix socket:
+ * the resolved path, argv and environment as one length-prefixed message,
+ * and the command's stdin, stdout, stderr and working directory as
+ * SCM_RIGHTS descriptors. The zygote creates the command with
+ * clone3(CLONE_PARENT), so the command is the shell's child, not the
+ * zygote's: waitpid, wait4, pidfds and the job reaper work on it exactly
+ * as on a posix_spawn'd one. Launch cost then tracks the zygote's
+ * footprint, not that of a shell or server that has grown large.
+ *
+ * The zygote reports the pid, or the errno exec failed with, through a
+ * CLOEXEC pipe it shares with the new child, so a launch is as
+ * synchronous as posix_spawn and failures read the same. Redirection
+ * targets are opened by the shell, in its own working directory, before
+ * the request is sent. One request is in flight at a time. If the zygote
+ * dies, or the kernel has no clone3, the launcher falls back to
+ * posix_spawn for good.
+ */
+
+typedef struct zygote_req {
+    uint32_t len;        // bytes of strings that follow
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t resolved;   // path is absolute; otherwise search PATH
+} zygote_req_t;
+
+typedef struct zygote_reply {
+    pid_t pid;           // -1: the zygote could not create a process
+    int err;             // errno of the failed exec or clone3
+} zygote_reply_t;
+
+#define ZYGOTE_FDS 4     // stdin, stdout, stderr, working directory
+
+static struct {
+    pthread_mutex_t lock;
+    int sock;            // -1 when there is no zygote
+    pid_t pid;
+} zygote = { .lock = PTHREAD_MUTEX_INITIALIZER, .sock = -1, .pid = -1 };
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Zygote side: receives a request header and its descriptors
+ */
+static int recv_req(int sock, zygote_req_t *req, int fds[ZYGOTE_FDS]) {
+    char ctl[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct iovec iov = { req, sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl, .msg_controllen = sizeof(ctl),
+    };
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(*req) || !c || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(c), ZYGOTE_FDS * sizeof(int));
+    return 0;
+}
+
+/**
+ * Runs in the new command: wires its streams and execs, or reports why not
+ */
+static void zygote_child(const zygote_req_t *req, char **argv, char **envp,
+                         const int fds[ZYGOTE_FDS], int err_pipe) {
+    sigset_t none;
+
+    // The shell ignores SIGPIPE and blocks SIGCHLD; commands expect neither
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+    if (fchdir(fds[3]) == 0) {
+        if (req->resolved) {
+            execve(argv[-1], argv, envp);
+        } else {
+            execvpe(argv[-1], argv, envp);
+        }
+    }
+    int err = errno;
+    write(err_pipe, &err, sizeof(err));
+    _exit(127);
+}
+
+/**
+ * The zygote's loop: one request in, one command out, until the shell
+ * closes its end
+ */
+static void zygote_main(int sock) {
+    while (1) {
+        zygote_req_t req;
+        int fds[ZYGOTE_FDS];
+        zygote_reply_t reply = { -1, 0 };
+
+        if (recv_req(sock, &req, fds) < 0) {
+            _exit(0);
+        }
+        char *strs = malloc(req.len + 1);
+        // path, argv and envp in one array: [path] argv... NULL envp... NULL
+        char **vec = malloc((req.argc + req.envc + 3) * sizeof(char *));
+        if (!strs || !vec || read_full(sock, strs, req.len) < 0) {
+            _exit(1);
+        }
+        strs[req.len] = '\0';
+
+        char *p = strs;
+        for (uint32_t i = 0; i < req.argc + req.envc + 1; i++) {
+            vec[i + (i > req.argc)] = p;
+            p += strlen(p) + 1;
+        }
+        vec[req.argc + 1] = NULL;
+        vec[req.argc + req.envc + 2] = NULL;
+
+        int ep[2];
+        if (pipe2(ep, O_CLOEXEC) < 0) {
+            reply.err = errno;
+        } else {
+            // With CLONE_PARENT the child inherits the zygote's own exit
+            // signal, SIGCHLD, and clone3 insists exit_signal is left 0
+            struct clone_args args = { .flags = CLONE_PARENT };
+            pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+            if (pid == 0) {
+                zygote_child(&req, vec + 1, vec + req.argc + 2, fds, ep[1]);
+            }
+            close(ep[1]);
+            if (pid < 0) {
+                reply.err = errno;
+            } else {
+                reply.pid = pid;
+                // EOF means the exec went through and closed the pipe
+                if (read_full(ep[0], &reply.err, sizeof(reply.err)) < 0) {
+                    reply.err = 0;
+                }
+            }
+            close(ep[0]);
+        }
+
+        for (int i = 0; i < ZYGOTE_FDS; i++) {
+            close(fds[i]);
+        }
+        free(strs);
+        free(vec);
+        if (write_full(sock, &reply, sizeof(reply)) < 0) {
+            _exit(0);
+        }
+    }
+}
+
+/**
+ * Shuts the zygote down; caller holds the lock
+ */
+static void zygote_shutdown(void) {
+    if (zygote.sock >= 0) {
+        close(zygote.sock);
+        zygote.sock = -1;
+    }
+    if (zygote.pid > 0) {
+        while (waitpid(zygote.pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        zygote.pid = -1;
+    }
+}
+
+/**
+ * Stops the zygote; later launches use posix_spawn
+ */
+void zygote_stop(void) {
+    pthread_mutex_lock(&zygote.lock);
+    zygote_shutdown();
+    pthread_mutex_unlock(&zygote.lock);
+}
+
+/**
+ * Forks the zygote
+ *
+ * Call it early, before the process grows and before it starts threads;
+ * the zygote keeps whatever memory the process had at this point.
+ *
+ * @return OK, or ERR_EXEC_CMD if it could not be started
+ */
+int zygote_start(void) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        return ERR_EXEC_CMD;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return ERR_EXEC_CMD;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+
+    pthread_mutex_lock(&zygote.lock);
+    zygote.sock = sv[0];
+    zygote.pid = pid;
+    pthread_mutex_unlock(&zygote.lock);
+    atexit(zygote_stop);
+    return OK;
+}
+
+/**
+ * Gives a forked copy of the shell a zygote of its own
+ *
+ * The inherited zygote would make commands children of the parent, so the
+ * copy drops its end of the channel and, if the parent had a zygote, forks
+ * a new one. Call it right after fork, before the copy starts threads.
+ *
+ * @return OK, or ERR_EXEC_CMD if a new zygote could not be started
+ */
+int zygote_reinit(void) {
+    pthread_mutex_lock(&zygote.lock);
+    int had = (zygote.sock >= 0);
+    if (had) {
+        close(zygote.sock);
+    }
+    zygote.sock = -1;
+    zygote.pid = -1;
+    pthread_mutex_unlock(&zygote.lock);
+    return had ? zygote_start() : OK;
+}
+
+/**
+ * Launches a command through the zygote
+ *
+ * @param path     Resolved path, or the bare name to search PATH for
+ * @param resolved path came from path_lookup
+ * @param argv     NULL-terminated argument vector
+ * @param fds      stdin, stdout and stderr for the command
+ * @param pid      Receives the command's pid, a child of this process
+ * @return 0, the errno the exec failed with, or -1 if there is no zygote
+ *         and the caller should use posix_spawn
+ */
+int zygote_spawn(const char *path, int resolved, char **argv, const int fds[3], pid_t *pid) {
+    zygote_req_t req = { 0, 0, 0, resolved };
+    int sendfds[ZYGOTE_FDS] = { fds[0], fds[1], fds[2], -1 };
+    zygote_reply_t reply;
+    char *buf = NULL;
+    int rc = -1;
+
+    // Size and pack path, argv and environ
+    size_t len = strlen(path) + 1;
+    for (; argv[req.argc]; req.argc++) {
+        len += strlen(argv[req.argc]) + 1;
+    }
+    for (; environ && environ[req.envc]; req.envc++) {
+        len += strlen(environ[req.envc]) + 1;
+    }
+    req.len = len;
+    if (!(buf = malloc(len))) {
+        return -1;
+    }
+    char *p = stpcpy(buf, path) + 1;
+    for (uint32_t i = 0; i < req.argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    for (uint32_t i = 0; i < req.envc; i++) {
+        p = stpcpy(p, environ[i]) + 1;
+    }
+
+    if ((sendfds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    char ctl[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    memset(ctl, 0, sizeof(ctl));
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl, .msg_controllen = sizeof(ctl),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(ZYGOTE_FDS * sizeof(int));
+    memcpy(CMSG_DATA(c), sendfds, sizeof(sendfds));
+
+    pthread_mutex_lock(&zygote.lock);
+    if (zygote.sock >= 0) {
+        ssize_t n;
+        while ((n = sendmsg(zygote.sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+        }
+        if (n == sizeof(req) && write_full(zygote.sock, buf, len) == 0 &&
+            read_full(zygote.sock, &reply, sizeof(reply)) == 0 && reply.pid > 0) {
+            rc = reply.err;
+            *pid = reply.pid;
+        } else {
+            // Gone, or cannot create processes here (no clone3, a
+            // seccomp filter, ...): stop asking
+            zygote_shutdown();
+        }
+    }
+    pthread_mutex_unlock(&zygote.lock);
+
+    close(sendfds[3]);
+    free(buf);
+
+    // A failed exec still left a child of ours behind
+    if (rc > 0 && *pid > 0) {
+        while (waitpid(*pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        *pid = -1;
+    }
+    return rc;
+}
+
+/**
+ * Whether launches currently go through the zygote
+ */
+int zygote_active(void) {
+    pthread_mutex_lock(&zygote.lock);
+    int active = (zygote.sock >= 0);
+    pthread_mutex_unlock(&zygote.lock);
+    return active;
+}
@@ -5,9 +5,185 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/wait.h>
 #include "dshlib.h"
 
+// Session that parse and builtin state is charged to on this thread
+static __thread dsh_session_t *tls_session;
+// Used when a thread parses without entering a session of its own
+static __thread dsh_session_t tls_default_session;
+
+/**
+ * Initializes a session; the arena is allocated on first use
+ *
+ * @param session The session to initialize
+ * @return OK on success, ERR_MEMORY on failure
+ */
+int session_init(dsh_session_t *session) {
+    if (!session) return ERR_MEMORY;
+
+    memset(session, 0, sizeof(*session));
+    session->pipefail = 1;
+    session->parse_cache = 1;
+    return OK;
+}
+
+/**
+ * Releases everything a session owns
+ *
+ * @param session The session to destroy
+ */
+void session_destroy(dsh_session_t *session) {
+    if (!session) return;
+
+    jobs_detach(session);
+    arena_release(&session->arena, 0);
+    free(session->arena.base);
+    memset(&session->arena, 0, sizeof(session->arena));
+    if (tls_session == session) {
+        tls_session = NULL;
+    }
+}
+
+/**
+ * Gives a session's arena chunk back to the heap between lines
+ *
+ * The next line allocates a chunk of the same size again. A server holding
+ * many idle clients trims each one once it has been idle a while, so an
+ * idle session costs only its struct.
+ *
+ * @param session The session to trim; no list may be built from it
+ */
+void session_trim(dsh_session_t *session) {
+    if (!session) return;
+
+    arena_release(&session->arena, 0);
+    free(session->arena.base);
+    session->arena.base = NULL;
+}
+
+/**
+ * Makes a session current for the calling thread
+ *
+ * @param session The session to enter, or NULL to leave the current one
+ * @return The session that was previously current
+ */
+dsh_session_t *session_enter(dsh_session_t *session) {
+    dsh_session_t *prev = tls_session;
+    tls_session = session;
+    return prev;
+}
+
+/**
+ * Returns the calling thread's current session
+ *
+ * @return The entered session, or a per-thread default one
+ */
+dsh_session_t *current_session(void) {
+    return tls_session ? tls_session : &tls_default_session;
+}
+
+// Room kept at the start of every chunk to link it once it is outgrown
+#define ARENA_HDR_SZ ((sizeof(arena_chunk_t) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/**
+ * Carves memory out of an arena
+ *
+ * The backing chunk is allocated on first use and reused for every later
+ * line, so steady-state parsing never reaches the heap. When a line needs
+ * more than the chunk holds, a chunk of at least twice the size replaces it
+ * and the old one is kept until the next full reset, so pointers already
+ * handed out stay valid. Allocations are pointer aligned.
+ *
+ * @param arena The arena to allocate from
+ * @param size  Number of bytes wanted
+ * @return Pointer to the memory, or NULL if the heap is exhausted
+ */
+void *arena_alloc(cmd_arena_t *arena, size_t size) {
+    if (!arena) return NULL;
+
+    size_t start = (arena->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (!arena->base || start > arena->size || size > arena->size - start) {
+        // Without a chunk, size carries the demand seen before the last reset
+        size_t want = arena->base ? arena->size * 2 : arena->size;
+        if (want < CMD_ARENA_SZ) {
+            want = CMD_ARENA_SZ;
+        }
+        while (want - ARENA_HDR_SZ < size) {
+            want *= 2;
+        }
+        char *chunk = malloc(want);
+        if (!chunk) {
+            return NULL;
+        }
+        arena->heap_allocs++;
+
+        if (arena->base) {
+            arena_chunk_t *old = (arena_chunk_t *)arena->base;
+            old->prev = arena->chunks;
+            old->size = arena->size;
+            arena->chunks = old;
+            arena->retired += arena->size;
+        }
+        arena->base = chunk;
+        arena->size = want;
+        start = ARENA_HDR_SZ;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+/**
+ * Returns a mark that arena_release can later roll back to
+ *
+ * @param arena The arena to mark
+ * @return Opaque position in the arena
+ */
+size_t arena_mark(cmd_arena_t *arena) {
+    return arena ? arena->retired + arena->used : 0;
+}
+
+/**
+ * Returns everything allocated after a mark back to the arena
+ *
+ * Rolling back within the current chunk is O(1). Rolling back to an empty
+ * arena also frees any chunks that were outgrown since and, if the line
+ * needed more than the current chunk, replaces it with one big enough for
+ * the whole line on next use, so a session settles on a single chunk sized
+ * for its longest line.
+ *
+ * @param arena The arena to roll back
+ * @param mark  A value previously returned by arena_mark
+ */
+void arena_release(cmd_arena_t *arena, size_t mark) {
+    if (!arena) return;
+
+    if (mark <= ARENA_HDR_SZ) {
+        if (arena->chunks) {
+            size_t demand = arena->retired + arena->used;
+            while (arena->chunks) {
+                arena_chunk_t *prev = arena->chunks->prev;
+                free(arena->chunks);
+                arena->chunks = prev;
+            }
+            free(arena->base);
+            arena->base = NULL;
+            arena->size = demand;
+            arena->retired = 0;
+        }
+        arena->used = ARENA_HDR_SZ;
+    } else if (mark >= arena->retired) {
+        if (mark - arena->retired < arena->used) {
+            arena->used = mark - arena->retired;
+        }
+    } else {
+        // The mark is in an outgrown chunk; it is reclaimed on full reset
+        arena->used = ARENA_HDR_SZ;
+    }
+}
+
 /**
  * Allocates memory for a command buffer
  *
@@ -18,14 +194,22 @@ int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
     if (!cmd_buff) return ERR_MEMORY;
     
     cmd_buff->_cmd_buffer = (char *)malloc(SH_CMD_MAX * sizeof(char));
-    if (!cmd_buff->_cmd_buffer) {
+    cmd_buff->argv = malloc(CMD_ARGV_MAX * sizeof(char *));
+    if (!cmd_buff->_cmd_buffer || !cmd_buff->argv) {
+        free(cmd_buff->_cmd_buffer);
+        free(cmd_buff->argv);
+        cmd_buff->_cmd_buffer = NULL;
+        cmd_buff->argv = NULL;
         return ERR_MEMORY;
     }
+    cmd_buff->_argv_cap = CMD_ARGV_MAX;
     cmd_buff->argc = 0;
     for (int i = 0; i < CMD_ARGV_MAX; i++) {
         cmd_buff->argv[i] = NULL;
     }
     cmd_buff->input_file = NULL;
+    cmd_buff->input_kind = INPUT_FILE;
+    cmd_buff->input_fd = -1;
     cmd_buff->output_file = NULL;
     cmd_buff->append_output = 0;
     return OK;
@@ -44,11 +228,13 @@ int free_cmd_buff(cmd_buff_t *cmd_buff) {
         free(cmd_buff->_cmd_buffer);
         cmd_buff->_cmd_buffer = NULL;
     }
+    free(cmd_buff->argv);
+    cmd_buff->argv = NULL;
+    cmd_buff->_argv_cap = 0;
     cmd_buff->argc = 0;
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
-        cmd_buff->argv[i] = NULL;
-    }
     cmd_buff->input_file = NULL;
+    cmd_buff->input_kind = INPUT_FILE;
+    cmd_buff->input_fd = -1;
     cmd_buff->output_file = NULL;
     cmd_buff->append_output = 0;
     return OK;
@@ -65,10 +251,12 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
     
     memset(cmd_buff->_cmd_buffer, 0, SH_CMD_MAX);
     cmd_buff->argc = 0;
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
+    for (int i = 0; i < cmd_buff->_argv_cap; i++) {
         cmd_buff->argv[i] = NULL;
     }
     cmd_buff->input_file = NULL;
+    cmd_buff->input_kind = INPUT_FILE;
+    cmd_buff->input_fd = -1;
     cmd_buff->output_file = NULL;
     cmd_buff->append_output = 0;
     return OK;
@@ -83,463 +271,797 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
 int close_cmd_buff(cmd_buff_t *cmd_buff) {
     if (!cmd_buff) return ERR_MEMORY;
     
-    if (cmd_buff->argc < CMD_ARGV_MAX) {
+    if (cmd_buff->argc < cmd_buff->_argv_cap) {
         cmd_buff->argv[cmd_buff->argc] = NULL;
     }
     return OK;
 }
 
 /**
- * Builds a command buffer from a command line
+ * Returns true for the characters that separate words on a command line
+ */
+static inline bool is_word_sep(char c) {
+    return c == SPACE_CHAR || c == '\t' || c == '\n' || c == '\r';
+}
+
+/**
+ * Resets the per-command fields of a pipeline stage without touching
+ * its buffer
  *
- * @param cmd_line The command line to parse
- * @param cmd_buff The command buffer to build
- * @return OK on success, ERR_MEMORY on failure
+ * @param cmd The command buffer to reset
  */
-int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-    if (!cmd_line || !cmd_buff || !cmd_buff->_cmd_buffer) return ERR_MEMORY;
-    
-    // Clear the command buffer
-    clear_cmd_buff(cmd_buff);
-    
-    // Copy the command line to the buffer
-    strncpy(cmd_buff->_cmd_buffer, cmd_line, SH_CMD_MAX - 1);
-    cmd_buff->_cmd_buffer[SH_CMD_MAX - 1] = '\0';
-    
-    // Tokenize the command line
-    char *token = strtok(cmd_buff->_cmd_buffer, " \t\n");
-    while (token != NULL && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        // Check for input redirection '<'
-        if (strcmp(token, "<") == 0) {
-            token = strtok(NULL, " \t\n");
-            if (token) {
-                cmd_buff->input_file = token;
+static void reset_stage(cmd_buff_t *cmd) {
+    cmd->argc = 0;
+    cmd->argv[0] = NULL;
+    cmd->input_file = NULL;
+    cmd->input_kind = INPUT_FILE;
+    cmd->input_fd = -1;
+    cmd->output_file = NULL;
+    cmd->append_output = 0;
+}
+
+/**
+ * Copies the body of a $(...) down to *wr between markers
+ *
+ * *rd is just past the '$' and on the '('. Parentheses nest, and quotes
+ * inside are copied as they are but hide the parentheses they enclose.
+ * Like the rest of tokenize_stage, one character is read for every one
+ * written ('$(' becomes the opening marker, ')' the closing one).
+ *
+ * @param rd     In/out read cursor, left just past the closing ')'
+ * @param wr     In/out write cursor
+ * @param marker SUBST_OPEN, or SUBST_OPEN_QUOTED inside double quotes
+ * @return OK, or ERR_CMD_ARGS_BAD if the line ends first
+ */
+static int copy_subst(char **rd, char **wr, char marker) {
+    char *r = *rd + 1;
+    char *w = *wr;
+    char quote = '\0';
+    int depth = 1;
+
+    *w++ = marker;
+    while (1) {
+        char c = *r;
+        if (c == '\0') {
+            return ERR_CMD_ARGS_BAD;
+        }
+        r++;
+        if (quote) {
+            if (c == quote) {
+                quote = '\0';
             }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            break;
+        }
+        *w++ = c;
+    }
+    *w++ = SUBST_CLOSE;
+
+    *rd = r;
+    *wr = w;
+    return OK;
+}
+
+/**
+ * Tokenizes one pipeline stage in place
+ *
+ * Scans from *rd until an unquoted '|', a trailing '&' or the end of the
+ * string. Words are compacted (quotes removed) at *wr and terminated with
+ * '\0', so argv, input_file and output_file point straight into the buffer
+ * being scanned. Every character is consumed before anything is written
+ * over it, which keeps the write cursor strictly behind the read cursor.
+ * Recognizes '<', '<<', '<<<', '>' and '>>' with or without surrounding
+ * whitespace. The text of a $(...) is kept as written, quotes and all,
+ * between SUBST_OPEN and SUBST_CLOSE markers for expand_cmd_list, unquoted
+ * wildcards in command words become GLOB_* markers, and *expand is set
+ * when the stage needs either. Keeps no state outside its arguments, so it
+ * is safe to use from several threads at once.
+ *
+ * cmd->argv must already hold cmd->_argv_cap slots. When it fills up the
+ * vector is doubled inside arena, or, without an arena, the stage is
+ * rejected as too big.
+ *
+ * @param rd     In/out read cursor, left just past the stage
+ * @param wr     In/out write cursor for compacted words
+ * @param cmd    The command buffer to fill
+ * @param arena  Arena to grow argv in, or NULL for a fixed-size argv
+ * @param term   Set to the operator that ended the stage: '|', '&' or '\0'
+ * @param expand Set to 1 if the stage has a substitution or here input
+ * @return OK, WARN_NO_CMDS for an empty stage, ERR_CMD_ARGS_BAD on a
+ *         dangling redirection, unterminated quote or $(...) or '&' that
+ *         does not end the line, ERR_CMD_OR_ARGS_TOO_BIG
+ *         when a fixed-size argv overflows, ERR_MEMORY if growing fails
+ */
+static int tokenize_stage(char **rd, char **wr, cmd_buff_t *cmd,
+                          cmd_arena_t *arena, char *term, int *expand) {
+    char *r = *rd;
+    char *w = *wr;
+    char **target = NULL;   // redirection waiting for its file name
+    char pending = '\0';    // delimiter already consumed by the last word
+    int rc = OK;
+
+    reset_stage(cmd);
+    *term = '\0';
+
+    while (rc == OK) {
+        char c = pending;
+        if (c) {
+            pending = '\0';
+        } else if ((c = *r) == '\0') {
+            break;
+        } else {
+            r++;
+        }
+
+        if (is_word_sep(c)) {
+            continue;
         }
-        // Check for output redirection '>'
-        else if (strcmp(token, ">") == 0) {
-            token = strtok(NULL, " \t\n");
-            if (token) {
-                cmd_buff->output_file = token;
-                cmd_buff->append_output = 0;
+        if (c == PIPE_CHAR) {
+            *term = PIPE_CHAR;
+            break;
+        }
+        if (c == BG_CHAR) {
+            // Only whitespace may follow a background marker
+            while (is_word_sep(*r)) {
+                r++;
+            }
+            if (*r != '\0' || target) {
+                rc = ERR_CMD_ARGS_BAD;
             }
+            *term = BG_CHAR;
+            break;
         }
-        // Check for output append redirection '>>'
-        else if (strcmp(token, ">>") == 0) {
-            token = strtok(NULL, " \t\n");
-            if (token) {
-                cmd_buff->output_file = token;
-                cmd_buff->append_output = 1;
+        if (c == REDIR_IN_CHAR || c == REDIR_OUT_CHAR) {
+            if (target) {
+                rc = ERR_CMD_ARGS_BAD;
+            } else if (c == REDIR_IN_CHAR) {
+                target = &cmd->input_file;
+                cmd->input_kind = INPUT_FILE;
+                if (*r == REDIR_IN_CHAR) {
+                    r++;
+                    cmd->input_kind = INPUT_HEREDOC;
+                    if (*r == REDIR_IN_CHAR) {
+                        r++;
+                        cmd->input_kind = INPUT_HERESTRING;
+                    }
+                    *expand = 1;
+                }
+            } else {
+                target = &cmd->output_file;
+                cmd->append_output = (*r == REDIR_OUT_CHAR);
+                r += cmd->append_output;
             }
+            continue;
+        }
+
+        // c starts a word: copy it down to w, dropping quote characters
+        char *word = w;
+        char quote = '\0';
+        while (1) {
+            if (c == '$' && *r == '(' && quote != '\'') {
+                if (copy_subst(&r, &w, quote ? SUBST_OPEN_QUOTED : SUBST_OPEN) != OK) {
+                    rc = ERR_CMD_ARGS_BAD;
+                    break;
+                }
+                *expand = 1;
+            } else if (quote) {
+                if (c == quote) {
+                    quote = '\0';
+                } else {
+                    *w++ = c;
+                }
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (is_word_sep(c) || c == PIPE_CHAR || c == BG_CHAR ||
+                       c == REDIR_IN_CHAR || c == REDIR_OUT_CHAR) {
+                pending = c;
+                break;
+            } else if (!target && (c == '*' || c == '?' || c == '[')) {
+                *w++ = (c == '*') ? GLOB_ANY : (c == '?') ? GLOB_ONE : GLOB_CLASS;
+                *expand = 1;
+            } else {
+                *w++ = c;
+            }
+            if ((c = *r) == '\0') {
+                break;
+            }
+            r++;
         }
-        else {
-            cmd_buff->argv[cmd_buff->argc++] = token;
+        if (quote || rc != OK) {
+            rc = ERR_CMD_ARGS_BAD;
+            break;
         }
-        token = strtok(NULL, " \t\n");
+        *w++ = '\0';
+
+        if (target) {
+            *target = word;
+            target = NULL;
+            continue;
+        }
+        if (cmd->argc + 1 >= cmd->_argv_cap) {
+            if (!arena) {
+                rc = ERR_CMD_OR_ARGS_TOO_BIG;
+                break;
+            }
+            char **grown = arena_alloc(arena, 2 * cmd->_argv_cap * sizeof(char *));
+            if (!grown) {
+                rc = ERR_MEMORY;
+                break;
+            }
+            memcpy(grown, cmd->argv, cmd->argc * sizeof(char *));
+            cmd->argv = grown;
+            cmd->_argv_cap *= 2;
+        }
+        cmd->argv[cmd->argc++] = word;
     }
-    
-    // Ensure the last argument is NULL
-    close_cmd_buff(cmd_buff);
-    
-    return (cmd_buff->argc > 0) ? OK : WARN_NO_CMDS;
+
+    if (rc == OK && target) {
+        rc = ERR_CMD_ARGS_BAD;
+    }
+    cmd->argv[cmd->argc] = NULL;
+
+    *rd = r;
+    *wr = w;
+
+    if (rc != OK) {
+        return rc;
+    }
+    return (cmd->argc > 0) ? OK : WARN_NO_CMDS;
+}
+
+/**
+ * Builds a command buffer from a command line
+ *
+ * The line is copied once into the command's own buffer and tokenized
+ * there. Parsing stops at the first '|'; use build_cmd_list for pipelines.
+ * Nothing here expands a line, so wildcards are handed back as typed and
+ * a $(...) is refused rather than left as markers in the words.
+ *
+ * @param cmd_line The command line to parse
+ * @param cmd_buff The command buffer to build
+ * @return OK on success, WARN_NO_CMDS for an empty line, or a parse error
+ */
+int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+    if (!cmd_line || !cmd_buff || !cmd_buff->_cmd_buffer) return ERR_MEMORY;
+
+    size_t len = strlen(cmd_line);
+    if (len >= SH_CMD_MAX) {
+        return ERR_CMD_OR_ARGS_TOO_BIG;
+    }
+    memcpy(cmd_buff->_cmd_buffer, cmd_line, len + 1);
+
+    char *rd = cmd_buff->_cmd_buffer;
+    char *wr = cmd_buff->_cmd_buffer;
+    char term;
+    int expand = 0;
+    int rc = tokenize_stage(&rd, &wr, cmd_buff, NULL, &term, &expand);
+    if (rc != OK || !expand) {
+        return rc;
+    }
+
+    static const char subst_open[] = { SUBST_OPEN, SUBST_OPEN_QUOTED, '\0' };
+    const char *redirs[] = { cmd_buff->input_file, cmd_buff->output_file };
+    for (int i = 0; i < 2; i++) {
+        if (redirs[i] && strpbrk(redirs[i], subst_open)) {
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    for (int i = 0; i < cmd_buff->argc; i++) {
+        if (strpbrk(cmd_buff->argv[i], subst_open)) {
+            return ERR_CMD_ARGS_BAD;
+        }
+        glob_unmark(cmd_buff->argv[i]);
+    }
+    return OK;
 }
 
 /**
  * Builds a command list from a command line that may include pipes
  *
+ * The line is copied once into the current session's arena and tokenized in
+ * a single pass; every stage's argv and redirection targets point into that
+ * copy. The stage array starts with CMD_MAX slots and each argv with
+ * CMD_ARGV_MAX, both carved from the arena, and double in place when a line
+ * needs more, so ordinary lines cost no heap allocation and long ones only
+ * pay for what they use. Empty stages (e.g. "ls | | wc") are skipped. A
+ * trailing '&' sets clist->background, and a substitution or here input
+ * sets clist->expand: the line is not ready to run until expand_cmd_list
+ * has been called on it. A line seen before is built from the parsed
+ * command cache instead (see dsh_cmdcache.c). On any return other than OK
+ * the list has already been released.
+ *
  * @param cmd_line The command line to parse
  * @param clist The command list to build
- * @return OK on success, ERR_TOO_MANY_COMMANDS if too many commands
+ * @return OK on success, WARN_NO_CMDS, ERR_CMD_ARGS_BAD or ERR_MEMORY
  */
 int build_cmd_list(char *cmd_line, command_list_t *clist) {
     if (!cmd_line || !clist) return ERR_MEMORY;
-    
-    // Initialize command list
+
+    uint64_t start_ns = monotonic_ns();
+    dsh_session_t *session = current_session();
+    cmd_arena_t *arena = &session->arena;
     clist->num = 0;
-    
-    // Make a copy of the command line
-    char cmd_line_copy[SH_CMD_MAX];
-    strncpy(cmd_line_copy, cmd_line, SH_CMD_MAX - 1);
-    cmd_line_copy[SH_CMD_MAX - 1] = '\0';
-    
-    // Split by pipes
-    char *cmd_start = cmd_line_copy;
-    char *pipe_pos;
-    
-    while ((pipe_pos = strstr(cmd_start, PIPE_STRING)) != NULL && clist->num < CMD_MAX) {
-        // Null-terminate at pipe
-        *pipe_pos = '\0';
-        
-        // Allocate command buffer
-        if (alloc_cmd_buff(&clist->commands[clist->num]) != OK) {
-            return ERR_MEMORY;
-        }
-        
-        // Parse command
-        int rc = build_cmd_buff(cmd_start, &clist->commands[clist->num]);
-        if (rc != OK && rc != WARN_NO_CMDS) {
-            return rc;
-        }
-        
-        // If valid command, increment counter
-        if (rc == OK) {
-            clist->num++;
-        }
-        
-        // Move to next command after pipe
-        cmd_start = pipe_pos + 1;
+    clist->_line = NULL;
+    clist->commands = NULL;
+    clist->_tmpl = NULL;
+    clist->_mark = arena_mark(arena);
+
+    if (session->parse_cache && cmd_cache_lookup(cmd_line, clist)) {
+        arena->lines++;
+        clist->parse_ns = monotonic_ns() - start_ns;
+        TRACE_END(start_ns, "parse", clist->num);
+        return OK;
     }
-    
-    // Process the last command (or the only one if no pipes)
-    if (clist->num < CMD_MAX) {
-        if (alloc_cmd_buff(&clist->commands[clist->num]) != OK) {
+
+    size_t len = strlen(cmd_line);
+    clist->_line = arena_alloc(arena, len + 1);
+    clist->commands = arena_alloc(arena, CMD_MAX * sizeof(cmd_buff_t));
+    clist->_cap = CMD_MAX;
+    if (!clist->_line || !clist->commands) {
+        free_cmd_list(clist);
+        return ERR_MEMORY;
+    }
+    memcpy(clist->_line, cmd_line, len + 1);
+    arena->lines++;
+
+    char *rd = clist->_line;
+    char *wr = clist->_line;
+    char term;
+
+    clist->background = 0;
+    clist->expand = 0;
+    do {
+        if (clist->num == clist->_cap) {
+            cmd_buff_t *grown = arena_alloc(arena, 2 * clist->_cap * sizeof(cmd_buff_t));
+            if (!grown) {
+                free_cmd_list(clist);
+                return ERR_MEMORY;
+            }
+            memcpy(grown, clist->commands, clist->num * sizeof(cmd_buff_t));
+            clist->commands = grown;
+            clist->_cap *= 2;
+        }
+
+        cmd_buff_t *cmd = &clist->commands[clist->num];
+        cmd->_cmd_buffer = NULL;    // stages borrow clist->_line
+        cmd->_argv_cap = CMD_ARGV_MAX;
+        cmd->argv = arena_alloc(arena, CMD_ARGV_MAX * sizeof(char *));
+        if (!cmd->argv) {
+            free_cmd_list(clist);
             return ERR_MEMORY;
         }
-        
-        int rc = build_cmd_buff(cmd_start, &clist->commands[clist->num]);
+
+        int rc = tokenize_stage(&rd, &wr, cmd, arena, &term, &clist->expand);
         if (rc == OK) {
             clist->num++;
+        } else if (rc != WARN_NO_CMDS) {
+            free_cmd_list(clist);
+            return rc;
         }
-    } else {
-        return ERR_TOO_MANY_COMMANDS;
+    } while (term == PIPE_CHAR);
+    clist->background = (term == BG_CHAR);
+
+    if (clist->num == 0) {
+        free_cmd_list(clist);
+        return WARN_NO_CMDS;
     }
-    
-    return (clist->num > 0) ? OK : WARN_NO_CMDS;
+    if (session->parse_cache) {
+        cmd_cache_store(cmd_line, clist);
+    }
+    clist->parse_ns = monotonic_ns() - start_ns;
+    TRACE_END(start_ns, "parse", clist->num);
+    return OK;
 }
 
 /**
  * Frees memory for a command list
  *
+ * Stages own no memory of their own. Everything the list took from the
+ * session arena, including scratch space the executors carve for it, is
+ * handed back in O(1); nothing is returned to the heap. The memfds
+ * expand_cmd_list made for here input are closed, and a list built from
+ * the parsed command cache lets go of its template.
+ *
  * @param cmd_lst The command list to free
  * @return OK on success
  */
 int free_cmd_list(command_list_t *cmd_lst) {
     if (!cmd_lst) return OK;
-    
+
     for (int i = 0; i < cmd_lst->num; i++) {
-        free_cmd_buff(&cmd_lst->commands[i]);
+        if (cmd_lst->commands[i].input_fd >= 0) {
+            close(cmd_lst->commands[i].input_fd);
+            cmd_lst->commands[i].input_fd = -1;
+        }
     }
+    if (cmd_lst->_line || cmd_lst->commands) {
+        arena_release(&current_session()->arena, cmd_lst->_mark);
+    }
+    cmd_cache_release(cmd_lst->_tmpl);
+    cmd_lst->_tmpl = NULL;
     cmd_lst->num = 0;
-    
+    cmd_lst->commands = NULL;
+    cmd_lst->_cap = 0;
+    cmd_lst->_line = NULL;
+
     return OK;
 }
 
 /**
- * Matches a command against built-in commands
+ * Matches a command against the local shell's built-in commands
  *
  * @param input The command string to match
  * @return The built-in command enum value
  */
 Built_In_Cmds match_command(const char *input) {
-    if (!input) return BI_NOT_BI;
-    
-    if (strcmp(input, EXIT_CMD) == 0) {
-        return BI_CMD_EXIT;
-    } else if (strcmp(input, "cd") == 0) {
-        return BI_CMD_CD;
-    } else if (strcmp(input, "dragon") == 0) {
-        return BI_CMD_DRAGON;
-    }
-    
-    return BI_NOT_BI;
+    const builtin_desc_t *bi = builtin_lookup(input, BUILTIN_LOCAL);
+
+    return bi ? bi->id : BI_NOT_BI;
 }
 
 /**
  * Executes a built-in command
  *
  * @param cmd The command buffer to execute
- * @return The result of the command execution
+ * @return BI_CMD_EXIT, BI_EXECUTED, or BI_NOT_BI if cmd is not a built-in
  */
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
     if (!cmd || cmd->argc == 0 || !cmd->argv[0]) return BI_NOT_BI;
     
-    Built_In_Cmds cmd_type = match_command(cmd->argv[0]);
-    
-    switch (cmd_type) {
-        case BI_CMD_EXIT:
-            printf("exiting...\n");
-            return BI_CMD_EXIT;
-        case BI_CMD_CD:
-            if (cmd->argc > 1) {
-                if (chdir(cmd->argv[1]) != 0) {
-                    perror("cd");
-                }
-            } else {
-                // Change to home directory if no argument
-                const char *home = getenv("HOME");
-                if (home && chdir(home) != 0) {
-                    perror("cd");
-                }
-            }
-            return BI_EXECUTED;
-        case BI_CMD_DRAGON:
-            printf("Here be dragons!\n");
-            return BI_EXECUTED;
-        default:
-            return BI_NOT_BI;
+    const builtin_desc_t *bi = builtin_lookup(cmd->argv[0], BUILTIN_LOCAL);
+    if (!bi) {
+        return BI_NOT_BI;
+    }
+    if (bi->id == BI_CMD_EXIT) {
+        printf("exiting...\n");
+        return BI_CMD_EXIT;
     }
+
+    launch_fds_t fds = { -1, -1, -1 };
+    run_builtin(bi, cmd, &fds);
+    return BI_EXECUTED;
 }
 
 /**
  * Executes a single command
  *
+ * Its status is judged as a one-stage pipeline's (see pipeline_status): a
+ * process killed by a signal fails with 128 + signo, except for SIGPIPE.
+ *
  * @param cmd The command buffer to execute
  * @return OK on success, error code on failure
  */
 int exec_cmd(cmd_buff_t *cmd) {
     if (!cmd || cmd->argc == 0) return WARN_NO_CMDS;
     
-    // Check if it's a built-in command
-    Built_In_Cmds cmd_type = exec_built_in_cmd(cmd);
-    if (cmd_type == BI_CMD_EXIT) {
+    launch_fds_t fds = { -1, -1, -1 };
+    const builtin_desc_t *bi = builtin_lookup(cmd->argv[0], BUILTIN_LOCAL);
+
+    // Built-ins run in-process with the shell's own stdio
+    if (bi && bi->id == BI_CMD_EXIT) {
+        printf("exiting...\n");
         return OK_EXIT;
-    } else if (cmd_type == BI_EXECUTED) {
-        return OK;
+    }
+    pipeline_stage_t st = { .pid = -1 };
+    if (bi) {
+        st.status = run_builtin(bi, cmd, &fds);
+        return (pipeline_status(&st, 1, 0) == 0) ? OK : ERR_EXEC_CMD;
     }
     
-    // Fork and execute external command
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        // Fork failed
-        perror("fork");
+    // Spawn the external command with the shell's own stdio
+    pid_t pid;
+    if (launch_cmd(cmd, &fds, &pid) != OK) {
         return ERR_EXEC_CMD;
-    } else if (pid == 0) {
-        // Child process
-        
-        // Handle input redirection
-        if (cmd->input_file) {
-            int fd = open(cmd->input_file, O_RDONLY);
-            if (fd < 0) {
-                perror("open input file");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fd, STDIN_FILENO) < 0) {
-                perror("dup2 input file");
-                close(fd);
-                exit(EXIT_FAILURE);
-            }
-            close(fd);
-        }
-        
-        // Handle output redirection
-        if (cmd->output_file) {
-            int flags = O_WRONLY | O_CREAT;
-            if (cmd->append_output) {
-                flags |= O_APPEND;
-            } else {
-                flags |= O_TRUNC;
-            }
-            
-            int fd = open(cmd->output_file, flags, 0644);
-            if (fd < 0) {
-                perror("open output file");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fd, STDOUT_FILENO) < 0) {
-                perror("dup2 output file");
-                close(fd);
-                exit(EXIT_FAILURE);
-            }
-            close(fd);
-        }
-        
-        // Execute the command
-        if (execvp(cmd->argv[0], cmd->argv) < 0) {
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
-        
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            return ERR_EXEC_CMD;
-        }
     }
-    
-    return OK;
+
+    int ws = 0;
+    TRACE_BEGIN(wait_ns);
+    while (waitpid(pid, &ws, 0) < 0 && errno == EINTR) {
+    }
+    TRACE_END(wait_ns, "wait", pid);
+
+    st.status = WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+    return (pipeline_status(&st, 1, 0) == 0) ? OK : ERR_EXEC_CMD;
 }
 
 /**
  * Executes a pipeline of commands
  *
+ * A timed pipeline ("time ..." or set stats=on) always goes through
+ * launch_pipeline so every stage is measured, and its summary is printed
+ * to stderr once it finishes.
+ *
  * @param clist The command list to execute
  * @return OK on success, error code on failure
  */
 int execute_pipeline(command_list_t *clist) {
     if (!clist || clist->num == 0) return WARN_NO_CMDS;
-    
-    // Check if it's a single command
-    if (clist->num == 1) {
-        return exec_cmd(&clist->commands[0]);
+
+    uint64_t start_ns = monotonic_ns();
+    int timed = stats_begin(clist, BUILTIN_LOCAL);
+    if (clist->num == 0) {
+        stats_report(STDERR_FILENO, clist, NULL, start_ns, monotonic_ns());
+        return OK;
     }
     
-    // Handle pipeline
-    int pipes[CMD_MAX-1][2]; // Array of pipe file descriptors
-    pid_t pids[CMD_MAX];     // Array of process IDs
+    if (clist->background) {
+        return jobs_start(clist);
+    }
     
-    // Create pipes
-    for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) < 0) {
-            perror("pipe");
-            return ERR_EXEC_CMD;
+    // Check if it's a single command; exit is handled there even when timed
+    if (clist->num == 1) {
+        const builtin_desc_t *bi = builtin_lookup(clist->commands[0].argv[0], BUILTIN_LOCAL);
+        if (!timed || (bi && !bi->fn)) {
+            return exec_cmd(&clist->commands[0]);
         }
     }
     
-    // Execute commands in the pipeline
+    // Handle pipeline
+    // Scratch array lives in the session arena and goes back with the list
+    pipeline_stage_t *stages = arena_alloc(&current_session()->arena,
+                                           clist->num * sizeof(pipeline_stage_t));
+    if (!stages) {
+        return ERR_MEMORY;
+    }
+    memset(stages, 0, clist->num * sizeof(pipeline_stage_t));
     for (int i = 0; i < clist->num; i++) {
-        // Fork process
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            perror("fork");
-            return ERR_EXEC_CMD;
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Set up input from previous pipe (except for first command)
-            if (i > 0) {
-                if (dup2(pipes[i-1][0], STDIN_FILENO) < 0) {
-                    perror("dup2 input");
-                    exit(EXIT_FAILURE);
-                }
-            } 
-            // Handle input redirection for first command
-            else if (clist->commands[i].input_file) {
-                int fd = open(clist->commands[i].input_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open input file");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd, STDIN_FILENO) < 0) {
-                    perror("dup2 input file");
-                    close(fd);
-                    exit(EXIT_FAILURE);
-                }
-                close(fd);
-            }
-            
-            // Set up output to next pipe (except for last command)
-            if (i < clist->num - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) < 0) {
-                    perror("dup2 output");
-                    exit(EXIT_FAILURE);
-                }
-            } 
-            // Handle output redirection for last command
-            else if (clist->commands[i].output_file) {
-                int flags = O_WRONLY | O_CREAT;
-                if (clist->commands[i].append_output) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
-                }
-                
-                int fd = open(clist->commands[i].output_file, flags, 0644);
-                if (fd < 0) {
-                    perror("open output file");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd, STDOUT_FILENO) < 0) {
-                    perror("dup2 output file");
-                    close(fd);
-                    exit(EXIT_FAILURE);
-                }
-                close(fd);
-            }
-            
-            // Close all pipe file descriptors in the child
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            // Execute command
-            if (execvp(clist->commands[i].argv[0], clist->commands[i].argv) < 0) {
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
-        }
+        stages[i].timed = timed;
     }
+
+    launch_fds_t ends = { -1, -1, -1 };
+    int rc = launch_pipeline(clist, &ends, BUILTIN_LOCAL, stages);
     
-    // Close all pipe file descriptors in the parent
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    // Wait for every stage to finish
+    if (wait_pipeline(stages, clist->num, NULL) != OK) {
+        rc = ERR_EXEC_CMD;
     }
-    
-    // Wait for all child processes to finish
-    for (int i = 0; i < clist->num; i++) {
-        int status;
-        waitpid(pids[i], &status, 0);
-        
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            return ERR_EXEC_CMD;
-        }
+    if (timed) {
+        stats_report(STDERR_FILENO, clist, stages, start_ns, monotonic_ns());
     }
+    TRACE_END(start_ns, "pipeline", clist->num);
     
+    return rc;
+}
+
+/**
+ * Prepares a line reader over a file descriptor
+ *
+ * @param rd The reader to initialize
+ * @param fd Descriptor to read command lines from
+ * @return OK on success, ERR_MEMORY on failure
+ */
+int reader_init(line_reader_t *rd, int fd) {
+    if (!rd) return ERR_MEMORY;
+
+    rd->buf = malloc(LINE_READER_CHUNK);
+    if (!rd->buf) {
+        return ERR_MEMORY;
+    }
+    rd->fd = fd;
+    rd->cap = LINE_READER_CHUNK;
+    rd->start = 0;
+    rd->end = 0;
+    rd->eof = 0;
     return OK;
 }
 
 /**
- * Main execution loop for the shell
+ * Returns the next line from a reader
  *
- * @return OK on successful termination, error code on failure
+ * Input is pulled in LINE_READER_CHUNK sized reads (a terminal still hands
+ * back one line per read). The newline is replaced with '\0' and a pointer
+ * into the reader's buffer is returned, so lines are never copied; it stays
+ * valid until the next call. Lines longer than the buffer grow it.
+ *
+ * @param rd The reader to read from
+ * @return The line, or NULL at end of input or on a read error
  */
-int exec_local_cmd_loop() {
-    char cmd_buff[SH_CMD_MAX];
-    
+char *reader_next_line(line_reader_t *rd) {
+    while (1) {
+        char *base = rd->buf + rd->start;
+        char *nl = memchr(base, '\n', rd->end - rd->start);
+        if (nl) {
+            *nl = '\0';
+            rd->start = (nl - rd->buf) + 1;
+            return base;
+        }
+
+        if (rd->eof) {
+            if (rd->start == rd->end) {
+                return NULL;
+            }
+            // Last line had no newline; read() always leaves room for '\0'
+            rd->buf[rd->end] = '\0';
+            rd->start = rd->end;
+            return base;
+        }
+
+        // Slide the partial line to the front, then make room for more
+        if (rd->start > 0) {
+            memmove(rd->buf, base, rd->end - rd->start);
+            rd->end -= rd->start;
+            rd->start = 0;
+        }
+        if (rd->cap - rd->end < 2) {
+            char *grown = realloc(rd->buf, rd->cap * 2);
+            if (!grown) {
+                return NULL;
+            }
+            rd->buf = grown;
+            rd->cap *= 2;
+        }
+
+        ssize_t n = read(rd->fd, rd->buf + rd->end, rd->cap - rd->end - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rd->eof = 1;
+        } else {
+            rd->end += n;
+        }
+    }
+}
+
+/**
+ * Releases a reader's buffer
+ *
+ * @param rd The reader to destroy
+ */
+void reader_destroy(line_reader_t *rd) {
+    if (!rd) return;
+
+    free(rd->buf);
+    rd->buf = NULL;
+}
+
+/**
+ * Reads, parses and runs command lines until input ends or exit
+ *
+ * @param fd        Descriptor to read command lines from
+ * @param prompt    Print SH_PROMPT before each line
+ * @param fail_fast Stop at the first line that fails to parse or run
+ * @return OK, the failing line's error in fail-fast mode, or ERR_MEMORY
+ */
+static int run_cmd_stream(int fd, bool prompt, bool fail_fast) {
+    line_reader_t reader;
+    dsh_session_t session;
+    int loop_rc = OK;
+    char *cmd_buff;
+
+    // A terminal needs the prompt pushed out before we block in read();
+    // piped input keeps stdout block-buffered
+    bool flush_prompt = prompt && isatty(fd);
+
+    if (reader_init(&reader, fd) != OK) {
+        printf("error: memory allocation failed\n");
+        return ERR_MEMORY;
+    }
+    session_init(&session);
+    dsh_session_t *prev_session = session_enter(&session);
+
     while (1) {
-        printf("%s", SH_PROMPT);
-        if (fgets(cmd_buff, SH_CMD_MAX, stdin) == NULL) {
-            printf("\n");
+        if (prompt) {
+            // Report background jobs that finished since the last prompt
+            jobs_notify();
+            printf("%s", SH_PROMPT);
+            if (flush_prompt) {
+                fflush(stdout);
+            }
+        }
+        if ((cmd_buff = reader_next_line(&reader)) == NULL) {
+            if (prompt) {
+                printf("\n");
+            }
             break;
         }
         
-        // Remove the trailing newline
-        cmd_buff[strcspn(cmd_buff, "\n")] = '\0';
-        
-        // Skip empty commands
-        if (strlen(cmd_buff) == 0) {
+        // Skip empty commands and comment lines
+        char *first = cmd_buff + strspn(cmd_buff, " \t\r");
+        if (*first == '\0' || *first == '#') {
             continue;
         }
         
         // Check for exit command directly
         if (strcmp(cmd_buff, EXIT_CMD) == 0) {
             printf("exiting...\n");
-            return OK;
+            break;
         }
         
-        // Parse and execute command
+        // Parse and execute command; a here-document's body is read from
+        // the lines that follow
         command_list_t cmd_list;
         int rc = build_cmd_list(cmd_buff, &cmd_list);
+        if (rc == OK &&
+            (rc = expand_cmd_list(&cmd_list, BUILTIN_LOCAL, STDERR_FILENO, &reader)) != OK) {
+            free_cmd_list(&cmd_list);
+        }
         
         if (rc == WARN_NO_CMDS) {
             printf(CMD_WARN_NO_CMD);
-            continue;
         } else if (rc == ERR_TOO_MANY_COMMANDS) {
             printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
-            continue;
+        } else if (rc == ERR_CMD_OR_ARGS_TOO_BIG) {
+            printf(CMD_ERR_ARGS_LIMIT, CMD_ARGV_MAX - 1);
+        } else if (rc == ERR_CMD_ARGS_BAD) {
+            printf(CMD_ERR_SYNTAX);
+        } else if (rc == ERR_EXEC_CMD) {
+            printf(CMD_ERR_EXECUTE);
         } else if (rc == ERR_MEMORY) {
             printf("error: memory allocation failed\n");
-            return ERR_MEMORY;
+            loop_rc = ERR_MEMORY;
+            break;
+        }
+        if (rc != OK) {
+            if (fail_fast && rc != WARN_NO_CMDS) {
+                loop_rc = rc;
+                break;
+            }
+            continue;
         }
         
         // Execute the command(s)
         rc = execute_pipeline(&cmd_list);
         
+        // Free command list resources
+        free_cmd_list(&cmd_list);
+
         if (rc == OK_EXIT) {
-            free_cmd_list(&cmd_list);
-            return OK;
+            break;
         } else if (rc == ERR_EXEC_CMD) {
             printf(CMD_ERR_EXECUTE);
+            if (fail_fast) {
+                loop_rc = rc;
+                break;
+            }
         }
-        
-        // Free command list resources
-        free_cmd_list(&cmd_list);
     }
-    
-    return OK;
-}
\ No newline at end of file
+
+    session_enter(prev_session);
+    session_destroy(&session);
+    reader_destroy(&reader);
+    return loop_rc;
+}
+
+/**
+ * Main execution loop for the shell
+ *
+ * Reads commands from stdin, printing SH_PROMPT before each one.
+ *
+ * @return OK on successful termination, error code on failure
+ */
+int exec_local_cmd_loop() {
+    return run_cmd_stream(STDIN_FILENO, true, false);
+}
+
+/**
+ * Runs a script file without prompting
+ *
+ * @param path      Script to run, or "-" for stdin
+ * @param fail_fast Stop at the first command that fails
+ * @return OK, the error that stopped a fail-fast script, or
+ *         ERR_EXEC_CMD if the script cannot be opened
+ */
+int exec_local_script(const char *path, int fail_fast) {
+    int fd = STDIN_FILENO;
+
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return ERR_EXEC_CMD;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    int rc = run_cmd_stream(fd, false, fail_fast);
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return rc;
+}
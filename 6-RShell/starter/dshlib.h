@@ -1,6 +1,12 @@
 #ifndef __DSHLIB_H__
 #define __DSHLIB_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
 //Constants for command structure sizes
 #define EXE_MAX 64
 #define ARG_MAX 256
@@ -8,7 +14,12 @@
 #define CMD_ARGV_MAX (CMD_MAX + 1)
 
 // Longest command that can be read from the shell
-#define SH_CMD_MAX EXE_MAX + ARG_MAX
+#define SH_CMD_MAX (EXE_MAX + ARG_MAX)
+
+// CMD_MAX, CMD_ARGV_MAX and SH_CMD_MAX are the initial capacities that
+// build_cmd_list reserves per line; pipelines, argv vectors and lines
+// larger than that grow geometrically inside the session arena. Only the
+// single-command build_cmd_buff path still enforces them as limits.
 
 typedef struct command
 {
@@ -19,23 +30,83 @@ typedef struct command
 typedef struct cmd_buff
 {
     int  argc;
-    char *argv[CMD_ARGV_MAX];
+    char **argv;         // NULL terminated, _argv_cap slots
+    int  _argv_cap;
     char *_cmd_buffer;
-    char *input_file;    // For < redirection
+    char *input_file;    // For < redirection; the word or delimiter for <<< and <<
+    int input_kind;      // INPUT_FILE, INPUT_HERESTRING or INPUT_HEREDOC
+    int input_fd;        // memfd with the <<< or << data once expanded, else -1
     char *output_file;   // For > redirection
     int append_output;   // For >> redirection (1 = append, 0 = overwrite)
 } cmd_buff_t;
 
+typedef struct cmd_template cmd_template_t;
+
 typedef struct command_list {
     int num;
-    cmd_buff_t commands[CMD_MAX];
+    cmd_buff_t *commands;   // _cap slots carved from the session arena
+    int _cap;
+    char *_line;         // Single tokenized copy of the line, argv points here
+    size_t _mark;        // Arena offset to roll back to in free_cmd_list
+    cmd_template_t *_tmpl;   // cached parse argv is borrowed from, or NULL
+    int background;      // Line ended with '&'
+    int expand;          // Line has $(...), <<< or <<; see expand_cmd_list
+    uint64_t parse_ns;   // time build_cmd_list took
 } command_list_t;
 
+// Bump allocator that command lines are carved from; reset per line
+#define CMD_ARENA_SZ 4096
+
+typedef struct arena_chunk {
+    struct arena_chunk *prev;   // chunk that filled up before this one
+    size_t size;
+} arena_chunk_t;
+
+typedef struct cmd_arena {
+    char *base;                 // current chunk, reused across lines
+    size_t size;
+    size_t used;
+    size_t retired;             // bytes held by outgrown chunks
+    arena_chunk_t *chunks;      // outgrown chunks, freed on the next reset
+    unsigned long heap_allocs;   // malloc calls made on behalf of the arena
+    unsigned long lines;         // command lines served since creation
+} cmd_arena_t;
+
+// State owned by one interactive session or one remote client
+typedef struct dsh_session {
+    cmd_arena_t arena;
+    int pipe_size;       // capacity of new pipes, 0 for the kernel default
+    int stats;           // report every pipeline as if prefixed with time
+    int pipefail;        // a pipeline fails if any stage does (default on)
+    int parse_cache;     // look lines up in the parsed command cache (default on)
+} dsh_session_t;
+
 //Special character #defines
 #define SPACE_CHAR  ' '
 #define PIPE_CHAR   '|'
 #define PIPE_STRING "|"
+#define BG_CHAR     '&'
+#define REDIR_IN_CHAR   '<'
+#define REDIR_OUT_CHAR  '>'
+
+// What cmd_buff_t.input_file names
+#define INPUT_FILE       0
+#define INPUT_HERESTRING 1      // cmd <<< word
+#define INPUT_HEREDOC    2      // cmd << DELIM, body on the lines that follow
+
+// tokenize_stage keeps the text of each $(...) between these for
+// expand_cmd_list; the quoted form was inside double quotes
+#define SUBST_OPEN        '\001'
+#define SUBST_OPEN_QUOTED '\002'
+#define SUBST_CLOSE       '\003'
+
+// ... and swaps unquoted wildcards in command words for these
+#define GLOB_ANY          '\004'   // *
+#define GLOB_ONE          '\005'   // ?
+#define GLOB_CLASS        '\006'   // [
 #define SH_PROMPT "dsh4> "
+// Set (non-empty) to keep prompting when stdin is not a terminal
+#define SH_PROMPT_ENV "DSH_PROMPT"
 #define EXIT_CMD "exit"
 #define EXIT_SC     99
 
@@ -58,22 +129,202 @@ int close_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
 int free_cmd_list(command_list_t *cmd_lst);
 
+//session and arena management
+int session_init(dsh_session_t *session);
+void session_destroy(dsh_session_t *session);
+void session_trim(dsh_session_t *session);
+dsh_session_t *session_enter(dsh_session_t *session);
+dsh_session_t *current_session(void);
+void *arena_alloc(cmd_arena_t *arena, size_t size);
+size_t arena_mark(cmd_arena_t *arena);
+void arena_release(cmd_arena_t *arena, size_t mark);
+
 //built in command stuff
 typedef enum {
     BI_CMD_EXIT,
     BI_CMD_DRAGON,
     BI_CMD_CD,
+    BI_CMD_MEMSTAT,
+    BI_CMD_HASH,
+    BI_CMD_ECHO,
+    BI_CMD_PWD,
+    BI_CMD_TRUE,
+    BI_CMD_FALSE,
+    BI_CMD_PRINTF,
+    BI_CMD_JOBS,
+    BI_CMD_WAIT,
+    BI_CMD_FG,
+    BI_CMD_PARALLEL,
+    BI_CMD_CAT,
+    BI_CMD_SET,
+    BI_CMD_TIME,
+    BI_CMD_TRACE,
+    BI_CMD_PARSECACHE,
     BI_NOT_BI,
     BI_EXECUTED,
     BI_CMD_STOP_SVR,
     BI_NOT_IMPLEMENTED
 } Built_In_Cmds;
 
+// Where a built-in may run; see builtins.def
+#define BUILTIN_LOCAL     0x1
+#define BUILTIN_REMOTE    0x2
+#define BUILTIN_PIPELINE  0x4
+#define BUILTIN_BOUNDED   0x8
+
+// Handlers use the descriptors they are given and return an exit status
+typedef int (*builtin_fn)(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+typedef struct builtin_desc {
+    const char *name;
+    Built_In_Cmds id;
+    builtin_fn fn;       // NULL for exit and stop-server
+    unsigned flags;
+} builtin_desc_t;
+
+// FNV-1a offset basis; tools/gen_builtin_hash searches seeds upward from it
+#define BUILTIN_HASH_BASIS 2166136261u
+
+// Seeded FNV-1a shared by builtin_lookup and its build-time generator
+static inline uint32_t builtin_name_hash(uint32_t seed, const char *name) {
+    uint32_t h = seed;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+const builtin_desc_t *builtin_lookup(const char *name, unsigned scope);
 Built_In_Cmds match_command(const char *input); 
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 
+//buffered line input for the command loops
+#define LINE_READER_CHUNK (64 * 1024)
+
+typedef struct line_reader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;        // first byte not yet returned
+    size_t end;          // one past the last byte read
+    int eof;
+} line_reader_t;
+
+int reader_init(line_reader_t *rd, int fd);
+char *reader_next_line(line_reader_t *rd);
+void reader_destroy(line_reader_t *rd);
+
+//executable lookup cache (dsh_path.c)
+int path_lookup(const char *name, char *out, size_t outsz);
+void path_cache_clear(void);
+int path_cache_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+//parsed command cache (dsh_cmdcache.c)
+int cmd_cache_lookup(const char *line, command_list_t *clist);
+void cmd_cache_store(const char *line, const command_list_t *clist);
+void cmd_cache_release(cmd_template_t *t);
+void cmd_cache_clear(void);
+int cmd_cache_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+//process launcher (dsh_launch.c)
+typedef struct launch_fds {
+    int in;              // -1 keeps the shell's own descriptor
+    int out;
+    int err;
+} launch_fds_t;
+
+// Runs a registry entry in-process with cmd's redirections applied
+int run_builtin(const builtin_desc_t *bi, cmd_buff_t *cmd, const launch_fds_t *fds);
+
+// One running pipeline stage: a spawned process or a built-in on a thread
+typedef struct pipeline_stage pipeline_stage_t;
+
+struct pipeline_stage {
+    pid_t pid;           // -1 unless the stage is a process
+    pthread_t thread;
+    int threaded;
+    int status;          // exit status of a stage that is not a process
+    const builtin_desc_t *builtin;
+    cmd_buff_t *cmd;
+    launch_fds_t fds;
+    int own_in;          // the thread closes fds.in / fds.out when done
+    int own_out;
+    int timed;           // set by the caller: measure built-in stages too
+    int async;           // set by the caller: a lone pipeline built-in runs
+                         // on a thread instead of inline
+    int detached;        // set by the caller: nothing runs inline, not even
+                         // a lone built-in that is not pipeline-safe
+    int own_cwd;         // set by the caller: a built-in thread unshares its
+    int cwd_fd;          // working directory and moves to cwd_fd first
+    void (*on_done)(pipeline_stage_t *st);  // set by the caller, may be NULL
+    void *done_arg;
+    uint64_t start_ns;   // CLOCK_MONOTONIC when the stage was started
+    uint64_t spawn_ns;   // ... when posix_spawn returned, 0 for a built-in
+    uint64_t end_ns;     // ... when it was reaped or its thread returned
+    struct rusage usage; // the process's, or the built-in thread's share
+};
+
+int launch_cmd(cmd_buff_t *cmd, const launch_fds_t *fds, pid_t *pid);
+int launch_pipeline(command_list_t *clist, const launch_fds_t *ends,
+                    unsigned scope, pipeline_stage_t *stages);
+int wait_pipeline(pipeline_stage_t *stages, int num, int *last_status);
+int pipeline_status(const pipeline_stage_t *stages, int num, int pipefail);
+void reap_stage(pipeline_stage_t *st);
+
+//zygote launcher (dsh_zygote.c)
+int zygote_start(void);
+void zygote_stop(void);
+int zygote_active(void);
+int zygote_reinit(void);
+int zygote_spawn(const char *path, int resolved, char **argv, const int fds[3], pid_t *pid);
+
+//background jobs (dsh_jobs.c)
+int jobs_start(command_list_t *clist);
+void jobs_notify(void);
+void jobs_detach(dsh_session_t *session);
+int jobs_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+int jobs_wait_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+int jobs_fg_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+//parallel built-in (dsh_parallel.c)
+int parallel_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+//here-strings, here-documents and command substitution (dsh_expand.c)
+int expand_cmd_list(command_list_t *clist, unsigned scope, int err_fd, line_reader_t *rd);
+int cmd_list_substitutes(const command_list_t *clist);
+
+//pathname expansion (dsh_glob.c)
+int glob_word(const char *word, int (*emit)(void *arg, const char *path), void *arg);
+void glob_unmark(char *word);
+
+//zero-copy file I/O (dsh_copy.c)
+int fd_copy(int in_fd, int out_fd);
+int cat_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
+//timing and resource accounting (dsh_stats.c)
+uint64_t monotonic_ns(void);
+int stats_begin(command_list_t *clist, unsigned scope);
+void stats_report(int fd, command_list_t *clist, pipeline_stage_t *stages,
+                  uint64_t start_ns, uint64_t end_ns);
+
+//event tracing (dsh_trace.c); trace points compile away unless built
+//with make TRACE=1
+#ifdef DSH_TRACE
+void trace_init(void);
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns, long arg);
+int trace_dump(const char *path);
+#define TRACE_BEGIN(var)           uint64_t var = monotonic_ns()
+#define TRACE_END(var, name, arg)  trace_event((name), (var), monotonic_ns(), (arg))
+#else
+#define TRACE_BEGIN(var)           ((void)0)
+#define TRACE_END(var, name, arg)  ((void)0)
+#endif
+int trace_builtin(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+
 //main execution context
 int exec_local_cmd_loop();
+int exec_local_script(const char *path, int fail_fast);
 int exec_cmd(cmd_buff_t *cmd);
 int execute_pipeline(command_list_t *clist);
 
@@ -82,5 +333,8 @@ int execute_pipeline(command_list_t *clist);
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
 #define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
 #define CMD_ERR_EXECUTE     "error: command execution failed\n"
+#define CMD_ERR_ARGS_LIMIT  "error: commands limited to %d arguments\n"
+#define MEMSTAT_FMT         "arena: %lu lines, %lu heap allocations, %zu bytes reserved\n"
+#define CMD_ERR_SYNTAX      "error: syntax error in command line\n"
 
 #endif
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,17 +12,166 @@
 #include "dshlib.h"
 #include "rshlib.h"
 
+/*
+ * negotiate(cli_socket, reader, rsp_buff)
+ *
+ * Offers the framed protocol. Returns the server's protocol version if it
+ * answered with a HELLO, 0 if it is a legacy server (its reply to the
+ * HELLO, which it ran as a command, is discarded) or a negative error.
+ */
+static int negotiate(int cli_socket, rdsh_reader_t *reader, char *rsp_buff) {
+    rdsh_frame_t frame;
+    char first;
+
+    if (rdsh_send_hello(cli_socket) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (recv(cli_socket, &first, 1, MSG_PEEK) != 1) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (first == RDSH_FRAME_HELLO) {
+        int version;
+        if (rdsh_read_frame(reader, &frame) != 1 || (version = rdsh_check_hello(&frame)) < 1) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        return version;
+    }
+
+    int n;
+    do {
+        if ((n = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ, 0)) <= 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+    } while (rsp_buff[n - 1] != RDSH_EOF_CHAR);
+    return 0;
+}
+
+/*
+ * reply_frame(frame, status)
+ *
+ * Writes a reply's DATA frame to stdout or stderr. Returns 1 with the
+ * status for its EXIT frame, 0 for DATA, or ERR_RDSH_COMMUNICATION.
+ */
+static int reply_frame(const rdsh_frame_t *frame, int *status) {
+    if (frame->type == RDSH_FRAME_EXIT && frame->len == sizeof(uint32_t)) {
+        uint32_t be_status;
+        memcpy(&be_status, frame->payload, sizeof(be_status));
+        *status = (int)ntohl(be_status);
+        return 1;
+    }
+    if (frame->type != RDSH_FRAME_DATA) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (frame->channel == RDSH_CH_STDERR) {
+        // Keep the order the server produced them in
+        fflush(stdout);
+        fwrite(frame->payload, 1, frame->len, stderr);
+    } else {
+        fwrite(frame->payload, 1, frame->len, stdout);
+    }
+    return 0;
+}
+
+/*
+ * framed_request(cli_socket, reader, cmd, status)
+ *
+ * Sends one command as a CMD frame and writes its reply until the EXIT
+ * frame. Returns OK, OK_EXIT if the server closed the connection, or
+ * ERR_RDSH_COMMUNICATION.
+ */
+static int framed_request(int cli_socket, rdsh_reader_t *reader, const char *cmd, int *status) {
+    rdsh_frame_t frame;
+
+    if (rdsh_send_frame(cli_socket, RDSH_FRAME_CMD, 0, 0, cmd, strlen(cmd)) != OK) {
+        printf("Error: Failed to send command to server\n");
+        return ERR_RDSH_COMMUNICATION;
+    }
+    while (1) {
+        int n = rdsh_read_frame(reader, &frame);
+        if (n == 0) {
+            return OK_EXIT;
+        }
+        if (n > 0) {
+            n = reply_frame(&frame, status);
+        }
+        if (n < 0) {
+            printf("Error: Failed to receive response from server\n");
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (n == 1) {
+            return OK;
+        }
+    }
+}
+
+/*
+ * legacy_request(cli_socket, cmd, req_buff, rsp_buff)
+ *
+ * Sends one command to a legacy server and prints its reply up to the EOF
+ * byte. Returns OK, OK_EXIT if the server closed the connection, or
+ * ERR_RDSH_COMMUNICATION.
+ */
+static int legacy_request(int cli_socket, const char *cmd, char *req_buff, char *rsp_buff) {
+    // Copy command to request buffer
+    strncpy(req_buff, cmd, RDSH_COMM_BUFF_SZ - 1);
+    req_buff[RDSH_COMM_BUFF_SZ - 1] = '\0';
+
+    // Send command to server (include null terminator)
+    int send_len = strlen(req_buff) + 1;
+    int bytes_sent = send(cli_socket, req_buff, send_len, 0);
+    
+    if (bytes_sent <= 0) {
+        printf("Error: Failed to send command to server\n");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    // Receive response from server
+    int is_last_chunk = 0;
+    while (!is_last_chunk) {
+        int recv_size = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ - 1, 0);
+        
+        if (recv_size < 0) {
+            printf("Error: Failed to receive response from server\n");
+            return ERR_RDSH_COMMUNICATION;
+        } else if (recv_size == 0) {
+            return OK_EXIT;
+        }
+
+        // Check if this is the last chunk (ends with EOF character)
+        is_last_chunk = (rsp_buff[recv_size - 1] == RDSH_EOF_CHAR) ? 1 : 0;
+        
+        if (is_last_chunk) {
+            // Replace EOF with null for proper string handling
+            rsp_buff[recv_size - 1] = '\0';
+            recv_size--;
+        } else {
+            // Ensure null termination for printing
+            rsp_buff[recv_size] = '\0';
+        }
+
+        // Print the response
+        if (recv_size > 0) {
+            printf("%.*s", recv_size, rsp_buff);
+        }
+    }
+    return OK;
+}
+
 /*
  * exec_remote_cmd_loop(server_ip, port)
  *
- * Main function to execute remote commands via the network
+ * Main function to execute remote commands via the network. The client
+ * offers the framed protocol first and falls back to the legacy one.
  */
 int exec_remote_cmd_loop(char *address, int port)
 {
     char *request_buff = NULL;
     char *response_buff = NULL;
     int cli_socket = -1;
-    char cmd_buff[SH_CMD_MAX];
+    char *cmd_buff = NULL;      // grown by getline, reused for every line
+    size_t cmd_cap = 0;
+    rdsh_reader_t reader;
+    int framed;
 
     // Allocate buffers for sending commands and receiving responses
     request_buff = malloc(RDSH_COMM_BUFF_SZ);
@@ -35,12 +186,21 @@ int exec_remote_cmd_loop(char *address, int port)
     if (cli_socket < 0) {
         return client_cleanup(cli_socket, request_buff, response_buff, ERR_RDSH_CLIENT);
     }
+    if (rdsh_reader_init(&reader, cli_socket) != OK) {
+        return client_cleanup(cli_socket, request_buff, response_buff, ERR_MEMORY);
+    }
+    framed = negotiate(cli_socket, &reader, response_buff);
+    if (framed < 0) {
+        printf("Error: Failed to receive response from server\n");
+        rdsh_reader_free(&reader);
+        return client_cleanup(cli_socket, request_buff, response_buff, ERR_RDSH_COMMUNICATION);
+    }
 
     // Main command loop
     while (1) {
         // Display prompt and get user input
         printf("%s", SH_PROMPT);
-        if (fgets(cmd_buff, SH_CMD_MAX, stdin) == NULL) {
+        if (getline(&cmd_buff, &cmd_cap, stdin) < 0) {
             printf("\n");
             break;
         }
@@ -53,57 +213,243 @@ int exec_remote_cmd_loop(char *address, int port)
             continue;
         }
 
-        // Copy command to request buffer
-        strncpy(request_buff, cmd_buff, RDSH_COMM_BUFF_SZ - 1);
-        request_buff[RDSH_COMM_BUFF_SZ - 1] = '\0';
+        int status = 0;
+        int rc = framed ? framed_request(cli_socket, &reader, cmd_buff, &status)
+                        : legacy_request(cli_socket, cmd_buff, request_buff, response_buff);
+        if (rc == OK_EXIT) {
+            printf("Server connection closed\n");
+            break;
+        }
+        if (rc != OK) {
+            free(cmd_buff);
+            rdsh_reader_free(&reader);
+            return client_cleanup(cli_socket, request_buff, response_buff, rc);
+        }
 
-        // Send command to server (include null terminator)
-        int send_len = strlen(request_buff) + 1;
-        int bytes_sent = send(cli_socket, request_buff, send_len, 0);
-        
-        if (bytes_sent <= 0) {
-            printf("Error: Failed to send command to server\n");
-            return client_cleanup(cli_socket, request_buff, response_buff, ERR_RDSH_COMMUNICATION);
-        }
-
-        // Receive response from server
-        int is_last_chunk = 0;
-        while (!is_last_chunk) {
-            int recv_size = recv(cli_socket, response_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-            
-            if (recv_size < 0) {
-                printf("Error: Failed to receive response from server\n");
-                return client_cleanup(cli_socket, request_buff, response_buff, ERR_RDSH_COMMUNICATION);
-            } else if (recv_size == 0) {
-                printf("Server connection closed\n");
-                return client_cleanup(cli_socket, request_buff, response_buff, OK);
-            }
+        // If the command was exit, break out of the loop
+        if (strcmp(cmd_buff, EXIT_CMD) == 0) {
+            break;
+        }
+    }
 
-            // Check if this is the last chunk (ends with EOF character)
-            is_last_chunk = (response_buff[recv_size - 1] == RDSH_EOF_CHAR) ? 1 : 0;
-            
-            if (is_last_chunk) {
-                // Replace EOF with null for proper string handling
-                response_buff[recv_size - 1] = '\0';
-                recv_size--;
-            } else {
-                // Ensure null termination for printing
-                response_buff[recv_size] = '\0';
+    free(cmd_buff);
+    rdsh_reader_free(&reader);
+    return client_cleanup(cli_socket, request_buff, response_buff, OK);
+}
+
+// A script being pipelined to the server
+typedef struct script_run {
+    FILE *in;
+    char *line;              // grown by getline, reused for every line
+    size_t line_cap;
+    int eof;                 // nothing more to send
+    char *out;               // CMD frames not yet sent
+    size_t out_len;
+    size_t out_off;
+    uint16_t next_tag;       // tag of the next command sent
+    uint16_t reply_tag;      // tag of the oldest command still unanswered
+    int inflight;
+    int window;              // most commands sent ahead of their replies
+} script_run_t;
+
+/*
+ * script_line(sr)
+ *
+ * The script's next command, skipping blank and comment lines as local
+ * scripts do; NULL at its end or at an exit line
+ */
+static char *script_line(script_run_t *sr) {
+    while (!sr->eof) {
+        if (getline(&sr->line, &sr->line_cap, sr->in) < 0) {
+            sr->eof = 1;
+            break;
+        }
+        sr->line[strcspn(sr->line, "\n")] = '\0';
+        char *first = sr->line + strspn(sr->line, " \t\r");
+        if (*first == '\0' || *first == '#') {
+            continue;
+        }
+        if (strcmp(sr->line, EXIT_CMD) == 0) {
+            sr->eof = 1;
+            break;
+        }
+        return sr->line;
+    }
+    return NULL;
+}
+
+/*
+ * script_queue(sr)
+ *
+ * Packs CMD frames for the script's next lines until the window is full
+ * or a frame's worth of them is waiting to be sent
+ */
+static int script_queue(script_run_t *sr) {
+    char *line;
+
+    while (sr->inflight < sr->window && sr->out_len - sr->out_off < RDSH_FRAME_DATA_MAX &&
+           (line = script_line(sr)) != NULL) {
+        size_t len = strlen(line);
+        if (sr->out_off > 0) {
+            memmove(sr->out, sr->out + sr->out_off, sr->out_len - sr->out_off);
+            sr->out_len -= sr->out_off;
+            sr->out_off = 0;
+        }
+        char *out = realloc(sr->out, sr->out_len + RDSH_FRAME_HDR_SZ + len);
+        if (!out) {
+            return ERR_MEMORY;
+        }
+        sr->out = out;
+        rdsh_pack_hdr(sr->out + sr->out_len, RDSH_FRAME_CMD, 0, sr->next_tag++, len);
+        memcpy(sr->out + sr->out_len + RDSH_FRAME_HDR_SZ, line, len);
+        sr->out_len += RDSH_FRAME_HDR_SZ + len;
+        sr->inflight++;
+    }
+    return OK;
+}
+
+/*
+ * script_replies(sr, reader, fail_fast)
+ *
+ * Writes out every reply frame received so far. Returns OK, or
+ * ERR_EXEC_CMD once a command fails with fail_fast, or
+ * ERR_RDSH_COMMUNICATION.
+ */
+static int script_replies(script_run_t *sr, rdsh_reader_t *reader, int fail_fast) {
+    rdsh_frame_t frame;
+    int rc = OK;
+    int n;
+
+    while ((n = rdsh_next_frame(reader, &frame)) == 1) {
+        int status = 0;
+
+        // Replies come in the order the commands went out
+        if (sr->inflight == 0 || frame.tag != sr->reply_tag) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        n = reply_frame(&frame, &status);
+        if (n < 0) {
+            return n;
+        }
+        if (n == 1) {
+            sr->reply_tag++;
+            sr->inflight--;
+            if (status != 0 && fail_fast) {
+                sr->eof = 1;
+                rc = ERR_EXEC_CMD;
             }
+        }
+    }
+    return (n < 0) ? n : rc;
+}
+
+/*
+ * exec_remote_script(address, port, path, fail_fast)
+ *
+ * Runs a script ("-" for stdin) on the server without prompting. Commands
+ * go out as fast as the connection takes them, up to RDSH_PIPELINE_WINDOW
+ * ahead of their replies, so a script costs about one round trip plus its
+ * transfer time rather than a round trip per line. The server runs them
+ * in order and tags each reply with its command's tag, which is checked
+ * as the replies are written out. With fail_fast commands go one at a
+ * time, since any sent ahead would already have run; a legacy server also
+ * gets them one at a time.
+ *
+ * Returns OK, or the error that stopped the script.
+ */
+int exec_remote_script(char *address, int port, const char *path, int fail_fast) {
+    script_run_t sr = { .in = stdin, .window = fail_fast ? 1 : RDSH_PIPELINE_WINDOW };
+    rdsh_reader_t reader = { .buf = NULL };
+    char *req_buff = malloc(RDSH_COMM_BUFF_SZ);
+    char *rsp_buff = malloc(RDSH_COMM_BUFF_SZ);
+    int cli_socket = -1;
+    int rc = OK;
 
-            // Print the response
-            if (recv_size > 0) {
-                printf("%.*s", recv_size, response_buff);
+    if (strcmp(path, "-") != 0 && (sr.in = fopen(path, "re")) == NULL) {
+        perror(path);
+        return client_cleanup(cli_socket, req_buff, rsp_buff, ERR_EXEC_CMD);
+    }
+    if (!req_buff || !rsp_buff) {
+        rc = ERR_MEMORY;
+        goto out;
+    }
+    if ((cli_socket = start_client(address, port)) < 0) {
+        rc = ERR_RDSH_CLIENT;
+        goto out;
+    }
+    if ((rc = rdsh_reader_init(&reader, cli_socket)) != OK) {
+        goto out;
+    }
+    int version = negotiate(cli_socket, &reader, rsp_buff);
+    if (version < 0) {
+        rc = version;
+        goto out;
+    }
+    if (version < 2) {
+        // No tags to match replies by; one command at a time
+        char *line;
+        int status = 0;
+        while (rc == OK && (line = script_line(&sr)) != NULL) {
+            rc = version ? framed_request(cli_socket, &reader, line, &status)
+                         : legacy_request(cli_socket, line, req_buff, rsp_buff);
+            if (rc == OK && status != 0 && fail_fast) {
+                rc = ERR_EXEC_CMD;
             }
         }
+        goto out;
+    }
 
-        // If the command was exit, break out of the loop
-        if (strcmp(cmd_buff, EXIT_CMD) == 0) {
+    while (rc == OK) {
+        if ((rc = script_queue(&sr)) != OK) {
+            break;
+        }
+        int sending = (sr.out_off < sr.out_len);
+        if (!sending && sr.inflight == 0) {
             break;
         }
+
+        struct pollfd pfd = { .fd = cli_socket, .events = POLLIN | (sending ? POLLOUT : 0) };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR) {
+                rc = ERR_RDSH_COMMUNICATION;
+            }
+            continue;
+        }
+        if (sending && (pfd.revents & POLLOUT)) {
+            ssize_t n = send(cli_socket, sr.out + sr.out_off, sr.out_len - sr.out_off,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                rc = ERR_RDSH_COMMUNICATION;
+                break;
+            }
+            if (n > 0 && (sr.out_off += n) == sr.out_len) {
+                sr.out_off = sr.out_len = 0;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            int n = rdsh_reader_fill(&reader);
+            if (n == 0) {
+                // The server hung up, e.g. after stop-server, with
+                // commands still unanswered
+                rc = ERR_RDSH_COMMUNICATION;
+                break;
+            }
+            rc = (n < 0) ? n : script_replies(&sr, &reader, fail_fast);
+        }
+    }
+    if (rc == ERR_RDSH_COMMUNICATION) {
+        fprintf(stderr, "Error: Failed to receive response from server\n");
     }
 
-    return client_cleanup(cli_socket, request_buff, response_buff, OK);
+out:
+    fflush(stdout);
+    if (sr.in != stdin) {
+        fclose(sr.in);
+    }
+    free(sr.line);
+    free(sr.out);
+    rdsh_reader_free(&reader);
+    return client_cleanup(cli_socket, req_buff, rsp_buff, rc);
 }
 
 /*
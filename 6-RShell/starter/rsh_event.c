@@ -0,0 +1,1366 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Event-driven server
+ *
+ * One thread serves every client from an epoll loop, so a connection costs
+ * a socket and a small rsh_conn_t instead of a thread and its stack. All
+ * descriptors the loop waits on are non-blocking. Each connection is a
+ * small state machine:
+ *
+ *   CONN_IDLE     waiting for the next command; the only state that reads
+ *   CONN_RUNNING  a command is in flight and its output is being relayed
+ *
+ * A command's stages write to a relay pipe instead of the socket. The loop
+ * moves the pipe's contents to the socket with splice and pauses the pipe
+ * while the socket is full, so a slow client stalls only its own command.
+ * Replies the loop makes itself (errors, time reports and the EOF byte) are
+ * queued on the connection and sent after the relayed output. Process
+ * stages are watched through pidfds; threads running built-in stages report
+ * on a pipe the loop reads. Once every stage is collected the loop closes
+ * its end of the relay pipe, and the pipe's EOF ends the command.
+ *
+ * Parsing and spawning happen on the loop. A line with a $(...) is
+ * expanded on a thread of its own, which moves into the connection's
+ * directory, enters its session and reports on the same pipe as built-in
+ * stages; the loop then starts the expanded line, so a slow substitution
+ * holds only its own client. Commands read /dev/null, not the socket: the
+ * socket carries further commands. Lines
+ * are terminated by '\0' as the client sends them, or by a newline ending
+ * the data received so far. A connection is read again only after its
+ * reply is out, which throttles a client that sends faster than it reads.
+ *
+ * The working directory is per process. Each connection keeps a descriptor
+ * for its directory once it has used cd, and the loop moves into it only
+ * while it starts that connection's command; built-in threads move into
+ * it on their own. A connection keeps its session arena between commands,
+ * so a busy client parses without touching the heap; once it has been
+ * idle for IDLE_TRIM_MS the arena is trimmed, so a thousand idle clients
+ * cost a thousand sockets and little else. Connections wait for that on a
+ * queue in the order they went idle, and the loop trims from its head.
+ * The loop raises the soft descriptor limit to the hard one at startup.
+ *
+ * A client that opens with a HELLO frame gets framed replies (see
+ * rsh_frame.c): its commands arrive as CMD frames, and stdout and stderr
+ * get a relay pipe each. Their output is read into DATA frames queued on
+ * the connection, not spliced, since each chunk needs a header in front;
+ * the pipes pause while queued frames wait for the socket. Once both pipes
+ * are drained the loop queues an EXIT frame with the pipeline's status.
+ *
+ * stop-server stops accepting and closes every idle connection; clients
+ * with a command in flight get its reply first.
+ */
+
+#define EV_BATCH          256       // epoll events taken per wait
+#define RELAY_CHUNK       65536     // most bytes moved per splice
+#define CONN_LINE_MAX     65536     // longest command line accepted
+#define POLL_MS           10        // recheck interval for unwatched stages
+#define IDLE_TRIM_MS      1000      // idle time before a session arena is trimmed
+
+enum { EV_LISTEN, EV_CLIENT, EV_RELAY, EV_CHILD, EV_DONE, EV_EXPAND, EV_FREED };
+enum { CONN_IDLE, CONN_RUNNING };
+
+typedef struct rsh_conn rsh_conn_t;
+
+// What an epoll event refers to
+typedef struct ev_src {
+    int kind;
+    int fd;
+    rsh_conn_t *conn;
+    int stage;                  // EV_CHILD: index into the command's stages
+} ev_src_t;
+
+// A command in flight, carved from the connection's session arena
+typedef struct rsh_cmd {
+    command_list_t clist;
+    pipeline_stage_t *stages;
+    ev_src_t *watch;            // per stage: its pidfd, or its thread's report
+    int pending;                // stages not yet collected
+    int unwatched;              // process stages without a pidfd
+    int relay_w;                // every stage's stdout, and stderr unless framed
+    int err_w;                  // every stage's stderr
+    int failed;                 // did not start; the status is 1
+    int timed;
+    int cd;                     // a lone cd; the loop remembers where it went
+    int dir_fd;                 // directory the command runs in
+    int expanding;              // expander has not reported yet
+    int expand_rc;              // expander's result
+    pthread_t expander;
+    ev_src_t expanded;          // what expander reports on the done pipe
+    uint64_t start_ns;
+    uint64_t end_ns;            // when the last stage was collected
+} rsh_cmd_t;
+
+struct rsh_conn {
+    ev_src_t sock;
+    ev_src_t relay;             // read end of the relay pipe, fd -1 if none
+    ev_src_t relay_err;         // framed: read end of the stderr pipe
+    int state;
+    int negotiated;             // the first byte has chosen the protocol
+    int framed;
+    uint16_t tag;               // framed: the running command's
+    unsigned events;            // what sock is registered for
+    unsigned relay_events;
+    unsigned relay_err_events;
+    int relay_blocked;          // socket full; relay waits for EPOLLOUT
+    int closing;                // close once the reply is out
+    int dead;                   // the client is gone; discard output
+    int cwd_fd;                 // directory after a cd, -1 for the server's
+    char *in;                   // unconsumed input, NULL when empty
+    size_t in_len;
+    char *out;                  // queued reply bytes, NULL when empty
+    size_t out_len;
+    size_t out_off;
+    rsh_cmd_t *cmd;
+    rsh_conn_t *prev;
+    rsh_conn_t *next;
+    uint64_t idle_ns;           // when it went idle holding its arena, 0 if not queued
+    rsh_conn_t *idle_prev;      // trim queue, oldest first
+    rsh_conn_t *idle_next;
+    dsh_session_t session;
+};
+
+typedef struct rsh_loop {
+    int epfd;
+    ev_src_t listen;
+    ev_src_t done;              // read end of the built-in threads' pipe
+    int listening;
+    int root_fd;                // directory every client starts in
+    int null_fd;
+    int stopping;
+    int nconns;
+    int unwatched;              // stages to poll for, across connections
+    rsh_conn_t *conns;
+    rsh_conn_t *idle_head;      // trim queue: idle connections holding an arena
+    rsh_conn_t *idle_tail;
+    rsh_conn_t *freed;          // closed this round, freed after the batch
+    char *buf;                  // shared receive buffer
+} rsh_loop_t;
+
+// Write end of the pipe built-in stage threads report on
+static int done_w = -1;
+
+/*
+ * set_watch(loop, src, op, events)
+ *
+ * Adds, changes or removes an epoll registration
+ */
+static int set_watch(rsh_loop_t *loop, ev_src_t *src, int op, unsigned events) {
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+
+    return epoll_ctl(loop->epfd, op, src->fd, &ev);
+}
+
+/*
+ * queue_out(c, data, len)
+ *
+ * Queues reply bytes the loop made itself, to follow any relayed output
+ */
+static void queue_out(rsh_conn_t *c, const char *data, size_t len) {
+    if (c->dead) {
+        return;
+    }
+    char *out = realloc(c->out, c->out_len + len);
+    if (!out) {
+        c->dead = 1;
+        return;
+    }
+    memcpy(out + c->out_len, data, len);
+    c->out = out;
+    c->out_len += len;
+}
+
+/*
+ * queue_frame(c, type, channel, data, len)
+ *
+ * Queues one frame for a framed client
+ */
+static void queue_frame(rsh_conn_t *c, int type, int channel, const char *data, size_t len) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+
+    rdsh_pack_hdr(hdr, type, channel, c->tag, len);
+    queue_out(c, hdr, sizeof(hdr));
+    queue_out(c, data, len);
+}
+
+/*
+ * queue_end(c, status)
+ *
+ * Queues the end of a reply: the EOF byte, or the EXIT frame
+ */
+static void queue_end(rsh_conn_t *c, int status) {
+    if (c->framed) {
+        uint32_t be_status = htonl((uint32_t)status);
+        queue_frame(c, RDSH_FRAME_EXIT, 0, (char *)&be_status, sizeof(be_status));
+    } else {
+        queue_out(c, &RDSH_EOF_CHAR, 1);
+    }
+}
+
+/*
+ * queue_message(c, msg, status)
+ *
+ * Queues a complete reply the loop makes itself. A framed client gets msg
+ * on stderr if status is nonzero, and the status.
+ */
+static void queue_message(rsh_conn_t *c, const char *msg, int status) {
+    if (c->framed) {
+        queue_frame(c, RDSH_FRAME_DATA, status ? RDSH_CH_STDERR : RDSH_CH_STDOUT,
+                    msg, strlen(msg));
+    } else {
+        queue_out(c, msg, strlen(msg));
+    }
+    queue_end(c, status);
+}
+
+/*
+ * sync_relay(loop, src, events, blocked)
+ *
+ * Registers a relay pipe for input unless the socket is full
+ */
+static void sync_relay(rsh_loop_t *loop, ev_src_t *src, unsigned *events, int blocked) {
+    unsigned want = blocked ? 0 : EPOLLIN;
+
+    if (src->fd >= 0 && want != *events && set_watch(loop, src, EPOLL_CTL_MOD, want) == 0) {
+        *events = want;
+    }
+}
+
+/*
+ * conn_sync(loop, c)
+ *
+ * Registers c's socket and relay pipe for what its state waits on
+ */
+static void conn_sync(rsh_loop_t *loop, rsh_conn_t *c) {
+    unsigned want = 0;
+
+    if (!c->dead) {
+        if (c->out || c->relay_blocked) {
+            want |= EPOLLOUT;
+        } else if (c->state == CONN_IDLE && !c->closing) {
+            want |= EPOLLIN;
+        }
+        if (want != c->events && set_watch(loop, &c->sock, EPOLL_CTL_MOD, want) == 0) {
+            c->events = want;
+        }
+    }
+    sync_relay(loop, &c->relay, &c->relay_events, c->relay_blocked);
+    sync_relay(loop, &c->relay_err, &c->relay_err_events, c->relay_blocked);
+}
+
+/*
+ * idle_remove(loop, c)
+ *
+ * Takes a connection off the trim queue, if it is on it
+ */
+static void idle_remove(rsh_loop_t *loop, rsh_conn_t *c) {
+    if (c->idle_ns == 0) {
+        return;
+    }
+    if (c->idle_prev) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        loop->idle_head = c->idle_next;
+    }
+    if (c->idle_next) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        loop->idle_tail = c->idle_prev;
+    }
+    c->idle_prev = c->idle_next = NULL;
+    c->idle_ns = 0;
+}
+
+/*
+ * idle_push(loop, c)
+ *
+ * Queues a connection that has just gone idle for its arena to be trimmed
+ */
+static void idle_push(rsh_loop_t *loop, rsh_conn_t *c) {
+    if (c->idle_ns != 0 || !c->session.arena.base) {
+        return;
+    }
+    c->idle_ns = monotonic_ns();
+    c->idle_prev = loop->idle_tail;
+    if (loop->idle_tail) {
+        loop->idle_tail->idle_next = c;
+    } else {
+        loop->idle_head = c;
+    }
+    loop->idle_tail = c;
+}
+
+/*
+ * idle_trim(loop)
+ *
+ * Trims the arenas of connections idle for IDLE_TRIM_MS; returns the
+ * milliseconds until the next one is due, or -1 if none is queued
+ */
+static int idle_trim(rsh_loop_t *loop) {
+    uint64_t now = monotonic_ns();
+    uint64_t after = (uint64_t)IDLE_TRIM_MS * 1000000;
+
+    while (loop->idle_head) {
+        rsh_conn_t *c = loop->idle_head;
+        if (now - c->idle_ns < after) {
+            return (int)((c->idle_ns + after - now) / 1000000) + 1;
+        }
+        idle_remove(loop, c);
+        session_trim(&c->session);
+    }
+    return -1;
+}
+
+/*
+ * conn_free(loop, c)
+ *
+ * Closes a connection that has no command in flight. The struct itself
+ * lives until the current batch of events is handled, since a later event
+ * in it may still point there.
+ */
+static void conn_free(rsh_loop_t *loop, rsh_conn_t *c) {
+    close(c->sock.fd);
+    c->sock.kind = EV_FREED;
+    if (c->cwd_fd >= 0) {
+        close(c->cwd_fd);
+    }
+    idle_remove(loop, c);
+    session_destroy(&c->session);
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        loop->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    free(c->in);
+    free(c->out);
+    c->in = c->out = NULL;
+    c->next = loop->freed;
+    loop->freed = c;
+    loop->nconns--;
+
+    // A descriptor is free again if accept had run out of them
+    if (!loop->listening && !loop->stopping &&
+        set_watch(loop, &loop->listen, EPOLL_CTL_ADD, EPOLLIN) == 0) {
+        loop->listening = 1;
+    }
+}
+
+/*
+ * conn_drop(loop, c)
+ *
+ * The client went away: close now, or once its command has finished
+ */
+static void conn_drop(rsh_loop_t *loop, rsh_conn_t *c) {
+    if (c->state == CONN_IDLE) {
+        conn_free(loop, c);
+        return;
+    }
+    if (!c->dead) {
+        c->dead = 1;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sock.fd, NULL);
+        free(c->out);
+        c->out = NULL;
+        c->out_len = c->out_off = 0;
+        c->relay_blocked = 0;
+        conn_sync(loop, c);
+    }
+}
+
+/*
+ * conn_flush(loop, c)
+ *
+ * Sends queued reply bytes; returns 0 once none are left, -1 if the socket
+ * is full and -2 if the client is gone
+ */
+static int conn_flush(rsh_loop_t *loop, rsh_conn_t *c) {
+    while (c->out) {
+        ssize_t n = send(c->sock.fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return -1;
+            }
+            conn_drop(loop, c);
+            return -2;
+        }
+        c->out_off += n;
+        if (c->out_off == c->out_len) {
+            free(c->out);
+            c->out = NULL;
+            c->out_len = c->out_off = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * cmd_finish(loop, c)
+ *
+ * The relay pipes hit EOF: queue the report and the end of the reply and
+ * release the command
+ */
+static void cmd_finish(rsh_loop_t *loop, rsh_conn_t *c) {
+    rsh_cmd_t *cmd = c->cmd;
+
+    if (c->relay.fd >= 0) {
+        close(c->relay.fd);
+        c->relay.fd = -1;
+    }
+    c->relay_blocked = 0;
+
+    session_enter(&c->session);
+    if (cmd->timed && !c->dead) {
+        // stats_report writes to a descriptor; read its report back
+        int mfd = memfd_create("rsh-stats", MFD_CLOEXEC);
+        struct stat sb;
+        if (mfd >= 0) {
+            stats_report(mfd, &cmd->clist, cmd->stages, cmd->start_ns, cmd->end_ns);
+            if (fstat(mfd, &sb) == 0 && sb.st_size > 0) {
+                char *text = malloc(sb.st_size);
+                if (text && pread(mfd, text, sb.st_size, 0) == sb.st_size) {
+                    if (c->framed) {
+                        queue_frame(c, RDSH_FRAME_DATA, RDSH_CH_STDERR, text, sb.st_size);
+                    } else {
+                        queue_out(c, text, sb.st_size);
+                    }
+                }
+                free(text);
+            }
+            close(mfd);
+        }
+    }
+    int status = cmd->failed;
+    if (!status && cmd->stages) {
+        status = pipeline_status(cmd->stages, cmd->clist.num, c->session.pipefail);
+    }
+    queue_end(c, status);
+    free_cmd_list(&cmd->clist);
+    session_enter(NULL);
+    c->cmd = NULL;
+    c->state = CONN_IDLE;
+
+    if (c->dead) {
+        conn_free(loop, c);
+    } else {
+        idle_push(loop, c);
+    }
+}
+
+/*
+ * relay_pump_framed(loop, c)
+ *
+ * relay_pump for a framed client: reads the stdout and stderr pipes into
+ * DATA frames, taking more only once the queued frames are sent
+ */
+static void relay_pump_framed(rsh_loop_t *loop, rsh_conn_t *c) {
+    ev_src_t *relays[2] = { &c->relay, &c->relay_err };
+    int moved = 1;
+
+    while (moved && (c->relay.fd >= 0 || c->relay_err.fd >= 0)) {
+        c->relay_blocked = (conn_flush(loop, c) == -1);
+        if (c->relay_blocked) {
+            break;
+        }
+        moved = 0;
+        for (int k = 0; k < 2; k++) {
+            ev_src_t *r = relays[k];
+            if (r->fd < 0) {
+                continue;
+            }
+            ssize_t n = read(r->fd, loop->buf + RDSH_FRAME_HDR_SZ, RELAY_CHUNK);
+            if (n > 0) {
+                rdsh_pack_hdr(loop->buf, RDSH_FRAME_DATA,
+                              k ? RDSH_CH_STDERR : RDSH_CH_STDOUT, c->tag, n);
+                queue_out(c, loop->buf, RDSH_FRAME_HDR_SZ + n);
+                moved = 1;
+            } else if (n == 0) {
+                close(r->fd);
+                r->fd = -1;
+                moved = 1;
+            } else if (errno == EINTR) {
+                moved = 1;
+            }
+        }
+    }
+    if (c->relay.fd < 0 && c->relay_err.fd < 0) {
+        cmd_finish(loop, c);
+        return;         // as for relay_pump
+    }
+    conn_sync(loop, c);
+}
+
+/*
+ * relay_pump(loop, c)
+ *
+ * Moves command output from the relay pipe to the client until one side
+ * would block or the command is over
+ */
+static void relay_pump(rsh_loop_t *loop, rsh_conn_t *c) {
+    if (c->framed) {
+        relay_pump_framed(loop, c);
+        return;
+    }
+    while (c->relay.fd >= 0) {
+        ssize_t n;
+
+        if (c->dead) {
+            n = read(c->relay.fd, loop->buf, RDSH_COMM_BUFF_SZ);
+        } else {
+            n = splice(c->relay.fd, NULL, c->sock.fd, NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            cmd_finish(loop, c);
+            return;     // the caller moves on to the next line
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            conn_drop(loop, c);
+            continue;
+        }
+        // EAGAIN from either end; data still waiting means the socket is full
+        int avail = 0;
+        c->relay_blocked = (!c->dead && ioctl(c->relay.fd, FIONREAD, &avail) == 0 &&
+                            avail > 0);
+        break;
+    }
+    conn_sync(loop, c);
+}
+
+/*
+ * cmd_close_writers(cmd)
+ *
+ * Closes the loop's copies of the relay pipes' write ends
+ */
+static void cmd_close_writers(rsh_cmd_t *cmd) {
+    if (cmd->err_w >= 0 && cmd->err_w != cmd->relay_w) {
+        close(cmd->err_w);
+    }
+    if (cmd->relay_w >= 0) {
+        close(cmd->relay_w);
+    }
+    cmd->relay_w = cmd->err_w = -1;
+}
+
+/*
+ * stage_collected(loop, c)
+ *
+ * Counts one collected stage; after the last, the loop's copies of the
+ * relay pipes' write ends are closed so the pipes reach EOF once drained
+ */
+static void stage_collected(rsh_loop_t *loop, rsh_conn_t *c) {
+    (void)loop;
+    if (--c->cmd->pending == 0) {
+        c->cmd->end_ns = monotonic_ns();
+        cmd_close_writers(c->cmd);
+    }
+}
+
+/*
+ * child_exited(loop, src)
+ *
+ * A process stage's pidfd became readable: reap it. Once the last stage
+ * is gone the earlier ones get SIGPIPE, as wait_pipeline does.
+ */
+static void child_exited(rsh_loop_t *loop, ev_src_t *src) {
+    rsh_conn_t *c = src->conn;
+    rsh_cmd_t *cmd = c->cmd;
+    int num = cmd->clist.num;
+
+    reap_stage(&cmd->stages[src->stage]);
+    close(src->fd);
+    src->fd = -1;
+    if (src->stage == num - 1) {
+        for (int i = 0; i < num; i++) {
+            if (cmd->watch[i].kind == EV_CHILD && cmd->watch[i].fd >= 0) {
+                syscall(SYS_pidfd_send_signal, cmd->watch[i].fd, SIGPIPE, NULL, 0);
+            }
+        }
+    }
+    stage_collected(loop, c);
+}
+
+/*
+ * stage_done(st)
+ *
+ * on_done hook, on a built-in stage's thread: tells the loop which stage
+ */
+static void stage_done(pipeline_stage_t *st) {
+    ev_src_t *src = st->done_arg;
+
+    while (write(done_w, &src, sizeof(src)) < 0 && errno == EINTR) {
+    }
+}
+
+static void expand_done(rsh_loop_t *loop, rsh_conn_t *c);
+
+/*
+ * threads_done(loop)
+ *
+ * Joins the built-in stage and expansion threads that have reported
+ */
+static void threads_done(rsh_loop_t *loop) {
+    ev_src_t *done[64];
+    ssize_t n;
+
+    while ((n = read(loop->done.fd, done, sizeof(done))) > 0) {
+        for (size_t i = 0; i < n / sizeof(done[0]); i++) {
+            rsh_conn_t *c = done[i]->conn;
+            if (done[i]->kind == EV_EXPAND) {
+                expand_done(loop, c);
+                continue;
+            }
+            pthread_join(c->cmd->stages[done[i]->stage].thread, NULL);
+            stage_collected(loop, c);
+        }
+    }
+}
+
+/*
+ * poll_unwatched(loop)
+ *
+ * Reaps exited process stages that could not get a pidfd
+ */
+static void poll_unwatched(rsh_loop_t *loop) {
+    for (rsh_conn_t *c = loop->conns; c && loop->unwatched > 0; c = c->next) {
+        if (!c->cmd || c->cmd->unwatched == 0) {
+            continue;
+        }
+        for (int i = 0; i < c->cmd->clist.num; i++) {
+            pipeline_stage_t *st = &c->cmd->stages[i];
+            siginfo_t si = { 0 };
+
+            if (c->cmd->watch[i].kind != EV_CHILD || c->cmd->watch[i].fd >= 0 ||
+                st->pid <= 0 || st->end_ns != 0) {
+                continue;
+            }
+            if (waitid(P_PID, st->pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+                si.si_pid == st->pid) {
+                reap_stage(st);
+                c->cmd->unwatched--;
+                loop->unwatched--;
+                stage_collected(loop, c);
+            }
+        }
+    }
+}
+
+/*
+ * loop_stop(loop)
+ *
+ * Stops accepting and closes every connection with nothing in flight
+ */
+static void loop_stop(rsh_loop_t *loop) {
+    if (loop->stopping) {
+        return;
+    }
+    loop->stopping = 1;
+    if (loop->listening) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen.fd, NULL);
+        loop->listening = 0;
+    }
+    rsh_conn_t *next;
+    for (rsh_conn_t *c = loop->conns; c; c = next) {
+        next = c->next;
+        c->closing = 1;
+        if (c->state == CONN_IDLE && !c->out) {
+            conn_free(loop, c);
+        } else {
+            conn_sync(loop, c);
+        }
+    }
+}
+
+/*
+ * open_relay(loop, src, c)
+ *
+ * Makes a relay pipe and registers its read end; returns the write end
+ */
+static int open_relay(rsh_loop_t *loop, ev_src_t *src, rsh_conn_t *c) {
+    int p[2];
+
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    *src = (ev_src_t){ EV_RELAY, p[0], c, 0 };
+    if (set_watch(loop, src, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+        close(p[0]);
+        close(p[1]);
+        src->fd = -1;
+        return -1;
+    }
+    return p[1];
+}
+
+/*
+ * cmd_start(loop, c, cmd)
+ *
+ * Starts an expanded command's stages writing into its relay pipes
+ */
+static int cmd_start(rsh_loop_t *loop, rsh_conn_t *c, rsh_cmd_t *cmd) {
+    cmd_arena_t *arena = &c->session.arena;
+
+    cmd->timed = stats_begin(&cmd->clist, BUILTIN_REMOTE);
+    int num = cmd->clist.num;
+    if (num == 0) {
+        cmd->end_ns = monotonic_ns();
+        cmd_close_writers(cmd);
+        return OK;
+    }
+
+    cmd->stages = arena_alloc(arena, num * sizeof(pipeline_stage_t));
+    cmd->watch = arena_alloc(arena, num * sizeof(ev_src_t));
+    if (!cmd->stages || !cmd->watch) {
+        return ERR_MEMORY;
+    }
+    memset(cmd->stages, 0, num * sizeof(pipeline_stage_t));
+    for (int i = 0; i < num; i++) {
+        cmd->watch[i] = (ev_src_t){ EV_DONE, -1, c, i };
+        cmd->stages[i].timed = cmd->timed;
+        cmd->stages[i].async = 1;
+        cmd->stages[i].own_cwd = 1;
+        cmd->stages[i].cwd_fd = cmd->dir_fd;
+        cmd->stages[i].on_done = stage_done;
+        cmd->stages[i].done_arg = &cmd->watch[i];
+    }
+
+    // A lone built-in whose output is sure to fit in the empty relay pipe
+    // runs inline; anything else could fill it and stall the loop
+    if (num == 1) {
+        cmd->stages[0].async = !rsh_fits_pipe(&cmd->clist.commands[0], cmd->relay_w);
+    }
+
+    launch_fds_t ends = { loop->null_fd, cmd->relay_w, cmd->err_w };
+    launch_pipeline(&cmd->clist, &ends, BUILTIN_REMOTE, cmd->stages);
+
+    for (int i = 0; i < num; i++) {
+        pipeline_stage_t *st = &cmd->stages[i];
+        ev_src_t *w = &cmd->watch[i];
+
+        if (st->threaded) {
+            cmd->pending++;
+        } else if (st->pid > 0) {
+            cmd->pending++;
+            w->kind = EV_CHILD;
+            w->fd = syscall(SYS_pidfd_open, st->pid, 0);
+            if (w->fd >= 0 && set_watch(loop, w, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+                close(w->fd);
+                w->fd = -1;
+            }
+            if (w->fd < 0) {
+                cmd->unwatched++;
+                loop->unwatched++;
+            }
+        }
+    }
+    if (cmd->pending == 0) {
+        cmd->end_ns = monotonic_ns();
+        cmd_close_writers(cmd);
+    }
+    return OK;
+}
+
+/*
+ * expand_thread(arg)
+ *
+ * Expands a line with a $(...) off the loop, in the connection's directory
+ * and session, then reports on the done pipe
+ */
+static void *expand_thread(void *arg) {
+    rsh_conn_t *c = arg;
+    rsh_cmd_t *cmd = c->cmd;
+    ev_src_t *src = &cmd->expanded;
+
+    if (unshare(CLONE_FS) < 0 || fchdir(cmd->dir_fd) < 0) {
+        dprintf(cmd->err_w, "error: %s\n", strerror(errno));
+        cmd->expand_rc = ERR_EXEC_CMD;
+    } else {
+        session_enter(&c->session);
+        cmd->expand_rc = expand_cmd_list(&cmd->clist, BUILTIN_REMOTE, cmd->err_w, NULL);
+        session_enter(NULL);
+    }
+    while (write(done_w, &src, sizeof(src)) < 0 && errno == EINTR) {
+    }
+    return NULL;
+}
+
+/*
+ * cmd_launch(loop, c, cmd)
+ *
+ * Opens a parsed command's relay pipes, expands it and starts its stages.
+ * A line with a $(...) is handed to expand_thread instead, with
+ * cmd->expanding set until expand_done starts it.
+ */
+static int cmd_launch(rsh_loop_t *loop, rsh_conn_t *c, rsh_cmd_t *cmd) {
+    cmd->relay_w = open_relay(loop, &c->relay, c);
+    c->relay_events = EPOLLIN;
+    cmd->err_w = cmd->relay_w;
+    if (cmd->relay_w >= 0 && c->framed) {
+        cmd->err_w = open_relay(loop, &c->relay_err, c);
+        c->relay_err_events = EPOLLIN;
+    }
+    if (cmd->relay_w < 0 || cmd->err_w < 0) {
+        if (c->relay.fd >= 0) {
+            close(c->relay.fd);
+            close(cmd->relay_w);
+            c->relay.fd = -1;
+        }
+        cmd->relay_w = cmd->err_w = -1;
+        return ERR_EXEC_CMD;
+    }
+
+    if (cmd_list_substitutes(&cmd->clist)) {
+        cmd->expanded = (ev_src_t){ EV_EXPAND, -1, c, 0 };
+        if (pthread_create(&cmd->expander, NULL, expand_thread, c) == 0) {
+            cmd->expanding = 1;
+            return OK;
+        }
+    }
+    int rc = expand_cmd_list(&cmd->clist, BUILTIN_REMOTE, cmd->err_w, NULL);
+    if (rc != OK) {
+        return rc;
+    }
+    return cmd_start(loop, c, cmd);
+}
+
+/*
+ * cmd_started(c, cmd, rc)
+ *
+ * Ends the reply of a command that failed to start, or remembers where a
+ * cd moved the loop
+ */
+static void cmd_started(rsh_conn_t *c, rsh_cmd_t *cmd, int rc) {
+    char error_msg[100];
+
+    if (rc != OK) {
+        dprintf(cmd->err_w, "%s", rsh_error_text(rc, error_msg, sizeof(error_msg)));
+        cmd->failed = 1;
+        cmd_close_writers(cmd);
+    } else if (cmd->cd) {
+        // cd moved the loop; remember where for this client
+        int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (c->cwd_fd >= 0) {
+                close(c->cwd_fd);
+            }
+            c->cwd_fd = fd;
+        }
+    }
+}
+
+/*
+ * expand_done(loop, c)
+ *
+ * expand_thread has reported: starts the expanded line in the connection's
+ * directory, or ends the command if the client has gone
+ */
+static void expand_done(rsh_loop_t *loop, rsh_conn_t *c) {
+    rsh_cmd_t *cmd = c->cmd;
+
+    pthread_join(cmd->expander, NULL);
+    cmd->expanding = 0;
+    int rc = cmd->expand_rc;
+    if (c->dead) {
+        cmd->failed = 1;
+        cmd_close_writers(cmd);
+        return;
+    }
+
+    session_enter(&c->session);
+    if (rc == OK && fchdir(cmd->dir_fd) < 0) {
+        rc = ERR_EXEC_CMD;
+    }
+    if (rc == OK) {
+        rc = cmd_start(loop, c, cmd);
+    }
+    cmd_started(c, cmd, rc);
+    if (fchdir(loop->root_fd) < 0) {
+        perror("fchdir");
+    }
+    session_enter(NULL);
+}
+
+/*
+ * conn_command(loop, c, line)
+ *
+ * Parses and starts one command line from a client
+ */
+static void conn_command(rsh_loop_t *loop, rsh_conn_t *c, char *line) {
+    int dir_fd = (c->cwd_fd >= 0) ? c->cwd_fd : loop->root_fd;
+    rsh_cmd_t *cmd;
+    int rc;
+
+    idle_remove(loop, c);
+    session_enter(&c->session);
+    if (c->cwd_fd >= 0 && fchdir(c->cwd_fd) < 0) {
+        queue_message(c, "error: working directory is gone\n", 1);
+        goto out;
+    }
+
+    command_list_t clist;
+    char error_msg[100];
+    rc = build_cmd_list(line, &clist);
+    if (rc != OK) {
+        queue_message(c, rsh_error_text(rc, error_msg, sizeof(error_msg)), rc != WARN_NO_CMDS);
+        goto out;
+    }
+    if (clist.background) {
+        queue_message(c, RDSH_ERR_NO_BG, 1);
+        free_cmd_list(&clist);
+        goto out;
+    }
+
+    // Control commands only apply to a single command
+    const builtin_desc_t *bi = NULL;
+    if (clist.num == 1) {
+        bi = builtin_lookup(clist.commands[0].argv[0], BUILTIN_REMOTE);
+    }
+    if (bi && (bi->id == BI_CMD_EXIT || bi->id == BI_CMD_STOP_SVR)) {
+        free_cmd_list(&clist);
+        c->closing = 1;
+        if (bi->id == BI_CMD_EXIT) {
+            queue_message(c, "Exiting...\n", 0);
+        } else {
+            queue_message(c, "Stopping server...\n", 0);
+            printf("Server stopping per client request...\n");
+            loop_stop(loop);
+        }
+        goto out;
+    }
+
+    cmd = arena_alloc(&c->session.arena, sizeof(*cmd));
+    if (!cmd) {
+        free_cmd_list(&clist);
+        queue_message(c, "error: out of memory\n", 1);
+        goto out;
+    }
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->clist = clist;
+    cmd->relay_w = cmd->err_w = -1;
+    cmd->start_ns = monotonic_ns();
+    cmd->cd = (bi && bi->id == BI_CMD_CD);
+    cmd->dir_fd = dir_fd;
+    c->cmd = cmd;
+    c->state = CONN_RUNNING;
+
+    rc = cmd_launch(loop, c, cmd);
+    if (rc != OK && c->relay.fd < 0) {
+        // Nothing was started and there is no pipe to relay
+        free_cmd_list(&cmd->clist);
+        c->cmd = NULL;
+        c->state = CONN_IDLE;
+        queue_message(c, rsh_error_text(rc, error_msg, sizeof(error_msg)), 1);
+        goto out;
+    }
+    if (!cmd->expanding) {
+        cmd_started(c, cmd, rc);
+    }
+
+out:
+    if (fchdir(loop->root_fd) < 0) {
+        perror("fchdir");
+    }
+    if (!c->cmd) {
+        idle_push(loop, c);
+    }
+    session_enter(NULL);
+}
+
+/*
+ * conn_consume(c, used)
+ *
+ * Drops the first used bytes of a client's input
+ */
+static void conn_consume(rsh_conn_t *c, size_t used) {
+    if (used == c->in_len) {
+        free(c->in);
+        c->in = NULL;
+        c->in_len = 0;
+    } else {
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+    }
+}
+
+/*
+ * conn_hello(c)
+ *
+ * Picks the protocol from a client's first bytes and answers a HELLO;
+ * returns 0 when chosen, 1 to wait for more input or -1 to close
+ */
+static int conn_hello(rsh_conn_t *c) {
+    rdsh_frame_t f;
+
+    if (c->in[0] != RDSH_FRAME_HELLO) {
+        c->negotiated = 1;
+        return 0;
+    }
+    ssize_t size = rdsh_parse_frame(c->in, c->in_len, &f);
+    if (size == 0) {
+        return 1;
+    }
+    if (size < 0 || rdsh_check_hello(&f) < 1) {
+        return -1;
+    }
+    char hello[RDSH_HELLO_SZ];
+    rdsh_pack_hello(hello);
+    queue_out(c, hello, sizeof(hello));
+    conn_consume(c, size);
+    c->negotiated = 1;
+    c->framed = 1;
+    return 0;
+}
+
+/*
+ * conn_next(loop, c)
+ *
+ * Runs the complete lines or CMD frames a client has sent, one at a time,
+ * each once the previous reply is out; then waits for more input or for
+ * the socket to drain
+ */
+static void conn_next(rsh_loop_t *loop, rsh_conn_t *c) {
+    while (c->state == CONN_IDLE) {
+        int rc = conn_flush(loop, c);
+        if (rc == -2) {
+            return;
+        }
+        if (rc < 0) {
+            break;
+        }
+        if (c->closing) {
+            conn_free(loop, c);
+            return;
+        }
+        if (c->in && !c->negotiated) {
+            rc = conn_hello(c);
+            if (rc < 0) {
+                conn_free(loop, c);
+                return;
+            }
+            if (rc > 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (c->framed) {
+            rdsh_frame_t f;
+            ssize_t size = c->in ? rdsh_parse_frame(c->in, c->in_len, &f) : 0;
+            if (size == 0) {
+                break;
+            }
+            if (size < 0 || f.type != RDSH_FRAME_CMD) {
+                conn_free(loop, c);
+                return;
+            }
+            // The byte after the payload is the next frame's, or the spare
+            // one conn_readable keeps
+            char saved = f.payload[f.len];
+            f.payload[f.len] = '\0';
+            c->tag = f.tag;
+            conn_command(loop, c, f.payload);
+            f.payload[f.len] = saved;
+            conn_consume(c, size);
+        } else {
+            char *end = c->in ? memchr(c->in, '\0', c->in_len) : NULL;
+            if (!end && c->in && c->in[c->in_len - 1] == '\n') {
+                // A client that does not terminate lines, such as nc; the
+                // spare byte takes the terminator
+                c->in[c->in_len++] = '\0';
+                end = c->in + c->in_len - 1;
+            }
+            if (!end) {
+                break;
+            }
+
+            // build_cmd_list copies the line, so the rest can move up after
+            conn_command(loop, c, c->in);
+            conn_consume(c, end - c->in + 1);
+        }
+        if (c->state == CONN_RUNNING) {
+            relay_pump(loop, c);
+            if (c->sock.kind == EV_FREED || c->state == CONN_RUNNING) {
+                return;
+            }
+        }
+    }
+    if (c->in_len > CONN_LINE_MAX + (c->framed ? RDSH_FRAME_HDR_SZ : 0)) {
+        conn_free(loop, c);
+        return;
+    }
+    conn_sync(loop, c);
+}
+
+/*
+ * conn_readable(loop, c)
+ *
+ * Reads whatever a client has sent and runs the first complete line
+ */
+static void conn_readable(rsh_loop_t *loop, rsh_conn_t *c) {
+    ssize_t n = recv(c->sock.fd, loop->buf, RDSH_COMM_BUFF_SZ, 0);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            conn_free(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        printf("Client closed connection\n");
+        conn_free(loop, c);
+        return;
+    }
+    // One spare byte past the input, for a line or payload terminator
+    char *in = realloc(c->in, c->in_len + n + 1);
+    if (!in) {
+        conn_free(loop, c);
+        return;
+    }
+    memcpy(in + c->in_len, loop->buf, n);
+    c->in = in;
+    c->in_len += n;
+    conn_next(loop, c);
+}
+
+/*
+ * conn_event(loop, src, ev)
+ *
+ * Handles readiness of a client's socket or relay pipe
+ */
+static void conn_event(rsh_loop_t *loop, ev_src_t *src, unsigned ev) {
+    rsh_conn_t *c = src->conn;
+
+    if (c->sock.kind == EV_FREED) {
+        return;
+    }
+    if (src->kind == EV_RELAY) {
+        // A framed command's other pipe may report after it has finished
+        if (c->state == CONN_RUNNING) {
+            relay_pump(loop, c);
+        }
+    } else if (ev & (EPOLLERR | EPOLLHUP)) {
+        conn_drop(loop, c);
+        return;
+    } else if (ev & EPOLLOUT) {
+        c->relay_blocked = 0;
+        if (c->state == CONN_RUNNING) {
+            relay_pump(loop, c);
+        }
+    } else if (ev & EPOLLIN) {
+        conn_readable(loop, c);
+        return;
+    }
+    if (c->sock.kind != EV_FREED && c->state == CONN_IDLE) {
+        conn_next(loop, c);
+    }
+}
+
+/*
+ * loop_accept(loop)
+ *
+ * Accepts every pending connection
+ */
+static void loop_accept(rsh_loop_t *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int sock = accept4(loop->listen.fd, (struct sockaddr *)&client_addr, &client_len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Leave the rest in the backlog until a connection closes
+                perror("accept");
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen.fd, NULL);
+                loop->listening = 0;
+            }
+            return;
+        }
+
+        rsh_conn_t *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(sock);
+            continue;
+        }
+        c->sock = (ev_src_t){ EV_CLIENT, sock, c, 0 };
+        c->relay.fd = -1;
+        c->relay_err.fd = -1;
+        c->cwd_fd = -1;
+        c->events = EPOLLIN;
+        session_init(&c->session);
+        if (set_watch(loop, &c->sock, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+            close(sock);
+            free(c);
+            continue;
+        }
+        // Replies end with a separate EOF byte; see exec_client_requests
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        c->next = loop->conns;
+        if (loop->conns) {
+            loop->conns->prev = c;
+        }
+        loop->conns = c;
+        loop->nconns++;
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        printf("Client connected from %s\n", client_ip);
+    }
+}
+
+/*
+ * raise_fd_limit()
+ *
+ * Lifts the soft descriptor limit to the hard one; every client is a socket
+ */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * process_cli_requests_event(svr_socket)
+ *
+ * Serves every client from one epoll loop until stop-server
+ */
+int process_cli_requests_event(int svr_socket) {
+    rsh_loop_t loop = { .epfd = -1, .root_fd = -1, .null_fd = -1 };
+    struct epoll_event events[EV_BATCH];
+    int done[2] = { -1, -1 };
+    int rc = OK_EXIT;
+
+    raise_fd_limit();
+    loop.buf = malloc(RDSH_FRAME_HDR_SZ + RELAY_CHUNK);
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop.root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    loop.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (!loop.buf || loop.epfd < 0 || loop.root_fd < 0 || loop.null_fd < 0 ||
+        pipe2(done, O_CLOEXEC) < 0) {
+        perror("process_cli_requests_event");
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+    fcntl(done[0], F_SETFL, O_NONBLOCK);
+    fcntl(svr_socket, F_SETFL, fcntl(svr_socket, F_GETFL) | O_NONBLOCK);
+    done_w = done[1];
+    loop.done = (ev_src_t){ EV_DONE, done[0], NULL, 0 };
+    loop.listen = (ev_src_t){ EV_LISTEN, svr_socket, NULL, 0 };
+    if (set_watch(&loop, &loop.done, EPOLL_CTL_ADD, EPOLLIN) < 0 ||
+        set_watch(&loop, &loop.listen, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+        perror("epoll_ctl");
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+    loop.listening = 1;
+
+    int timeout = -1;
+    while (!loop.stopping || loop.nconns > 0) {
+        if (loop.unwatched && (timeout < 0 || timeout > POLL_MS)) {
+            timeout = POLL_MS;
+        }
+        int n = epoll_wait(loop.epfd, events, EV_BATCH, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            ev_src_t *src = events[i].data.ptr;
+            unsigned ev = events[i].events;
+
+            switch (src->kind) {
+            case EV_LISTEN:
+                loop_accept(&loop);
+                break;
+            case EV_DONE:
+                threads_done(&loop);
+                break;
+            case EV_CHILD:
+                child_exited(&loop, src);
+                break;
+            case EV_RELAY:
+            case EV_CLIENT:
+                conn_event(&loop, src, ev);
+                break;
+            }
+        }
+        if (loop.unwatched) {
+            poll_unwatched(&loop);
+        }
+        timeout = idle_trim(&loop);
+        while (loop.freed) {
+            rsh_conn_t *c = loop.freed;
+            loop.freed = c->next;
+            free(c);
+        }
+    }
+
+out:
+    while (loop.conns) {
+        conn_free(&loop, loop.conns);
+    }
+    while (loop.freed) {
+        rsh_conn_t *c = loop.freed;
+        loop.freed = c->next;
+        free(c);
+    }
+    done_w = -1;
+    if (done[0] >= 0) {
+        close(done[0]);
+        close(done[1]);
+    }
+    if (loop.null_fd >= 0) {
+        close(loop.null_fd);
+    }
+    if (loop.root_fd >= 0) {
+        close(loop.root_fd);
+    }
+    if (loop.epfd >= 0) {
+        close(loop.epfd);
+    }
+    free(loop.buf);
+    return rc;
+}
@@ -0,0 +1,352 @@
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Framed protocol
+ *
+ * The legacy protocol relies on recv boundaries. One recv is one command,
+ * and a reply ends when a chunk happens to end in RDSH_EOF_CHAR. Commands
+ * sent back to back can merge, and output containing 0x04 cuts a reply
+ * short. A framed connection instead carries a stream of frames, each an
+ * RDSH_FRAME_HDR_SZ header giving its type, channel, tag and payload
+ * length (see rshlib.h). Frames can split or merge across recv calls; the
+ * reader reassembles them.
+ *
+ * The client opens with a HELLO frame carrying RDSH_PROTO_MAGIC and its
+ * version, and the server answers with a HELLO of its own. Every frame of
+ * a reply carries the tag of the CMD frame it answers. The server runs
+ * commands in the order they arrive, so a client may send many before
+ * reading any reply (see exec_remote_script) and match replies to
+ * commands by tag. A legacy command never starts with the HELLO type byte
+ * (DEL), so the server can tell the two apart from the first byte. A
+ * legacy server runs the hello as a command that fails and replies in the
+ * legacy way, and the client stays on the legacy protocol.
+ *
+ * The reader hands out payloads in place, in its own buffer, and
+ * terminates each one with a NUL it swaps in for the byte after the
+ * payload until the next call. rdsh_read_frame blocks for a frame; a
+ * caller with its own poll loop pairs rdsh_reader_fill, one recv, with
+ * rdsh_next_frame, which only decodes what has arrived. Commands go
+ * straight to build_cmd_list and output straight to write, without a copy.
+ * Senders put the header and the payload on the wire together, with
+ * writev or with a header followed by splice from a pipe.
+ */
+
+#define READER_INIT_SZ 4096
+
+/*
+ * rdsh_pack_hdr(hdr, type, channel, tag, len)
+ *
+ * Fills in a frame header
+ */
+void rdsh_pack_hdr(char hdr[RDSH_FRAME_HDR_SZ], int type, int channel, uint16_t tag,
+                   uint32_t len) {
+    uint16_t be_tag = htons(tag);
+    uint32_t be_len = htonl(len);
+
+    hdr[0] = (char)type;
+    hdr[1] = (char)channel;
+    memcpy(hdr + 2, &be_tag, sizeof(be_tag));
+    memcpy(hdr + 4, &be_len, sizeof(be_len));
+}
+
+/*
+ * rdsh_parse_frame(buf, len, f)
+ *
+ * Decodes the frame at the start of buf without copying it
+ *
+ * Returns the frame's size once it is complete, 0 if more bytes are
+ * needed, or ERR_RDSH_COMMUNICATION for a header no peer would send. f's
+ * payload points into buf.
+ */
+ssize_t rdsh_parse_frame(char *buf, size_t len, rdsh_frame_t *f) {
+    uint16_t be_tag;
+    uint32_t be_len;
+
+    if (len < RDSH_FRAME_HDR_SZ) {
+        return 0;
+    }
+    memcpy(&be_tag, buf + 2, sizeof(be_tag));
+    memcpy(&be_len, buf + 4, sizeof(be_len));
+    f->type = (unsigned char)buf[0];
+    f->channel = (unsigned char)buf[1];
+    f->tag = ntohs(be_tag);
+    f->len = ntohl(be_len);
+    f->payload = buf + RDSH_FRAME_HDR_SZ;
+    if (f->len > RDSH_FRAME_MAX) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (len - RDSH_FRAME_HDR_SZ < f->len) {
+        return 0;
+    }
+    return RDSH_FRAME_HDR_SZ + f->len;
+}
+
+/*
+ * rdsh_send_frame(sock, type, channel, tag, data, len)
+ *
+ * Sends one frame on a blocking socket, header and payload in one call
+ * when the socket takes it
+ */
+int rdsh_send_frame(int sock, int type, int channel, uint16_t tag, const void *data,
+                    uint32_t len) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+    struct iovec iov[2] = {
+        { hdr, RDSH_FRAME_HDR_SZ },
+        { (void *)data, len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t left = RDSH_FRAME_HDR_SZ + len;
+
+    rdsh_pack_hdr(hdr, type, channel, tag, len);
+    TRACE_BEGIN(send_ns);
+    while (left > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERR_RDSH_COMMUNICATION;
+        }
+        left -= n;
+        // Skip what went out
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    TRACE_END(send_ns, "send", len);
+    return OK;
+}
+
+/*
+ * rdsh_send_exit(sock, tag, status)
+ *
+ * Ends a command's reply with its exit status
+ */
+int rdsh_send_exit(int sock, uint16_t tag, int status) {
+    uint32_t be_status = htonl((uint32_t)status);
+
+    return rdsh_send_frame(sock, RDSH_FRAME_EXIT, 0, tag, &be_status, sizeof(be_status));
+}
+
+/*
+ * rdsh_pack_hello(frame)
+ *
+ * Fills in the HELLO frame that opens a framed connection, either way
+ */
+void rdsh_pack_hello(char frame[RDSH_HELLO_SZ]) {
+    size_t magic = sizeof(RDSH_PROTO_MAGIC) - 1;
+
+    rdsh_pack_hdr(frame, RDSH_FRAME_HELLO, 0, 0, magic + 1);
+    memcpy(frame + RDSH_FRAME_HDR_SZ, RDSH_PROTO_MAGIC, magic);
+    frame[RDSH_FRAME_HDR_SZ + magic] = RDSH_PROTO_VERSION;
+}
+
+/*
+ * rdsh_send_hello(sock)
+ *
+ * Sends a HELLO frame on a blocking socket
+ */
+int rdsh_send_hello(int sock) {
+    char frame[RDSH_HELLO_SZ];
+
+    rdsh_pack_hello(frame);
+    return rdsh_send_frame(sock, RDSH_FRAME_HELLO, 0, 0, frame + RDSH_FRAME_HDR_SZ,
+                           RDSH_HELLO_SZ - RDSH_FRAME_HDR_SZ);
+}
+
+/*
+ * rdsh_check_hello(f)
+ *
+ * Returns the version a HELLO frame offers, or -1 if it is not one
+ */
+int rdsh_check_hello(const rdsh_frame_t *f) {
+    size_t magic = sizeof(RDSH_PROTO_MAGIC) - 1;
+
+    if (f->type != RDSH_FRAME_HELLO || f->len < magic + 1 ||
+        memcmp(f->payload, RDSH_PROTO_MAGIC, magic) != 0) {
+        return -1;
+    }
+    return (unsigned char)f->payload[magic];
+}
+
+/*
+ * rdsh_relay_chunk(pipe_fd, sock, channel, tag)
+ *
+ * Moves what is waiting in a pipe to a blocking socket as one DATA frame:
+ * the header, then the bytes themselves with splice. Returns the bytes
+ * moved, 0 at the pipe's EOF, or ERR_RDSH_COMMUNICATION if the socket
+ * failed; a caller that keeps the pipe open then just drains it.
+ */
+int rdsh_relay_chunk(int pipe_fd, int sock, int channel, uint16_t tag) {
+    char hdr[RDSH_FRAME_HDR_SZ];
+    int avail = 0;
+
+    if (ioctl(pipe_fd, FIONREAD, &avail) < 0 || avail == 0) {
+        // Readable and empty: every writer has gone
+        return 0;
+    }
+    if (avail > RDSH_FRAME_DATA_MAX) {
+        avail = RDSH_FRAME_DATA_MAX;
+    }
+
+    rdsh_pack_hdr(hdr, RDSH_FRAME_DATA, channel, tag, avail);
+    if (send(sock, hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE) != sizeof(hdr)) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    for (int left = avail; left > 0; ) {
+        ssize_t n = splice(pipe_fd, NULL, sock, NULL, left, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        left -= n;
+    }
+    return avail;
+}
+
+/*
+ * rdsh_reader_init(r, fd)
+ *
+ * Prepares a reader for the frames arriving on fd
+ */
+int rdsh_reader_init(rdsh_reader_t *r, int fd) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->buf = malloc(READER_INIT_SZ);
+    if (!r->buf) {
+        return ERR_MEMORY;
+    }
+    r->cap = READER_INIT_SZ;
+    return OK;
+}
+
+/*
+ * rdsh_reader_free(r)
+ *
+ * Releases a reader's buffer
+ */
+void rdsh_reader_free(rdsh_reader_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/*
+ * rdsh_next_frame(r, f)
+ *
+ * Decodes the next frame already received, without reading. Returns 1
+ * with it in f, 0 if it has not fully arrived, or a negative error. f's
+ * payload stays valid and NUL-terminated until the next call on r.
+ */
+int rdsh_next_frame(rdsh_reader_t *r, rdsh_frame_t *f) {
+    // Put back the byte the last payload's terminator covers
+    if (r->held) {
+        r->buf[r->start] = r->saved;
+        r->held = 0;
+    }
+
+    ssize_t size = rdsh_parse_frame(r->buf + r->start, r->end - r->start, f);
+    if (size <= 0) {
+        return (int)size;
+    }
+    r->start += size;
+    r->saved = r->buf[r->start];
+    r->buf[r->start] = '\0';
+    r->held = 1;
+    return 1;
+}
+
+/*
+ * rdsh_reader_fill(r)
+ *
+ * Receives once into the reader, making room for the frame it is in the
+ * middle of. Returns the bytes received, 0 at EOF, or a negative error;
+ * a non-blocking socket with nothing to read gives ERR_RDSH_COMMUNICATION
+ * with errno EAGAIN.
+ */
+int rdsh_reader_fill(rdsh_reader_t *r) {
+    rdsh_frame_t f;
+
+    if (r->held) {
+        r->buf[r->start] = r->saved;
+        r->held = 0;
+    }
+
+    // Room for the whole frame and its terminator
+    size_t want = RDSH_FRAME_HDR_SZ + 1;
+    if (rdsh_parse_frame(r->buf + r->start, r->end - r->start, &f) == 0 &&
+        r->end - r->start >= RDSH_FRAME_HDR_SZ) {
+        want += f.len;
+    }
+    if (r->start > 0 && r->cap - r->start < want + RDSH_COMM_BUFF_SZ) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->cap < want || r->cap - r->end <= 1) {
+        size_t cap = (want > r->cap) ? want : r->cap * 2;
+        char *buf = realloc(r->buf, cap);
+        if (!buf) {
+            return ERR_MEMORY;
+        }
+        r->buf = buf;
+        r->cap = cap;
+    }
+
+    // The last byte stays free for the terminator
+    while (1) {
+        TRACE_BEGIN(recv_ns);
+        ssize_t n = recv(r->fd, r->buf + r->end, r->cap - r->end - 1, 0);
+        TRACE_END(recv_ns, "recv", n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        r->end += n;
+        return (int)n;
+    }
+}
+
+/*
+ * rdsh_read_frame(r, f)
+ *
+ * Returns 1 with the next frame in f, 0 at a clean EOF, or a negative
+ * error, receiving until one has arrived. f's payload stays valid and
+ * NUL-terminated until the next call on r.
+ */
+int rdsh_read_frame(rdsh_reader_t *r, rdsh_frame_t *f) {
+    while (1) {
+        int rc = rdsh_next_frame(r, f);
+        if (rc != 0) {
+            return rc;
+        }
+        rc = rdsh_reader_fill(r);
+        if (rc < 0) {
+            return rc;
+        }
+        if (rc == 0) {
+            return (r->end == r->start) ? 0 : ERR_RDSH_COMMUNICATION;
+        }
+    }
+}
@@ -0,0 +1,219 @@
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Pre-forked server
+ *
+ * With -P the server process only supervises a group of workers, one per
+ * core unless -w says otherwise. Each worker boots its own listening
+ * socket on the shared address with SO_REUSEPORT. The kernel spreads new
+ * connections across the group by a hash of their addresses, so accepts
+ * run on every core at once, with no shared queue or lock. Each worker
+ * then serves its clients in the chosen mode: one at a time, from a
+ * thread pool (-x) or from an epoll loop (-E).
+ *
+ * Workers are forked before they have run anything, so each starts as a
+ * small copy of the server. With -z each forks a zygote of its own. A
+ * worker reports over a pipe once it is listening; if one cannot boot,
+ * the whole start fails. The master then waits on its workers and forks a
+ * replacement for any that dies. If a worker dies within a second of
+ * starting, the master waits a second before replacing it. Connections
+ * still queued on a dead worker's socket go with it; the kernel does not
+ * move them to the others.
+ *
+ * stop-server reaches a single worker, which exits with status 0 once its
+ * client has the reply. The master then sends SIGTERM to the rest, waits
+ * for them and returns. Workers also get SIGTERM if the master itself
+ * dies (PR_SET_PDEATHSIG).
+ */
+
+typedef struct prefork {
+    char *ifaces;
+    int port;
+    int mode;
+    int backlog;
+    int nworkers;
+    pid_t *pids;             // -1 for a slot with no worker
+    uint64_t *started_ns;
+} prefork_t;
+
+/*
+ * worker_main(pf, ready_fd, master)
+ *
+ * Body of a worker process: boots a listener, reports on ready_fd and
+ * serves until stop-server; never returns
+ */
+static void worker_main(prefork_t *pf, int ready_fd, pid_t master) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) {
+        _exit(1);           // the master died before prctl took effect
+    }
+    // Workers end with SIGTERM, which would lose buffered log lines
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (zygote_reinit() != OK) {
+        fprintf(stderr, "warning: zygote not started, using posix_spawn\n");
+    }
+
+    int svr_socket = boot_server(pf->ifaces, pf->port, pf->backlog, 1);
+    if (svr_socket < 0) {
+        exit(1);
+    }
+    char ok = 1;
+    if (write(ready_fd, &ok, 1) != 1) {
+        exit(1);
+    }
+    close(ready_fd);
+
+    int rc = serve_requests(svr_socket, pf->mode);
+    stop_server(svr_socket);
+    exit(rc == OK_EXIT ? 0 : 1);
+}
+
+/*
+ * fork_worker(pf, slot)
+ *
+ * Starts the worker for a slot and waits until it is listening
+ */
+static int fork_worker(prefork_t *pf, int slot) {
+    pid_t master = getpid();
+    int ready[2];
+
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return ERR_RDSH_SERVER;
+    }
+    // Buffered log lines would otherwise be written by both processes
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        close(ready[1]);
+        return ERR_RDSH_SERVER;
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        worker_main(pf, ready[1], master);
+    }
+    close(ready[1]);
+
+    char ok = 0;
+    ssize_t n;
+    while ((n = read(ready[0], &ok, 1)) < 0 && errno == EINTR) {
+    }
+    close(ready[0]);
+    if (n != 1) {
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        return ERR_RDSH_SERVER;
+    }
+    pf->pids[slot] = pid;
+    pf->started_ns[slot] = monotonic_ns();
+    return OK;
+}
+
+/*
+ * stop_workers(pf)
+ *
+ * Terminates and reaps every worker still running
+ */
+static void stop_workers(prefork_t *pf) {
+    for (int i = 0; i < pf->nworkers; i++) {
+        if (pf->pids[i] > 0) {
+            kill(pf->pids[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < pf->nworkers; i++) {
+        if (pf->pids[i] > 0) {
+            while (waitpid(pf->pids[i], NULL, 0) < 0 && errno == EINTR) {
+            }
+            pf->pids[i] = -1;
+        }
+    }
+}
+
+/*
+ * start_prefork_server(ifaces, port, mode, backlog, workers)
+ *
+ * Runs the master of a pre-forked server until a worker takes stop-server
+ */
+int start_prefork_server(char *ifaces, int port, int mode, int backlog, int workers) {
+    prefork_t pf = { ifaces, port, mode, backlog, workers, NULL, NULL };
+    int rc = OK_EXIT;
+
+    pf.pids = malloc(workers * sizeof(pid_t));
+    pf.started_ns = malloc(workers * sizeof(uint64_t));
+    if (!pf.pids || !pf.started_ns) {
+        free(pf.pids);
+        free(pf.started_ns);
+        return ERR_MEMORY;
+    }
+    for (int i = 0; i < workers; i++) {
+        pf.pids[i] = -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (fork_worker(&pf, i) != OK) {
+            fprintf(stderr, "error: worker %d did not start\n", i);
+            rc = ERR_RDSH_SERVER;
+            goto out;
+        }
+    }
+    printf("%d workers serving %s:%d\n", workers, ifaces, port);
+
+    while (1) {
+        int ws;
+        pid_t pid = waitpid(-1, &ws, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+
+        int slot = -1;
+        for (int i = 0; i < workers; i++) {
+            if (pf.pids[i] == pid) {
+                slot = i;
+            }
+        }
+        if (slot < 0) {
+            continue;       // not a worker, e.g. the zygote
+        }
+        pf.pids[slot] = -1;
+        if (WIFEXITED(ws) && WEXITSTATUS(ws) == 0) {
+            printf("Server stopping per client request...\n");
+            break;
+        }
+
+        printf("Worker %d (pid %d) %s %d; restarting\n", slot, (int)pid,
+               WIFSIGNALED(ws) ? "killed by signal" : "exited with",
+               WIFSIGNALED(ws) ? WTERMSIG(ws) : WEXITSTATUS(ws));
+        if (monotonic_ns() - pf.started_ns[slot] < 1000000000ull) {
+            sleep(1);
+        }
+        if (fork_worker(&pf, slot) != OK) {
+            fprintf(stderr, "error: worker %d did not restart\n", slot);
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+    }
+
+out:
+    stop_workers(&pf);
+    free(pf.pids);
+    free(pf.started_ns);
+    return rc;
+}
@@ -1,33 +1,48 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include "dshlib.h"
 #include "rshlib.h"
 
 /*
- * start_server(ifaces, port, is_threaded)
+ * start_server(ifaces, port, mode, backlog, workers)
  *
- * Starts the remote shell server
+ * Starts the remote shell server. RDSH_SERVER_THREADED (-x) serves clients
+ * concurrently from a pool of RDSH_POOL_THREADS threads and
+ * RDSH_SERVER_EVENT (-E) from one epoll loop; backlog (-b) sizes the
+ * listen queue. With workers > 0 (-P) that many pre-forked processes
+ * serve the port in the given mode; see start_prefork_server.
  */
-int start_server(char *ifaces, int port, int is_threaded) {
+int start_server(char *ifaces, int port, int mode, int backlog, int workers) {
     int svr_socket;
     int rc;
 
+    if (workers > 0) {
+        return start_prefork_server(ifaces, port, mode, backlog, workers);
+    }
+
     // Boot the server
-    svr_socket = boot_server(ifaces, port);
+    svr_socket = boot_server(ifaces, port, backlog, 0);
     if (svr_socket < 0) {
         return svr_socket;  // Pass through the error code
     }
 
     // Process client requests
-    rc = process_cli_requests(svr_socket);
+    rc = serve_requests(svr_socket, mode);
 
     // Stop the server
     stop_server(svr_socket);
@@ -36,16 +51,32 @@ int start_server(char *ifaces, int port, int is_threaded) {
 }
 
 /*
- * boot_server(ifaces, port)
+ * serve_requests(svr_socket, mode)
+ *
+ * Runs the accept loop for a server mode until stop-server
+ */
+int serve_requests(int svr_socket, int mode) {
+    if (mode == RDSH_SERVER_THREADED) {
+        return process_cli_requests_threaded(svr_socket, RDSH_POOL_THREADS);
+    } else if (mode == RDSH_SERVER_EVENT) {
+        return process_cli_requests_event(svr_socket);
+    }
+    return process_cli_requests(svr_socket);
+}
+
+/*
+ * boot_server(ifaces, port, backlog, reuseport)
  *
- * Sets up the server socket to accept connections
+ * Sets up the server socket to accept connections; with reuseport other
+ * sockets may listen on the same port and the kernel spreads new
+ * connections across them
  */
-int boot_server(char *ifaces, int port) {
+int boot_server(char *ifaces, int port, int backlog, int reuseport) {
     int svr_socket;
     struct sockaddr_in server_addr;
     
     // Create server socket
-    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
+    svr_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (svr_socket < 0) {
         perror("socket");
         return ERR_RDSH_COMMUNICATION;
@@ -58,6 +89,12 @@ int boot_server(char *ifaces, int port) {
         close(svr_socket);
         return ERR_RDSH_COMMUNICATION;
     }
+    if (reuseport &&
+        setsockopt(svr_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
     
     // Set up server address
     memset(&server_addr, 0, sizeof(server_addr));
@@ -78,8 +115,9 @@ int boot_server(char *ifaces, int port) {
         return ERR_RDSH_COMMUNICATION;
     }
     
-    // Listen for connections
-    if (listen(svr_socket, 5) < 0) {
+    // Listen for connections; with -x or -E many clients may connect at
+    // once. The kernel caps the backlog at net.core.somaxconn.
+    if (listen(svr_socket, backlog) < 0) {
         perror("listen");
         close(svr_socket);
         return ERR_RDSH_COMMUNICATION;
@@ -102,7 +140,8 @@ int process_cli_requests(int svr_socket) {
     
     while (1) {
         // Accept client connection
-        client_socket = accept(svr_socket, (struct sockaddr*)&client_addr, &client_len);
+        client_socket = accept4(svr_socket, (struct sockaddr*)&client_addr, &client_len,
+                                SOCK_CLOEXEC);
         if (client_socket < 0) {
             perror("accept");
             return ERR_RDSH_COMMUNICATION;
@@ -128,6 +167,263 @@ int process_cli_requests(int svr_socket) {
     return OK_EXIT;
 }
 
+/*
+ * Threaded server
+ *
+ * The main thread accepts; a fixed pool of workers runs one client's
+ * exec_client_requests loop each. The main thread only accepts while a
+ * worker is free, so a client beyond the pool waits in the listen
+ * backlog until one finishes, and the server never holds more than
+ * nthreads clients.
+ *
+ * Each client's state lives in its own session and on its worker's
+ * stack. The working directory is per-process state, so every worker
+ * first unshares it with unshare(CLONE_FS). cd then moves only that
+ * worker. Everything the worker starts inherits its directory: pipeline
+ * built-in threads, posix_spawn'd children and zygote launches. Relative
+ * paths in redirections, globs and cat resolve against it too. Each new
+ * client starts back in the server's starting directory. Replies only go
+ * to the client's socket; the server's stdout only carries connection
+ * log lines.
+ *
+ * stop-server stops the accept loop, shuts down the read side of every
+ * other client's socket so its loop ends after the command it is
+ * running, and joins the pool.
+ */
+
+typedef struct rsh_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // a client was queued, or the pool is stopping
+    pthread_cond_t idle;     // a worker started or finished a client
+    int svr_socket;
+    int root_fd;             // directory every client starts in
+    int nthreads;
+    int started;             // workers that have set themselves up
+    int setup_err;           // errno of a worker's failed unshare
+    int *queue;              // accepted sockets waiting for a worker
+    int head;
+    int count;
+    int *active;             // each worker's client socket, -1 when idle
+    int busy;
+    int stopping;
+} rsh_pool_t;
+
+typedef struct rsh_worker {
+    rsh_pool_t *pool;
+    int slot;
+    pthread_t thread;
+} rsh_worker_t;
+
+/*
+ * pool_stop(pool)
+ *
+ * Stops accepting and asks every connected client's loop to end; caller
+ * holds the lock
+ */
+static void pool_stop(rsh_pool_t *pool) {
+    if (pool->stopping) {
+        return;
+    }
+    pool->stopping = 1;
+    shutdown(pool->svr_socket, SHUT_RDWR);     // wakes accept
+    for (int i = 0; i < pool->nthreads; i++) {
+        if (pool->active[i] >= 0) {
+            shutdown(pool->active[i], SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&pool->work);
+    pthread_cond_broadcast(&pool->idle);
+}
+
+/*
+ * serve_client(pool, sock)
+ *
+ * Runs one client's loop on the calling worker, from the server's
+ * starting directory. exec_client_requests closes the copy it is given;
+ * sock itself stays open so pool_stop can shut it down safely.
+ */
+static int serve_client(rsh_pool_t *pool, int sock) {
+    int conn = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+
+    if (conn < 0 || fchdir(pool->root_fd) < 0) {
+        perror("serve_client");
+        if (conn >= 0) {
+            close(conn);
+        }
+        return ERR_RDSH_SERVER;
+    }
+    return exec_client_requests(conn);
+}
+
+/*
+ * pool_worker(arg)
+ *
+ * Worker thread: takes accepted clients off the queue until the pool stops
+ */
+static void *pool_worker(void *arg) {
+    rsh_worker_t *w = arg;
+    rsh_pool_t *pool = w->pool;
+    int err = (unshare(CLONE_FS) == 0) ? 0 : errno;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->started++;
+    if (err) {
+        pool->setup_err = err;
+    }
+    pthread_cond_broadcast(&pool->idle);
+
+    while (!err) {
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        int sock = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->nthreads;
+        pool->count--;
+        pool->active[w->slot] = sock;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int rc = serve_client(pool, sock);
+
+        pthread_mutex_lock(&pool->lock);
+        close(sock);
+        pool->active[w->slot] = -1;
+        pool->busy--;
+        if (rc == OK_EXIT) {
+            printf("Server stopping per client request...\n");
+            pool_stop(pool);
+        } else {
+            printf("Client disconnected\n");
+        }
+        pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * process_cli_requests_threaded(svr_socket, nthreads)
+ *
+ * Accept loop for the threaded server. Falls back to process_cli_requests
+ * if the workers cannot get a working directory of their own.
+ */
+int process_cli_requests_threaded(int svr_socket, int nthreads) {
+    rsh_pool_t pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .work = PTHREAD_COND_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER,
+        .svr_socket = svr_socket,
+        .nthreads = nthreads,
+    };
+    rsh_worker_t *workers = calloc(nthreads, sizeof(rsh_worker_t));
+    int rc = OK_EXIT;
+    int created = 0;
+
+    pool.queue = malloc(nthreads * sizeof(int));
+    pool.active = malloc(nthreads * sizeof(int));
+    pool.root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (!workers || !pool.queue || !pool.active || pool.root_fd < 0) {
+        perror("process_cli_requests_threaded");
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+    for (; created < nthreads; created++) {
+        pool.active[created] = -1;
+        workers[created].pool = &pool;
+        workers[created].slot = created;
+        if (pthread_create(&workers[created].thread, NULL, pool_worker,
+                           &workers[created]) != 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.started < created) {
+        pthread_cond_wait(&pool.idle, &pool.lock);
+    }
+    int setup_err = pool.setup_err;
+    if (created < nthreads || setup_err) {
+        pool.stopping = 1;
+        pthread_cond_broadcast(&pool.work);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (created < nthreads || setup_err) {
+        fprintf(stderr, "warning: threaded mode unavailable (%s); serving one client at a time\n",
+                strerror(setup_err ? setup_err : EAGAIN));
+        for (int i = 0; i < created; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        created = 0;
+        rc = process_cli_requests(svr_socket);
+        goto out;
+    }
+
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        // Leave clients in the backlog until a worker can take them
+        pthread_mutex_lock(&pool.lock);
+        while (pool.busy + pool.count >= nthreads && !pool.stopping) {
+            pthread_cond_wait(&pool.idle, &pool.lock);
+        }
+        int stopping = pool.stopping;
+        pthread_mutex_unlock(&pool.lock);
+        if (stopping) {
+            break;
+        }
+
+        int client_socket = accept4(svr_socket, (struct sockaddr*)&client_addr, &client_len,
+                                    SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            pthread_mutex_lock(&pool.lock);
+            if (!pool.stopping) {
+                perror("accept");
+                rc = ERR_RDSH_COMMUNICATION;
+                pool_stop(&pool);
+            }
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        printf("Client connected from %s\n", client_ip);
+
+        pthread_mutex_lock(&pool.lock);
+        if (pool.stopping) {
+            close(client_socket);
+        } else {
+            pool.queue[(pool.head + pool.count) % nthreads] = client_socket;
+            pool.count++;
+            pthread_cond_signal(&pool.work);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+out:
+    for (int i = 0; i < created; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    // Clients accepted but never picked up
+    for (int i = 0; i < pool.count; i++) {
+        close(pool.queue[(pool.head + i) % nthreads]);
+    }
+    if (pool.root_fd >= 0) {
+        close(pool.root_fd);
+    }
+    free(pool.queue);
+    free(pool.active);
+    free(workers);
+    return rc;
+}
+
 /*
  * stop_server(svr_socket)
  *
@@ -137,16 +433,138 @@ int stop_server(int svr_socket) {
     return close(svr_socket);
 }
 
+/*
+ * rsh_error_text(rc, buf, len)
+ *
+ * The reply for a line that did not parse or expand; buf holds it when it
+ * needs formatting
+ */
+const char *rsh_error_text(int rc, char *buf, size_t len) {
+    if (rc == WARN_NO_CMDS) {
+        return CMD_WARN_NO_CMD;
+    } else if (rc == ERR_TOO_MANY_COMMANDS) {
+        snprintf(buf, len, CMD_ERR_PIPE_LIMIT, CMD_MAX);
+        return buf;
+    } else if (rc == ERR_CMD_OR_ARGS_TOO_BIG) {
+        snprintf(buf, len, CMD_ERR_ARGS_LIMIT, CMD_ARGV_MAX - 1);
+        return buf;
+    } else if (rc == ERR_CMD_ARGS_BAD) {
+        return CMD_ERR_SYNTAX;
+    } else if (rc == ERR_EXEC_CMD) {
+        return CMD_ERR_EXECUTE;
+    }
+    return "Error parsing command\n";
+}
+
+/*
+ * send_framed_reply(cli_socket, tag, msg, status)
+ *
+ * Sends a reply the server makes itself: msg, on stderr if status is
+ * nonzero, then the EXIT frame
+ */
+static int send_framed_reply(int cli_socket, uint16_t tag, const char *msg, int status) {
+    int channel = status ? RDSH_CH_STDERR : RDSH_CH_STDOUT;
+
+    if (rdsh_send_frame(cli_socket, RDSH_FRAME_DATA, channel, tag, msg, strlen(msg)) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return rdsh_send_exit(cli_socket, tag, status);
+}
+
+/*
+ * exec_framed_requests(cli_socket)
+ *
+ * Command loop for a client that opened with a HELLO frame. Each CMD frame
+ * is answered with DATA frames for its output and an EXIT frame with its
+ * status, all with its tag; commands read /dev/null. Frames a client sends
+ * ahead wait in the socket until their turn.
+ */
+static int exec_framed_requests(int cli_socket) {
+    rdsh_reader_t reader;
+    rdsh_frame_t frame;
+    command_list_t cmd_list;
+    int rc = rdsh_reader_init(&reader, cli_socket);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (rc != OK || null_fd < 0) {
+        rc = (rc != OK) ? rc : ERR_RDSH_SERVER;
+        goto out;
+    }
+    if (rdsh_read_frame(&reader, &frame) != 1 || rdsh_check_hello(&frame) < 1 ||
+        rdsh_send_hello(cli_socket) != OK) {
+        rc = ERR_RDSH_COMMUNICATION;
+        goto out;
+    }
+
+    while (1) {
+        int n = rdsh_read_frame(&reader, &frame);
+        if (n == 0) {
+            printf("Client closed connection\n");
+            rc = OK;
+            break;
+        }
+        if (n < 0 || frame.type != RDSH_FRAME_CMD) {
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+
+        // The payload is terminated in place; build_cmd_list copies it
+        rc = build_cmd_list(frame.payload, &cmd_list);
+        if (rc != OK) {
+            char error_msg[100];
+            rc = send_framed_reply(cli_socket, frame.tag,
+                                   rsh_error_text(rc, error_msg, sizeof(error_msg)),
+                                   rc != WARN_NO_CMDS);
+        } else if (cmd_list.background) {
+            rc = send_framed_reply(cli_socket, frame.tag, RDSH_ERR_NO_BG, 1);
+        } else {
+            const builtin_desc_t *bi = NULL;
+            if (cmd_list.num == 1) {
+                bi = builtin_lookup(cmd_list.commands[0].argv[0], BUILTIN_REMOTE);
+            }
+            if (bi && bi->id == BI_CMD_EXIT) {
+                send_framed_reply(cli_socket, frame.tag, "Exiting...\n", 0);
+                rc = OK;
+                free_cmd_list(&cmd_list);
+                break;
+            } else if (bi && bi->id == BI_CMD_STOP_SVR) {
+                send_framed_reply(cli_socket, frame.tag, "Stopping server...\n", 0);
+                rc = OK_EXIT;
+                free_cmd_list(&cmd_list);
+                break;
+            }
+            rc = rsh_execute_framed(cli_socket, &cmd_list, null_fd, frame.tag);
+        }
+        free_cmd_list(&cmd_list);
+        if (rc == ERR_RDSH_COMMUNICATION) {
+            break;
+        }
+    }
+
+out:
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    rdsh_reader_free(&reader);
+    return rc;
+}
+
 /*
  * exec_client_requests(cli_socket)
  *
  * Handles the execution of commands from a client
+ *
+ * Each request is parsed exactly once, into the client's session arena, so
+ * after the first command the loop makes no further heap allocations. A
+ * client whose first byte opens a HELLO frame is served by
+ * exec_framed_requests instead; see rsh_frame.c.
  */
 int exec_client_requests(int cli_socket) {
     char *io_buff = NULL;
     int recv_bytes;
-    int rc;
+    int rc = OK;
     command_list_t cmd_list;
+    dsh_session_t session;
     
     // Allocate buffer for communication
     io_buff = malloc(RDSH_COMM_BUFF_SZ);
@@ -154,94 +572,84 @@ int exec_client_requests(int cli_socket) {
         close(cli_socket);
         return ERR_MEMORY;
     }
+
+    // Every reply ends with a separate one-byte EOF send, which Nagle
+    // would hold back until the client's delayed ACK
+    int nodelay = 1;
+    setsockopt(cli_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    session_init(&session);
+    dsh_session_t *prev_session = session_enter(&session);
+
+    char first;
+    if (recv(cli_socket, &first, 1, MSG_PEEK) == 1 && first == RDSH_FRAME_HELLO) {
+        rc = exec_framed_requests(cli_socket);
+        goto out;
+    }
     
     // Process client commands
     while (1) {
         // Receive command from client
-        memset(io_buff, 0, RDSH_COMM_BUFF_SZ);
+        TRACE_BEGIN(recv_ns);
         recv_bytes = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
+        TRACE_END(recv_ns, "recv", recv_bytes);
         
         if (recv_bytes < 0) {
             perror("recv");
-            free(io_buff);
-            close(cli_socket);
-            return ERR_RDSH_COMMUNICATION;
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
         } else if (recv_bytes == 0) {
             // Client closed connection
             printf("Client closed connection\n");
-            free(io_buff);
-            close(cli_socket);
-            return OK;
+            rc = OK;
+            break;
         }
         
         // Ensure null termination
         io_buff[recv_bytes] = '\0';
         
-        // Check for exit commands
-        if (strcmp(io_buff, EXIT_CMD) == 0) {
-            send_message_string(cli_socket, "Exiting...\n");
-            free(io_buff);
-            close(cli_socket);
-            return OK;
-        } else if (strcmp(io_buff, "stop-server") == 0) {
-            send_message_string(cli_socket, "Stopping server...\n");
-            free(io_buff);
-            close(cli_socket);
-            return OK_EXIT;
+        // Parse the request once; built-ins and pipelines share the result
+        rc = build_cmd_list(io_buff, &cmd_list);
+        if (rc == OK &&
+            (rc = expand_cmd_list(&cmd_list, BUILTIN_REMOTE, cli_socket, NULL)) != OK) {
+            free_cmd_list(&cmd_list);
         }
         
-        // Check for built-in commands
-        cmd_buff_t cmd_buff;
-        if (alloc_cmd_buff(&cmd_buff) != OK) {
-            send_message_string(cli_socket, "Error: Memory allocation failed\n");
+        if (rc != OK) {
+            char error_msg[100];
+            send_message_string(cli_socket,
+                                (char *)rsh_error_text(rc, error_msg, sizeof(error_msg)));
             continue;
         }
-        
-        rc = build_cmd_buff(io_buff, &cmd_buff);
-        
-        if (rc != OK) {
-            if (rc == WARN_NO_CMDS) {
-                send_message_string(cli_socket, CMD_WARN_NO_CMD);
-            } else {
-                send_message_string(cli_socket, "Error parsing command\n");
-            }
-            free_cmd_buff(&cmd_buff);
+
+        // Output could not be told apart from later replies on the socket
+        if (cmd_list.background) {
+            send_message_string(cli_socket, RDSH_ERR_NO_BG);
+            free_cmd_list(&cmd_list);
             continue;
         }
-        
-        // Execute built-in command
-        Built_In_Cmds cmd_type = rsh_match_command(cmd_buff.argv[0]);
-        
-        if (cmd_type != BI_NOT_BI) {
-            rc = rsh_built_in_cmd(&cmd_buff);
-            
-            if (rc == BI_EXECUTED) {
-                send_message_eof(cli_socket);
-                free_cmd_buff(&cmd_buff);
-                continue;
-            }
+
+        // Control commands only apply to a single command; every other
+        // built-in runs through the pipeline so its output reaches the client
+        const builtin_desc_t *bi = NULL;
+        if (cmd_list.num == 1) {
+            bi = builtin_lookup(cmd_list.commands[0].argv[0], BUILTIN_REMOTE);
         }
-        
-        free_cmd_buff(&cmd_buff);
-        
-        // Parse command for execution
-        rc = build_cmd_list(io_buff, &cmd_list);
-        
-        if (rc != OK) {
-            if (rc == WARN_NO_CMDS) {
-                send_message_string(cli_socket, CMD_WARN_NO_CMD);
-            } else if (rc == ERR_TOO_MANY_COMMANDS) {
-                char error_msg[100];
-                snprintf(error_msg, sizeof(error_msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
-                send_message_string(cli_socket, error_msg);
-            } else {
-                send_message_string(cli_socket, "Error parsing command\n");
-            }
-            continue;
+
+        if (bi && bi->id == BI_CMD_EXIT) {
+            send_message_string(cli_socket, "Exiting...\n");
+            free_cmd_list(&cmd_list);
+            rc = OK;
+            break;
+        } else if (bi && bi->id == BI_CMD_STOP_SVR) {
+            send_message_string(cli_socket, "Stopping server...\n");
+            free_cmd_list(&cmd_list);
+            rc = OK_EXIT;
+            break;
         }
         
         // Execute the command pipeline
-        rc = rsh_execute_pipeline(cli_socket, &cmd_list);
+        rsh_execute_pipeline(cli_socket, &cmd_list);
         
         // Send EOF to signal end of command output
         send_message_eof(cli_socket);
@@ -249,11 +657,13 @@ int exec_client_requests(int cli_socket) {
         // Free command list resources
         free_cmd_list(&cmd_list);
     }
-    
-    // This should not be reached due to return statements in the loop
+
+out:
+    session_enter(prev_session);
+    session_destroy(&session);
     free(io_buff);
     close(cli_socket);
-    return OK;
+    return rc;
 }
 
 /*
@@ -262,7 +672,9 @@ int exec_client_requests(int cli_socket) {
  * Sends the EOF character to the client
  */
 int send_message_eof(int cli_socket) {
+    TRACE_BEGIN(send_ns);
     int bytes_sent = send(cli_socket, &RDSH_EOF_CHAR, 1, 0);
+    TRACE_END(send_ns, "send", bytes_sent);
     
     if (bytes_sent == 1) {
         return OK;
@@ -278,7 +690,9 @@ int send_message_eof(int cli_socket) {
  */
 int send_message_string(int cli_socket, char *buff) {
     int len = strlen(buff);
+    TRACE_BEGIN(send_ns);
     int bytes_sent = send(cli_socket, buff, len, 0);
+    TRACE_END(send_ns, "send", bytes_sent);
     
     if (bytes_sent != len) {
         return ERR_RDSH_COMMUNICATION;
@@ -296,171 +710,224 @@ int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
     if (!clist || clist->num == 0) {
         return WARN_NO_CMDS;
     }
+
+    uint64_t start_ns = monotonic_ns();
+    int timed = stats_begin(clist, BUILTIN_REMOTE);
+    if (clist->num == 0) {
+        stats_report(cli_sock, clist, NULL, start_ns, monotonic_ns());
+        return 0;
+    }
     
-    // Single command case (no pipes)
-    if (clist->num == 1) {
-        // Fork child process
-        pid_t pid = fork();
-        
-        if (pid < 0) {
-            // Fork failed
-            return ERR_EXEC_CMD;
-        } else if (pid == 0) {
-            // Child process
-            
-            // Redirect stdin, stdout, and stderr to client socket
-            dup2(cli_sock, STDIN_FILENO);
-            dup2(cli_sock, STDOUT_FILENO);
-            dup2(cli_sock, STDERR_FILENO);
-            
-            // Execute command
-            execvp(clist->commands[0].argv[0], clist->commands[0].argv);
-            
-            // If execvp returns, there was an error
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else {
-            // Parent process
-            int status;
-            waitpid(pid, &status, 0);
-            
-            return WIFEXITED(status) ? WEXITSTATUS(status) : ERR_EXEC_CMD;
-        }
+    // Scratch array lives in the session arena and goes back with the list
+    pipeline_stage_t *stages = arena_alloc(&current_session()->arena,
+                                           clist->num * sizeof(pipeline_stage_t));
+    if (!stages) {
+        return ERR_MEMORY;
+    }
+    memset(stages, 0, clist->num * sizeof(pipeline_stage_t));
+    for (int i = 0; i < clist->num; i++) {
+        stages[i].timed = timed;
     }
     
-    // Multiple commands case (pipes)
-    int pipes[CMD_MAX-1][2];
-    pid_t pids[CMD_MAX];
+    // The first stage reads from the client socket, the last writes stdout
+    // and every stage writes stderr back to it
+    launch_fds_t ends = { cli_sock, cli_sock, cli_sock };
+    launch_pipeline(clist, &ends, BUILTIN_REMOTE, stages);
     
-    // Create pipes
-    for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) < 0) {
-            perror("pipe");
-            return ERR_EXEC_CMD;
-        }
+    // Wait for all stages; see wait_pipeline for how the status is chosen
+    int status = 0;
+    wait_pipeline(stages, clist->num, &status);
+    if (timed) {
+        stats_report(cli_sock, clist, stages, start_ns, monotonic_ns());
     }
+    TRACE_END(start_ns, "pipeline", clist->num);
     
-    // Execute commands in pipeline
-    for (int i = 0; i < clist->num; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            // Fork failed
-            perror("fork");
-            return ERR_EXEC_CMD;
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // First process: stdin from client socket
-            if (i == 0) {
-                dup2(cli_sock, STDIN_FILENO);
-            } else {
-                // Not first process: stdin from previous pipe
-                dup2(pipes[i-1][0], STDIN_FILENO);
+    return status;
+}
+
+/*
+ * rsh_fits_pipe(cmd, pipe_fd)
+ *
+ * Whether cmd is a BUILTIN_BOUNDED built-in whose output, with its error
+ * messages, fits in the empty pipe pipe_fd, so it can run with nobody
+ * reading the pipe yet
+ */
+int rsh_fits_pipe(cmd_buff_t *cmd, int pipe_fd) {
+    const builtin_desc_t *bi = builtin_lookup(cmd->argv[0], BUILTIN_REMOTE);
+    size_t bytes = PATH_MAX + 256;
+
+    if (!bi || !(bi->flags & BUILTIN_BOUNDED)) {
+        return 0;
+    }
+    for (int i = 0; i < cmd->argc; i++) {
+        bytes += strlen(cmd->argv[i]) + 1;
+    }
+    int cap = fcntl(pipe_fd, F_GETPIPE_SZ);
+    return cap > 0 && bytes <= (size_t)cap;
+}
+
+// Output relay of a framed command, on its own thread
+typedef struct frame_relay {
+    int sock;
+    int fds[2];              // read ends: stdout, stderr
+    uint16_t tag;
+    int failed;              // the socket failed; output is discarded
+} frame_relay_t;
+
+/*
+ * frame_relay_thread(arg)
+ *
+ * Sends a command's stdout and stderr as DATA frames until both pipes
+ * reach EOF
+ */
+static void *frame_relay_thread(void *arg) {
+    frame_relay_t *r = arg;
+    struct pollfd pfds[2] = {
+        { .fd = r->fds[0], .events = POLLIN },
+        { .fd = r->fds[1], .events = POLLIN },
+    };
+    int open_fds = 2;
+    char sink[RDSH_COMM_BUFF_SZ];
+
+    while (open_fds > 0) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            
-            // Last process: stdout/stderr to client socket
-            if (i == clist->num - 1) {
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
+            break;
+        }
+        for (int k = 0; k < 2; k++) {
+            if (pfds[k].fd < 0 || !pfds[k].revents) {
+                continue;
+            }
+            int n;
+            if (r->failed) {
+                n = read(pfds[k].fd, sink, sizeof(sink));
             } else {
-                // Not last process: stdout to next pipe
-                dup2(pipes[i][1], STDOUT_FILENO);
+                n = rdsh_relay_chunk(pfds[k].fd, r->sock,
+                                     k ? RDSH_CH_STDERR : RDSH_CH_STDOUT, r->tag);
+                r->failed = (n < 0);
             }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            if (n == 0) {
+                pfds[k].fd = -1;
+                open_fds--;
             }
-            
-            // Execute command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, there was an error
-            perror("execvp");
-            exit(EXIT_FAILURE);
         }
     }
-    
-    // Close all pipe file descriptors in parent
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    return NULL;
+}
+
+/*
+ * rsh_execute_framed(cli_sock, clist, in_fd, tag)
+ *
+ * Runs a pipeline for a framed client: its stdout and stderr go to pipes
+ * a relay thread forwards as DATA frames, and the EXIT frame follows once
+ * both are drained. A lone bounded built-in with nothing to expand cannot
+ * fill the pipes, so it runs first and this thread relays after. Returns
+ * OK, or ERR_RDSH_COMMUNICATION if the client is gone.
+ */
+int rsh_execute_framed(int cli_sock, command_list_t *clist, int in_fd, uint16_t tag) {
+    int out[2] = { -1, -1 };
+    int err[2] = { -1, -1 };
+    int status = 1;
+    pthread_t relay;
+
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0) {
+        for (int k = 0; k < 2; k++) {
+            if (out[k] >= 0) {
+                close(out[k]);
+            }
+        }
+        return send_framed_reply(cli_sock, tag, "error: out of descriptors\n", 1);
     }
-    
-    // Wait for all processes to complete
-    int last_status = 0;
-    for (int i = 0; i < clist->num; i++) {
-        int status;
-        waitpid(pids[i], &status, 0);
-        
-        // Store exit status of last command in pipeline
-        if (i == clist->num - 1) {
-            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : ERR_EXEC_CMD;
+    frame_relay_t r = { cli_sock, { out[0], err[0] }, tag, 0 };
+    int direct = !clist->expand && clist->num == 1 &&
+                 rsh_fits_pipe(&clist->commands[0], out[1]);
+    if (!direct && pthread_create(&relay, NULL, frame_relay_thread, &r) != 0) {
+        for (int k = 0; k < 2; k++) {
+            close(out[k]);
+            close(err[k]);
         }
+        return send_framed_reply(cli_sock, tag, "error: out of threads\n", 1);
     }
-    
-    return last_status;
+
+    uint64_t start_ns = monotonic_ns();
+    int rc = expand_cmd_list(clist, BUILTIN_REMOTE, err[1], NULL);
+    if (rc != OK) {
+        char error_msg[100];
+        dprintf(err[1], "%s", rsh_error_text(rc, error_msg, sizeof(error_msg)));
+    } else {
+        int timed = stats_begin(clist, BUILTIN_REMOTE);
+        pipeline_stage_t *stages = NULL;
+
+        status = 0;
+        if (clist->num > 0) {
+            stages = arena_alloc(&current_session()->arena,
+                                 clist->num * sizeof(pipeline_stage_t));
+        }
+        if (clist->num > 0 && !stages) {
+            dprintf(err[1], "error: out of memory\n");
+            status = 1;
+        } else if (clist->num > 0) {
+            memset(stages, 0, clist->num * sizeof(pipeline_stage_t));
+            for (int i = 0; i < clist->num; i++) {
+                stages[i].timed = timed;
+            }
+            launch_fds_t ends = { in_fd, out[1], err[1] };
+            launch_pipeline(clist, &ends, BUILTIN_REMOTE, stages);
+            wait_pipeline(stages, clist->num, &status);
+        }
+        if (timed) {
+            stats_report(err[1], clist, stages, start_ns, monotonic_ns());
+        }
+    }
+
+    // The relay ends once the last writers, these, are gone
+    close(out[1]);
+    close(err[1]);
+    if (direct) {
+        frame_relay_thread(&r);
+    } else {
+        pthread_join(relay, NULL);
+    }
+    close(out[0]);
+    close(err[0]);
+    TRACE_END(start_ns, "pipeline", clist->num);
+
+    if (r.failed) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return rdsh_send_exit(cli_sock, tag, status);
 }
 
 /*
  * rsh_match_command(const char *input)
  *
- * Matches input against built-in commands
+ * Matches input against the built-in commands available to clients
  */
 Built_In_Cmds rsh_match_command(const char *input) {
-    if (!input) return BI_NOT_BI;
-    
-    if (strcmp(input, EXIT_CMD) == 0) {
-        return BI_CMD_EXIT;
-    } else if (strcmp(input, "cd") == 0) {
-        return BI_CMD_CD;
-    } else if (strcmp(input, "dragon") == 0) {
-        return BI_CMD_DRAGON;
-    } else if (strcmp(input, "stop-server") == 0) {
-        return BI_CMD_STOP_SVR;
-    }
-    
-    return BI_NOT_BI;
+    const builtin_desc_t *bi = builtin_lookup(input, BUILTIN_REMOTE);
+
+    return bi ? bi->id : BI_NOT_BI;
 }
 
 /*
  * rsh_built_in_cmd(cmd_buff_t *cmd)
  *
- * Executes built-in commands
+ * Executes built-in commands with the server's own stdio
  */
 Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd) {
     if (!cmd || cmd->argc == 0 || !cmd->argv[0]) return BI_NOT_BI;
     
-    Built_In_Cmds cmd_type = rsh_match_command(cmd->argv[0]);
-    
-    switch (cmd_type) {
-        case BI_CMD_EXIT:
-            return BI_CMD_EXIT;
-            
-        case BI_CMD_STOP_SVR:
-            return BI_CMD_STOP_SVR;
-            
-        case BI_CMD_CD:
-            if (cmd->argc > 1) {
-                if (chdir(cmd->argv[1]) != 0) {
-                    perror("cd");
-                }
-            } else {
-                // Change to home directory if no argument
-                const char *home = getenv("HOME");
-                if (home && chdir(home) != 0) {
-                    perror("cd");
-                }
-            }
-            return BI_EXECUTED;
-            
-        case BI_CMD_DRAGON:
-            printf("Here be dragons!\n");
-            return BI_EXECUTED;
-            
-        default:
-            return BI_NOT_BI;
-    }
-}
\ No newline at end of file
+    const builtin_desc_t *bi = builtin_lookup(cmd->argv[0], BUILTIN_REMOTE);
+    if (!bi) {
+        return BI_NOT_BI;
+    }
+    if (!bi->fn) {
+        return bi->id;       // exit and stop-server
+    }
+
+    launch_fds_t fds = { -1, -1, -1 };
+    run_builtin(bi, cmd, &fds);
+    return BI_EXECUTED;
+}
@@ -15,6 +15,66 @@ static const char RDSH_EOF_CHAR = 0x04;
 #define RDSH_DEF_SVR_INTFACE    "0.0.0.0"   // Default start all interfaces
 #define RDSH_DEF_CLI_CONNECT    "127.0.0.1" // Default server is running on localhost
 #define RDSH_COMM_BUFF_SZ       4096        // Default communication buffer size
+#define RDSH_POOL_THREADS       16          // Clients served at once with -x
+#define RDSH_DEF_BACKLOG        4096        // Default listen backlog (-b)
+
+// How start_server serves clients
+#define RDSH_SERVER_SINGLE      0           // One client at a time
+#define RDSH_SERVER_THREADED    1           // A thread per client (-x)
+#define RDSH_SERVER_EVENT       2           // One epoll loop for all (-E)
+
+// Sent when a client ends a line with '&'
+#define RDSH_ERR_NO_BG "error: background jobs are not supported remotely\n"
+
+//
+// Framed protocol (rsh_frame.c)
+//
+// A client that opens with a HELLO frame is answered in frames; any other
+// first byte selects the legacy protocol above. Every frame is a header
+// followed by len bytes of payload:
+//
+//   byte 0      type      RDSH_FRAME_*
+//   byte 1      channel   RDSH_CH_* for DATA frames, 0 otherwise
+//   bytes 2-3   tag       chosen by the client per CMD frame and repeated on
+//                         every frame of its reply, big-endian
+//   bytes 4-7   len       payload length, big-endian
+//
+#define RDSH_PROTO_VERSION      2       // 2: replies carry their command's tag
+#define RDSH_PROTO_MAGIC        "RDSH"
+#define RDSH_FRAME_HDR_SZ       8
+#define RDSH_HELLO_SZ           (RDSH_FRAME_HDR_SZ + 5)     // magic and version
+#define RDSH_FRAME_MAX          (1024 * 1024)   // longest payload accepted
+#define RDSH_FRAME_DATA_MAX     65536           // longest DATA payload sent
+
+#define RDSH_FRAME_HELLO        0x7f    // first frame each way
+#define RDSH_FRAME_CMD          0x01    // client: one command line, unterminated
+#define RDSH_FRAME_DATA         0x02    // server: command output on a channel
+#define RDSH_FRAME_EXIT         0x03    // server: reply done; big-endian int32 status
+
+#define RDSH_CH_STDOUT          1
+#define RDSH_CH_STDERR          2
+
+// Commands a script client keeps in flight; tags must not wrap within it
+#define RDSH_PIPELINE_WINDOW    1024
+
+typedef struct rdsh_frame {
+    int type;
+    int channel;
+    uint16_t tag;
+    uint32_t len;
+    char *payload;          // in the buffer it was parsed from
+} rdsh_frame_t;
+
+// Reassembles frames from a blocking socket
+typedef struct rdsh_reader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;           // first byte not yet handed out
+    size_t end;
+    char saved;             // byte under the last payload's terminator
+    int held;               // whether saved needs putting back
+} rdsh_reader_t;
 
 //
 // Remote shell error codes
@@ -24,24 +84,51 @@ static const char RDSH_EOF_CHAR = 0x04;
 #define ERR_RDSH_SERVER       102   // Server error
 #define ERR_RDSH_COMMUNICATION 103  // Communication error between client/server
 
+//
+// Framed protocol function prototypes
+//
+void rdsh_pack_hdr(char hdr[RDSH_FRAME_HDR_SZ], int type, int channel, uint16_t tag,
+                   uint32_t len);
+void rdsh_pack_hello(char frame[RDSH_HELLO_SZ]);
+ssize_t rdsh_parse_frame(char *buf, size_t len, rdsh_frame_t *f);
+int rdsh_check_hello(const rdsh_frame_t *f);
+int rdsh_send_frame(int sock, int type, int channel, uint16_t tag, const void *data,
+                    uint32_t len);
+int rdsh_send_hello(int sock);
+int rdsh_send_exit(int sock, uint16_t tag, int status);
+int rdsh_relay_chunk(int pipe_fd, int sock, int channel, uint16_t tag);
+int rdsh_reader_init(rdsh_reader_t *r, int fd);
+int rdsh_reader_fill(rdsh_reader_t *r);
+int rdsh_next_frame(rdsh_reader_t *r, rdsh_frame_t *f);
+int rdsh_read_frame(rdsh_reader_t *r, rdsh_frame_t *f);
+void rdsh_reader_free(rdsh_reader_t *r);
+
 //
 // Remote shell client function prototypes
 //
 int exec_remote_cmd_loop(char *address, int port);
+int exec_remote_script(char *address, int port, const char *path, int fail_fast);
 int start_client(char *server_ip, int port);
 int client_cleanup(int cli_socket, char *cmd_buff, char *rsp_buff, int rc);
 
 //
 // Remote shell server function prototypes
 //
-int start_server(char *ifaces, int port, int is_threaded);
-int boot_server(char *ifaces, int port);
+int start_server(char *ifaces, int port, int mode, int backlog, int workers);
+int start_prefork_server(char *ifaces, int port, int mode, int backlog, int workers);
+int boot_server(char *ifaces, int port, int backlog, int reuseport);
+int serve_requests(int svr_socket, int mode);
 int process_cli_requests(int svr_socket);
+int process_cli_requests_threaded(int svr_socket, int nthreads);
+int process_cli_requests_event(int svr_socket);
 int stop_server(int svr_socket);
 int exec_client_requests(int cli_socket);
 int send_message_eof(int cli_socket);
 int send_message_string(int cli_socket, char *buff);
 int rsh_execute_pipeline(int cli_sock, command_list_t *clist);
+int rsh_execute_framed(int cli_sock, command_list_t *clist, int in_fd, uint16_t tag);
+int rsh_fits_pipe(cmd_buff_t *cmd, int pipe_fd);
+const char *rsh_error_text(int rc, char *buf, size_t len);
 
 //
 // Remote shell built-in command function prototypes
@@ -0,0 +1,84 @@
+/*
+ * gen_builtin_hash.c
+ *
+ * Build-time generator for builtin_hash.h. Collects the names in
+ * builtins.def and searches for a seed that makes builtin_name_hash
+ * collision-free over them in a power-of-two table at least twice the
+ * size of the registry, then prints the seed and the slot -> entry map.
+ *
+ *   ./tools/gen_builtin_hash > builtin_hash.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dshlib.h"
+
+static const char *names[] = {
+#define BUILTIN(name, id, fn, flags) name,
+#include "../builtins.def"
+#undef BUILTIN
+};
+
+#define NUM_NAMES (sizeof(names) / sizeof(names[0]))
+#define MAX_TRIES 1000000u
+
+/*
+ * try_seed(seed, nslots, slots)
+ *
+ * Fills slots and returns 1 if seed places every name in its own slot
+ */
+static int try_seed(uint32_t seed, unsigned nslots, int *slots) {
+    for (unsigned i = 0; i < nslots; i++) {
+        slots[i] = -1;
+    }
+    for (unsigned i = 0; i < NUM_NAMES; i++) {
+        unsigned s = builtin_name_hash(seed, names[i]) & (nslots - 1);
+        if (slots[s] >= 0) {
+            return 0;
+        }
+        slots[s] = (int)i;
+    }
+    return 1;
+}
+
+int main(void) {
+    size_t max_len = 0;
+    unsigned nslots = 8;
+
+    for (unsigned i = 0; i < NUM_NAMES; i++) {
+        if (strlen(names[i]) > max_len) {
+            max_len = strlen(names[i]);
+        }
+    }
+    while (nslots < 2 * NUM_NAMES) {
+        nslots *= 2;
+    }
+
+    for (;; nslots *= 2) {
+        int *slots = malloc(nslots * sizeof(int));
+        if (!slots) {
+            fprintf(stderr, "gen_builtin_hash: out of memory\n");
+            return EXIT_FAILURE;
+        }
+        for (uint32_t seed = BUILTIN_HASH_BASIS; seed != BUILTIN_HASH_BASIS + MAX_TRIES; seed++) {
+            if (!try_seed(seed, nslots, slots)) {
+                continue;
+            }
+            printf("/* Generated by tools/gen_builtin_hash from builtins.def; do not edit */\n");
+            printf("#ifndef __BUILTIN_HASH_H__\n#define __BUILTIN_HASH_H__\n\n");
+            printf("#define BUILTIN_HASH_SEED  0x%08xu\n", seed);
+            printf("#define BUILTIN_HASH_SLOTS %u\n", nslots);
+            printf("#define BUILTIN_NAME_MAX   %zu\n\n", max_len);
+            printf("// Index into builtins.def for each slot, -1 if empty\n");
+            printf("static const signed char builtin_hash_slots[BUILTIN_HASH_SLOTS] = {");
+            for (unsigned i = 0; i < nslots; i++) {
+                printf("%s%s%d", i ? "," : "", (i % 16) ? " " : "\n    ", slots[i]);
+            }
+            printf("\n};\n\n#endif // __BUILTIN_HASH_H__\n");
+            free(slots);
+            return EXIT_SUCCESS;
+        }
+        free(slots);
+    }
+}